@@ -1,124 +1,472 @@
 #include <algorithm>
 #include <android/log.h>
-#include <cmath>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
 #include <jni.h>
+#include <memory>
 #include <mutex>
-#include <random>
+#include <shared_mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "llama/ggml-backend.h"
+#include "llama/ggml-cpu.h"
 #include "llama/llama.h"
+#include "llm/llm_bench.h"
+#include "llm/llm_chat.h"
+#include "llm/llm_ctx_profile.h"
+#include "llm/llm_embed.h"
+#include "llm/llm_grammar.h"
+#include "llm/llm_gguf.h"
+#include "llm/llm_lora.h"
+#include "llm/llm_metrics.h"
+#include "llm/llm_prefetch.h"
+#include "llm/llm_prompt_cache.h"
+#include "llm/llm_scheduler.h"
+#include "llm/llm_session.h"
+#include "llm/llm_speculative.h"
+#include "llm/llm_utf8.h"
 
 #define LOG_TAG "LLM_DEBUG"
 #define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
 
-static std::mutex g_mutex;
+// Number of concurrent sequences the scheduler decodes together: the
+// default, and the most setParallelSlots allows
+#define LLM_N_SLOTS   4
+#define LLM_MAX_SLOTS 16
+
+// Streaming: pending pieces are handed to Kotlin once this long has passed
+// since the previous callback, or as soon as this many bytes are queued
+#define LLM_STREAM_FLUSH_MS    30
+#define LLM_STREAM_FLUSH_BYTES 64
+
+// Guards the model lifecycle. Requests hold it shared for their whole
+// duration; load/unload take it exclusively, which drains in-flight work.
+static std::shared_mutex g_mutex;
 
 static llama_model *g_model = nullptr;
 static llama_context *g_ctx = nullptr;
 static const llama_vocab *g_vocab = nullptr;
+static double g_load_ms = 0.0;   // wall time of the last llama_model_load_from_file
+
+// Optional draft model for speculative decoding; shares the slots' seq ids
+static llama_model *g_draft_model = nullptr;
+static llama_context *g_draft_ctx = nullptr;
 
 static llama_context_params g_cparams{};
-static int32_t g_pos = 0;
+static const LlmCtxProfile *g_ctx_profile = nullptr;   // of the live context
+static int g_n_slots = 0;                              // of the live scheduler
+static std::atomic<int32_t> g_n_threads{0};
+static std::atomic<int32_t> g_n_threads_batch{0};
+
+// Persistent ggml threadpool, created once per model and sized to the core
+// count; the live thread counts only select how many of its workers run.
+static ggml_threadpool_t g_threadpool = nullptr;
+static std::atomic<int32_t> g_threadpool_size{0};   // read by setThreads unlocked
+static decltype(ggml_threadpool_free) *g_threadpool_free_fn = nullptr;
 static llama_token g_token_bos = -1;
 static llama_token g_token_eos = -1;
 
-// ---------------- Scoped Lock ----------------
-struct ScopedLock {
-    std::mutex &m;
-    explicit ScopedLock(std::mutex &m_) : m(m_) { m.lock(); }
-    ~ScopedLock() { m.unlock(); }
-};
+// kotlin.jvm.functions.Function1.invoke, resolved on first use
+static jmethodID g_invoke_method = nullptr;
 
 // ---------------- Helpers ----------------
+// Standard UTF-8 of a jstring. GetStringUTFChars yields modified UTF-8,
+// which encodes emoji as two 3-byte surrogates, so encode the UTF-16 here.
 static std::string jstring_to_std(JNIEnv *env, jstring js) {
     if (!js) return {};
-    const char *utf = env->GetStringUTFChars(js, nullptr);
-    std::string out(utf ? utf : "");
-    if (utf) env->ReleaseStringUTFChars(js, utf);
+    const jsize n = env->GetStringLength(js);
+    std::vector<jchar> utf16(n);
+    env->GetStringRegion(js, 0, n, utf16.data());
+    std::string out;
+    out.reserve(n);
+    for (jsize i = 0; i < n; ++i) {
+        uint32_t cp = utf16[i];
+        if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < n &&
+            utf16[i + 1] >= 0xDC00 && utf16[i + 1] < 0xE000) {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (utf16[++i] - 0xDC00);
+        } else if (cp >= 0xD800 && cp < 0xE000) {
+            cp = 0xFFFD;   // unpaired surrogate
+        }
+        if (cp < 0x80) {
+            out += (char)cp;
+        } else if (cp < 0x800) {
+            out += (char)(0xC0 | (cp >> 6));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += (char)(0xE0 | (cp >> 12));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        } else {
+            out += (char)(0xF0 | (cp >> 18));
+            out += (char)(0x80 | ((cp >> 12) & 0x3F));
+            out += (char)(0x80 | ((cp >> 6) & 0x3F));
+            out += (char)(0x80 | (cp & 0x3F));
+        }
+    }
+    llm_metrics_add(LlmCounter::JniCopyBytes, n * sizeof(jchar) + out.size());
     return out;
 }
 
-// Select template based on loaded model
-static std::string select_template_for_model() {
-    if (!g_model) {
-        // Safe fallback
-        return
-                "### Instruction:\n"
-                "{prompt}\n"
-                "\n"
-                "### Response:\n";
+// Build a jstring from standard UTF-8. NewStringUTF expects modified UTF-8 and
+// rejects 4-byte sequences (emoji), so decode to UTF-16 ourselves.
+static jstring utf8_to_jstring(JNIEnv *env, const char *s, size_t n) {
+    std::vector<jchar> out;
+    out.reserve(n);
+    size_t i = 0;
+    while (i < n) {
+        unsigned char c = (unsigned char)s[i];
+        uint32_t cp = 0xFFFD;
+        size_t len = 1;
+        if (c < 0x80) {
+            cp = c;
+        } else if ((c & 0xE0) == 0xC0) {
+            len = 2; cp = c & 0x1F;
+        } else if ((c & 0xF0) == 0xE0) {
+            len = 3; cp = c & 0x0F;
+        } else if ((c & 0xF8) == 0xF0) {
+            len = 4; cp = c & 0x07;
+        }
+        if (len > 1) {
+            if (i + len > n) {
+                cp = 0xFFFD;
+                len = n - i;
+            } else {
+                for (size_t k = 1; k < len; ++k) {
+                    unsigned char cc = (unsigned char)s[i + k];
+                    if ((cc & 0xC0) != 0x80) { cp = 0xFFFD; len = k; break; }
+                    cp = (cp << 6) | (cc & 0x3F);
+                }
+            }
+        }
+        if (cp >= 0x10000) {
+            cp -= 0x10000;
+            out.push_back((jchar)(0xD800 + (cp >> 10)));
+            out.push_back((jchar)(0xDC00 + (cp & 0x3FF)));
+        } else {
+            out.push_back((jchar)cp);
+        }
+        i += len;
     }
+    // Decoded here, then copied again by NewString
+    llm_metrics_add(LlmCounter::JniCopyBytes, 2 * out.size() * sizeof(jchar));
+    return env->NewString(out.data(), (jsize)out.size());
+}
 
-    char buf[256];
-    buf[0] = '\0';
-    llama_model_desc(g_model, buf, sizeof(buf));
-    std::string name = buf;
+// Anything that can carry model output or client text (names, paths,
+// grammars) goes through here, never NewStringUTF
+static jstring utf8_to_jstring(JNIEnv *env, const std::string &s) {
+    return utf8_to_jstring(env, s.data(), s.size());
+}
+
+// ---------------- Threadpool ----------------
+// ggml_threadpool_new/free live in the CPU backend, which may be a separately
+// loaded library, so they are resolved through the backend registry.
+static void create_threadpool() {
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_dev) {
+        LOGD("No CPU backend device, using llama's default threadpool");
+        return;
+    }
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpu_dev);
+    auto *new_fn = (decltype(ggml_threadpool_new) *)
+            ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+    g_threadpool_free_fn = (decltype(ggml_threadpool_free) *)
+            ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+    if (!new_fn || !g_threadpool_free_fn) {
+        LOGD("Threadpool API not exported by the CPU backend");
+        return;
+    }
+
+    int n_cores = (int)std::thread::hardware_concurrency();
+    g_threadpool_size = std::max(1, std::min(n_cores, GGML_MAX_N_THREADS));
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(g_threadpool_size);
+    g_threadpool = new_fn(&tpp);
+    if (!g_threadpool) {
+        LOGD("Failed to create threadpool");
+        g_threadpool_size = 0;
+        return;
+    }
+    LOGD("Threadpool created with %d workers", g_threadpool_size.load());
+}
+
+static void free_threadpool() {
+    if (g_threadpool && g_threadpool_free_fn) {
+        g_threadpool_free_fn(g_threadpool);
+    }
+    g_threadpool = nullptr;
+    g_threadpool_size = 0;
+}
 
-    std::string lower = name;
-    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+static int32_t clamp_threads(int32_t n) {
+    if (n <= 0) n = 1;
+    const int32_t size = g_threadpool_size.load();
+    if (size > 0 && n > size) n = size;
+    return n;
+}
+
+// ---------------- Model staging ----------------
+// A model and its contexts, built outside the live globals so that the
+// current model keeps serving while the next one loads (see swapModel).
+struct StagedModel {
+    llama_model   *model       = nullptr;
+    llama_context *ctx         = nullptr;
+    llama_model   *draft_model = nullptr;   // optional, for speculative decoding
+    llama_context *draft_ctx   = nullptr;
+    llama_context_params cparams{};
+    const LlmCtxProfile *profile = nullptr;
+    double load_ms = 0.0;
+    int n_slots = LLM_N_SLOTS;
+    std::vector<std::shared_ptr<LlmLora>> loras;   // adapters loaded into `model`
+};
 
-    if (lower.find("tiny") != std::string::npos ||
-        lower.find("llama") != std::string::npos ||
-        lower.find("chat") != std::string::npos) {
+// Longest token piece of the live vocabulary (0: not computed yet), for
+// sizing direct output buffers
+static std::atomic<int32_t> g_max_piece_bytes{0};
 
-        return
-                "### Instruction:\n"
-                "{prompt}\n"
-                "\n"
-                "### Response:\n";
+// Cold start options, applied to the next load or swap
+struct StartupOptions {
+    bool prefetch = true;    // read the tensor data into the page cache in parallel
+    bool mlock    = false;   // pin the weights (needs RLIMIT_MEMLOCK headroom)
+    bool warmup   = true;    // one decode through every layer before going live
+};
+
+// Timings of the last load or swap, reported by getStartupStats
+struct StartupStats {
+    double   ready_ms    = 0.0;   // load/swap call -> scheduler serving
+    double   prefetch_ms = 0.0;
+    uint64_t prefetch_bytes = 0;
+    double   warmup_ms   = 0.0;
+};
+
+static StartupOptions g_startup;        // guarded by g_load_mutex
+// Context profile of the next load or swap (nullptr: the default profile)
+// and an n_ctx override (0: the profile's). Guarded by g_load_mutex.
+static const LlmCtxProfile *g_next_profile = nullptr;
+static uint32_t g_next_n_ctx = 0;
+static int g_next_n_slots = LLM_N_SLOTS;   // guarded by g_load_mutex
+static StartupStats   g_startup_stats;  // guarded by g_load_mutex
+
+// Serializes load, swap and unload. Unlike g_mutex it is held while a model
+// is staged, so requests keep running meanwhile.
+static std::mutex g_load_mutex;
+// Progress of the model load in flight, 0..1, from llama's progress_callback
+static std::atomic<float> g_load_progress{0.0f};
+// Bumped by unloadModel before it waits for g_load_mutex: a load or swap
+// called earlier is abandoned instead of finishing only to be freed
+static std::atomic<uint64_t> g_unload_gen{0};
+
+// user_data is the g_unload_gen the load started under; returning false
+// makes llama abort the load
+static bool on_load_progress(float progress, void *user_data) {
+    g_load_progress.store(progress, std::memory_order_relaxed);
+    return *(const uint64_t *)user_data == g_unload_gen.load();
+}
+
+static void free_staged(StagedModel &m) {
+    if (m.draft_ctx) llama_free(m.draft_ctx);
+    if (m.draft_model) llama_model_free(m.draft_model);
+    if (m.ctx) llama_free(m.ctx);
+    if (m.model) llama_model_free(m.model);
+    m = StagedModel{};
+}
+
+// One decode of a single token, then forget it: the first real request does
+// not pay for graph allocation and weight page faults
+static void warmup(llama_context *ctx) {
+    const llama_vocab *vocab = llama_model_get_vocab(llama_get_model(ctx));
+    llama_token tok = llama_vocab_bos(vocab);
+    if (tok == LLAMA_TOKEN_NULL) tok = 0;
+    llama_decode(ctx, llama_batch_get_one(&tok, 1));
+    llama_memory_clear(llama_get_memory(ctx), true);
+}
+
+// Load the draft model with the target's context shape. Failure only
+// disables speculation.
+static void load_draft(StagedModel &m, const std::string &path) {
+    llama_model_params mparams = llama_model_default_params();
+    m.draft_model = llama_model_load_from_file(path.c_str(), mparams);
+    if (!m.draft_model) {
+        LOGD("Failed to load draft model, speculation disabled");
+        return;
+    }
+    m.draft_ctx = llama_init_from_model(m.draft_model, m.cparams);
+    if (!m.draft_ctx) {
+        LOGD("Failed to initialize draft context, speculation disabled");
+        llama_model_free(m.draft_model);
+        m.draft_model = nullptr;
+        return;
     }
+    LOGD("Draft model loaded");
+}
 
-    // TinyLlama / Alpaca / Vicuna style
-    if (lower.find("tinyllama") != std::string::npos ||
-        lower.find("vicuna")    != std::string::npos ||
-        lower.find("alpaca")    != std::string::npos) {
-        return "### Instruction:\n"
-               "{prompt}\n"
-               "\n"
-               "### Response:\n";    }
+// Load `path` (plus an optional draft) into `m`, create its context and warm
+// it up. Touches no live state, so it may run while the scheduler serves.
+// Gives up once g_unload_gen moves past `unload_gen`.
+static bool stage_model(StagedModel &m, const std::string &path,
+                        const std::string &draft_path, int32_t n_threads,
+                        uint64_t unload_gen) {
+    auto unloaded = [unload_gen] {
+        if (g_unload_gen.load() == unload_gen) return false;
+        LOGD("Load abandoned: model unloaded meanwhile");
+        return true;
+    };
+    if (unloaded()) return false;
+    LOGD("Model path: %s", path.c_str());
+    g_load_progress = 0.0f;
 
-    // CodeLlama / LLaMA-2 Instruct style
-    if (lower.find("codellama") != std::string::npos ||
-        lower.find("llama-2")   != std::string::npos) {
-        return "[INST] {prompt} [/INST]";
+    // Page the weights in on a few threads while llama maps the file
+    LlmPrefetch prefetch;
+    if (g_startup.prefetch) {
+        llm_prefetch_begin(prefetch, path,
+                           std::min(4, (int)std::thread::hardware_concurrency()));
     }
 
-    // LLaMA-3 / Mistral / Gemma / Qwen chat-style
-    if (lower.find("llama-3") != std::string::npos ||
-        lower.find("mistral") != std::string::npos ||
-        lower.find("gemma")   != std::string::npos ||
-        lower.find("qwen")    != std::string::npos) {
-        return "<|user|>\n{prompt}\n<|assistant|>\n";
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = false;
+    mparams.use_mmap   = true;
+    mparams.use_mlock  = g_startup.mlock;
+    mparams.progress_callback = on_load_progress;
+    mparams.progress_callback_user_data = &unload_gen;
+
+    const auto t_load = std::chrono::steady_clock::now();
+    m.model = llama_model_load_from_file(path.c_str(), mparams);
+    g_startup_stats.prefetch_ms    = llm_prefetch_wait(prefetch);
+    g_startup_stats.prefetch_bytes = prefetch.bytes.load();
+    if (!m.model) {
+        if (!unloaded()) LOGD("Failed to load model!");
+        return false;
+    }
+    m.load_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t_load).count();
+    LOGD("Model loaded successfully in %.0f ms", m.load_ms);
+
+    // Registered LoRA adapters, before the context exists
+    m.loras = llm_lora_preload(m.model);
+
+    // The scheduler submits at most one ubatch per iteration, so prompts are
+    // prefilled in chunks of the profile's n_ubatch
+    int n_profiles;
+    const LlmCtxProfile *defaults = llm_ctx_profiles(&n_profiles);
+    m.profile = g_next_profile ? g_next_profile : defaults;
+    m.n_slots = g_next_n_slots;
+    for (;;) {
+        m.cparams = llama_context_default_params();
+        llm_ctx_profile_apply(*m.profile, m.cparams, g_next_n_ctx);
+        m.cparams.n_seq_max       = m.n_slots + 1;   // + prompt cache scratch
+        m.cparams.kv_unified      = true;   // slots share one pool of KV cells
+        m.cparams.n_threads       = clamp_threads(n_threads);
+        m.cparams.n_threads_batch = m.cparams.n_threads;
+
+        m.ctx = llama_init_from_model(m.model, m.cparams);
+        if (m.ctx || m.profile == defaults) break;
+        // A quantized KV cache needs flash attention on the backend
+        LOGD("Context profile %s failed, falling back to %s", m.profile->name, defaults->name);
+        m.profile = defaults;
     }
+    if (!m.ctx) {
+        LOGD("Failed to initialize context!");
+        free_staged(m);
+        return false;
+    }
+    LOGD("Context initialized: profile %s, n_ctx %u, KV ~%.1f MiB", m.profile->name,
+         m.cparams.n_ctx,
+         llm_ctx_profile_kv_bytes(m.model, *m.profile, m.cparams.n_ctx) / 1048576.0);
 
-    // Base / unknown models: Alpaca-style fallback
-    return
-            "### Instruction:\n"
-            "{prompt}\n"
-            "\n"
-            "### Response:\n";
+    if (!draft_path.empty()) {
+        LOGD("Draft model path: %s", draft_path.c_str());
+        load_draft(m, draft_path);
+    }
+    if (unloaded()) {
+        free_staged(m);
+        return false;
+    }
 
+    // Warm up on llama's own threads; the shared threadpool belongs to the
+    // live context until go_live
+    g_startup_stats.warmup_ms = 0.0;
+    if (g_startup.warmup) {
+        const auto t_warmup = std::chrono::steady_clock::now();
+        warmup(m.ctx);
+        if (m.draft_ctx) warmup(m.draft_ctx);
+        g_startup_stats.warmup_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t_warmup).count();
+        LOGD("Warmup decode took %.0f ms", g_startup_stats.warmup_ms);
+    }
+    g_load_progress = 1.0f;
+    return true;
 }
 
-static std::string apply_chat_template(const std::string &user_prompt) {
-    std::string tmpl = select_template_for_model();
-    const std::string marker = "{prompt}";
-    size_t pos = tmpl.find(marker);
-    if (pos != std::string::npos) {
-        tmpl.replace(pos, marker.size(), user_prompt);
-    }
-    return tmpl;
+// Move the live model out of the globals, stopping the scheduler first.
+// Caller holds g_mutex exclusively.
+static StagedModel take_live() {
+    llm_scheduler_stop();
+    llm_embed_detach();
+    llm_grammar_clear_cache();
+    llm_chat_reset();
+    StagedModel m;
+    m.model       = g_model;
+    m.ctx         = g_ctx;
+    m.draft_model = g_draft_model;
+    m.draft_ctx   = g_draft_ctx;
+    m.cparams     = g_cparams;
+    m.profile     = g_ctx_profile;
+    m.load_ms     = g_load_ms;
+    m.n_slots     = g_n_slots;
+    m.loras       = llm_lora_detach();
+    g_model = nullptr;
+    g_ctx   = nullptr;
+    g_draft_model = nullptr;
+    g_draft_ctx   = nullptr;
+    g_ctx_profile = nullptr;
+    g_n_slots     = 0;
+    g_max_piece_bytes = 0;
+    g_vocab = nullptr;
+    g_token_bos = -1;
+    g_token_eos = -1;
+    return m;
 }
 
-static std::string token_to_piece(const llama_vocab *vocab, llama_token token,
-                                  bool special) {
-    if (!vocab || token == LLAMA_TOKEN_NULL) return "";
-    char buf[512];
-    int32_t n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, special);
-    if (n < 0) return "";
-    return std::string(buf, n);
+// Make `m` the live model and start the scheduler on it. Caller holds
+// g_mutex exclusively and the live slot is empty. On failure `m` is freed
+// and nothing is live.
+static bool go_live(StagedModel &m) {
+    g_model       = m.model;
+    g_ctx         = m.ctx;
+    g_draft_model = m.draft_model;
+    g_draft_ctx   = m.draft_ctx;
+    g_cparams     = m.cparams;
+    g_ctx_profile = m.profile;
+    g_load_ms     = m.load_ms;
+    g_n_slots     = m.n_slots;
+    llm_lora_attach(g_model, std::move(m.loras));
+    m = StagedModel{};
+
+    if (g_threadpool) {
+        llama_attach_threadpool(g_ctx, g_threadpool, nullptr);
+        if (g_draft_ctx) llama_attach_threadpool(g_draft_ctx, g_threadpool, nullptr);
+    }
+    g_n_threads       = g_cparams.n_threads;
+    g_n_threads_batch = g_cparams.n_threads_batch;
+
+    g_vocab     = llama_model_get_vocab(g_model);
+    g_token_bos = llama_vocab_bos(g_vocab);
+    g_token_eos = llama_vocab_eos(g_vocab);
+    LOGD("Vocab loaded, BOS=%d, EOS=%d", g_token_bos, g_token_eos);
+    llm_chat_init(g_model);
+
+    if (!llm_scheduler_start(g_ctx, g_cparams, g_n_slots, g_draft_ctx)) {
+        LOGD("Failed to start scheduler!");
+        StagedModel failed = take_live();
+        free_staged(failed);
+        return false;
+    }
+    LOGD("Scheduler started with %d slots", g_n_slots);
+    return true;
 }
 
 static std::string json_escape(const std::string &s) {
@@ -144,241 +492,297 @@ static std::string json_escape(const std::string &s) {
     return out;
 }
 
-// ---------------- Manual sampling (temp, top_p, top_k) ----------------
-static llama_token sample_token_from_logits(const llama_vocab *vocab,
-                                            const float *logits, float temp,
-                                            float top_p, int top_k) {
-    int n_vocab = llama_vocab_n_tokens(vocab);
-    if (n_vocab <= 0 || !logits) {
-        return LLAMA_TOKEN_NULL;
+// ---------------- Core generation ----------------
+// Templated prompt: special tokens written by the template (e.g.
+// <|im_start|>) are parsed as such, those in message content are not, so a
+// client cannot open a turn of another role. BOS is not doubled if the
+// template already starts with it.
+static std::vector<llama_token> tokenize_prompt(const std::vector<LlmChatSegment> &prompt,
+                                                bool add_bos = true) {
+    const int64_t t_start = llm_clock_us();
+    std::vector<llama_token> tokens;
+    for (const LlmChatSegment &seg : prompt) {
+        const size_t at = tokens.size();
+        tokens.resize(at + seg.text.size() + 8);
+        int32_t n = llama_tokenize(
+                g_vocab,
+                seg.text.c_str(),
+                (int32_t)seg.text.size(),
+                tokens.data() + at,
+                (int32_t)(tokens.size() - at),
+                false,
+                !seg.content
+        );
+        if (n < 0) n = 0;
+        tokens.resize(at + n);
     }
+    LOGD("Prompt tokenized into %zu tokens", tokens.size());
 
-    // Greedy fallback if temp <= 0
-    if (temp <= 0.0f) {
-        float max_logit = -1e30f;
-        llama_token best = LLAMA_TOKEN_NULL;
-        for (int i = 0; i < n_vocab; ++i) {
-            if (logits[i] > max_logit) {
-                max_logit = logits[i];
-                best = (llama_token)i;
-            }
-        }
-        return best;
+    if (add_bos && g_token_bos != -1 && (tokens.empty() || tokens[0] != g_token_bos)) {
+        tokens.insert(tokens.begin(), g_token_bos);
     }
+    llm_metrics_record(LlmHist::Tokenize, llm_clock_us() - t_start);
+    return tokens;
+}
 
-    struct Candidate {
-        llama_token id;
-        float logit;
-        float p;
-    };
+static std::shared_ptr<LlmRequest> make_request(const std::string &user_prompt,
+                                                int n_gen, float temp,
+                                                float top_p, int top_k) {
+    std::vector<LlmChatSegment> prompt = llm_chat_render({{"user", user_prompt}}, true);
+    LOGD("Prompt after template:\n%s", llm_chat_text(prompt).c_str());
+
+    auto req = std::make_shared<LlmRequest>();
+    req->prompt = tokenize_prompt(prompt);
+    req->n_gen  = n_gen;
+    req->temp   = temp;
+    req->top_p  = top_p;
+    req->top_k  = top_k;
+    return req;
+}
 
-    std::vector<Candidate> cands;
-    cands.reserve(n_vocab);
-    for (int i = 0; i < n_vocab; ++i) {
-        Candidate c;
-        c.id = (llama_token)i;
-        c.logit = logits[i];
-        c.p = 0.0f;
-        cands.push_back(c);
-    }
-
-    // Top-k
-    if (top_k > 0 && top_k < n_vocab) {
-        std::nth_element(
-                cands.begin(),
-                cands.begin() + top_k,
-                cands.end(),
-                [](const Candidate &a, const Candidate &b) {
-                    return a.logit > b.logit;
-                }
-        );
-        cands.resize(top_k);
-    }
+// Cancellation id (for cancelRequest), wall-clock timeout and token budget
+// of a request; 0 means none
+static void set_request_limits(LlmRequest &req, jlong id, jint timeout_ms, jint token_budget) {
+    req.id          = (uint64_t)id;
+    req.deadline_us = timeout_ms > 0 ? llm_clock_us() + (int64_t)timeout_ms * 1000 : 0;
+    req.n_budget    = token_budget > 0 ? token_budget : 0;
+}
 
-    // Temperature
-    for (auto &c : cands) {
-        c.logit /= temp;
+// LoRA adapter of a request by name; empty means the base model
+static bool set_request_lora(LlmRequest &req, const std::string &name, std::string &error) {
+    if (name.empty()) return true;
+    req.lora = llm_lora_acquire(name, error);
+    return req.lora != nullptr;
+}
+
+// Callers must hold g_mutex (shared) so the model cannot go away meanwhile.
+// n_generated, if set, receives the number of tokens generated.
+static std::string generate(const std::string &user_prompt,
+                            int n_gen = 64,
+                            float temp = 0.7f,
+                            float top_p = 0.9f,
+                            int top_k = 40,
+                            bool prompt_lookup = false,
+                            jlong request_id = 0,
+                            jint timeout_ms = 0,
+                            jint token_budget = 0,
+                            const std::string &grammar = "",
+                            const std::string &lora = "",
+                            int *n_generated = nullptr) {
+    if (!g_ctx || !g_vocab) {
+        return "Error: model not loaded";
     }
 
-    // Softmax
-    float max_logit = -1e30f;
-    for (const auto &c : cands) {
-        if (c.logit > max_logit) max_logit = c.logit;
+    auto req = make_request(user_prompt, n_gen, temp, top_p, top_k);
+    req->prompt_lookup = prompt_lookup;
+    req->grammar = grammar;
+    std::string error;
+    if (!set_request_lora(*req, lora, error)) return "Error: " + error;
+    set_request_limits(*req, request_id, timeout_ms, token_budget);
+    llm_scheduler_submit(req);
+    llm_request_wait(*req);
+    if (n_generated) *n_generated = req->n_generated;
+
+    if (!req->error.empty()) {
+        LOGD("Generation failed: %s", req->error.c_str());
+        return "Error: " + req->error;
+    }
+    LOGD("Generation complete, reused %d prompt tokens, generated %d tokens",
+         req->n_prompt_reused, req->n_generated);
+    if (req->n_spec_steps > 0) {
+        LOGD("Speculation: %.2f accepted tokens per step over %d steps",
+             (double)req->n_spec_accepted / req->n_spec_steps, req->n_spec_steps);
     }
+    return req->text;
+}
 
-    double sum = 0.0;
-    for (auto &c : cands) {
-        double v = std::exp((double)c.logit - (double)max_logit);
-        c.p = (float)v;
-        sum += v;
+// n completions of one prompt. The prompt is prefilled once and forked to
+// the other slots (LlmRequest::forks), which decode together in the shared
+// batch. With best_of > n, best_of completions are generated and the n with
+// the highest mean log-probability per token are returned, best first. Every
+// completion is constrained by `grammar` if set and runs with the `lora`
+// adapter if set. Returns JSON; callers hold g_mutex (shared).
+static std::string generate_choices(const std::string &user_prompt, int n_gen, float temp,
+                                    int n, int best_of, jlong request_id,
+                                    jint timeout_ms, jint token_budget,
+                                    const std::string &grammar, const std::string &lora) {
+    if (!g_ctx || !g_vocab) {
+        return "{\"error\":\"model not loaded\"}";
     }
-    if (sum <= 0.0) {
-        llama_token best = LLAMA_TOKEN_NULL;
-        float best_logit = -1e30f;
-        for (const auto &c : cands) {
-            if (c.logit > best_logit) {
-                best_logit = c.logit;
-                best = c.id;
-            }
-        }
-        return best;
+    n = std::max(1, n);
+    best_of = std::max(n, best_of);
+    const bool rank = best_of > n;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    auto req = make_request(user_prompt, n_gen, temp, 0.9f, 40);
+    req->logprobs = rank;
+    req->grammar  = grammar;
+    set_request_limits(*req, request_id, timeout_ms, token_budget);
+    std::string error;
+    if (!set_request_lora(*req, lora, error)) {
+        return "{\"error\":\"" + json_escape(error) + "\"}";
     }
-    for (auto &c : cands) {
-        c.p = (float)((double)c.p / sum);
+    std::vector<std::shared_ptr<LlmRequest>> all = {req};
+    for (int i = 1; i < best_of; ++i) {
+        auto fork = std::make_shared<LlmRequest>();
+        fork->n_gen       = req->n_gen;
+        fork->temp        = req->temp;
+        fork->top_p       = req->top_p;
+        fork->top_k       = req->top_k;
+        fork->logprobs    = rank;
+        fork->grammar     = grammar;
+        fork->lora        = req->lora;
+        fork->deadline_us = req->deadline_us;
+        fork->n_budget    = req->n_budget;
+        req->forks.push_back(fork);
+        all.push_back(fork);
     }
-
-    // Top-p
-    if (top_p > 0.0f && top_p < 1.0f) {
-        std::sort(
-                cands.begin(),
-                cands.end(),
-                [](const Candidate &a, const Candidate &b) {
-                    return a.p > b.p;
-                }
-        );
-        double cum = 0.0;
-        size_t cut = cands.size();
-        for (size_t i = 0; i < cands.size(); ++i) {
-            cum += cands[i].p;
-            if (cum >= top_p) {
-                cut = i + 1;
-                break;
-            }
-        }
-        if (cut < cands.size()) {
-            cands.resize(cut);
-        }
-        double sum2 = 0.0;
-        for (auto &c : cands) sum2 += c.p;
-        if (sum2 > 0.0) {
-            for (auto &c : cands) c.p = (float)(c.p / sum2);
-        }
+    llm_scheduler_submit(req);
+    for (auto &r : all) llm_request_wait(*r);
+    const double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t_start).count();
+
+    std::vector<int> order;
+    for (int i = 0; i < best_of; ++i) {
+        if (all[i]->error.empty()) order.push_back(i);
     }
-
-    static thread_local std::mt19937 rng{std::random_device{}()};
-    std::vector<double> weights;
-    weights.reserve(cands.size());
-    for (const auto &c : cands) {
-        weights.push_back((double)c.p);
+    if (order.empty()) {
+        LOGD("Generation failed: %s", req->error.c_str());
+        return "{\"error\":\"" + json_escape(req->error) + "\"}";
     }
+    // Ranked by mean log-probability per sampled token: the sum favours
+    // whichever completion stops first
+    auto mean_logprob = [](const LlmRequest &r) {
+        const int n_sampled = r.n_generated + (r.stop_token != LLAMA_TOKEN_NULL ? 1 : 0);
+        return n_sampled > 0 ? r.sum_logprob / n_sampled : 0.0;
+    };
+    if (rank) {
+        std::stable_sort(order.begin(), order.end(), [&all, &mean_logprob](int a, int b) {
+            return mean_logprob(*all[a]) > mean_logprob(*all[b]);
+        });
+    }
+    if ((int)order.size() > n) order.resize(n);
 
-    std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
-    size_t idx = dist(rng);
-    if (idx >= cands.size()) {
-        return LLAMA_TOKEN_NULL;
+    int n_generated = 0;
+    for (auto &r : all) n_generated += r->n_generated;
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"n_prompt\":%zu,\"n_prompt_reused\":%d,\"generated\":%d,"
+             "\"duration_ms\":%.1f,\"choices\":[",
+             req->prompt.size(), req->n_prompt_reused, n_generated, ms);
+    std::string out = buf;
+    for (size_t k = 0; k < order.size(); ++k) {
+        const LlmRequest &r = *all[order[k]];
+        out += k ? ",{" : "{";
+        snprintf(buf, sizeof(buf), "\"index\":%zu,\"tokens\":%d,\"finish_reason\":\"%s\",",
+                 k, r.n_generated, r.stop_token != LLAMA_TOKEN_NULL ? "stop" : "length");
+        out += buf;
+        if (rank) {
+            snprintf(buf, sizeof(buf), "\"logprob\":%.4f,\"mean_logprob\":%.4f,",
+                     r.sum_logprob, mean_logprob(r));
+            out += buf;
+        }
+        out += "\"text\":\"" + json_escape(r.text) + "\"}";
     }
-    return cands[idx].id;
+    LOGD("Generated %d completions (%d kept) of %zu prompt tokens, %d tokens in %.0f ms",
+         best_of, (int)order.size(), req->prompt.size(), n_generated, ms);
+    return out + "]}";
 }
 
-// ---------------- Core generation ----------------
-static std::string generate(const std::string &user_prompt,
-                            int n_gen = 64,
-                            float temp = 0.7f,
-                            float top_p = 0.9f,
-                            int top_k = 40) {
-    if (!g_ctx || !g_vocab) {
-        return "Error: model not loaded";
-    }
+// Hand a submitted streaming request to `callback` piece by piece until it
+// completes. Pieces are coalesced for up to LLM_STREAM_FLUSH_MS to bound the
+// number of JNI crossings, and never split a UTF-8 codepoint. If the callback
+// throws (e.g. the client went away) the request is cancelled and the
+// exception left pending.
+static void stream_request(JNIEnv *env, jobject callback, LlmRequest &req) {
+    using clock = std::chrono::steady_clock;
+    const auto flush_interval = std::chrono::milliseconds(LLM_STREAM_FLUSH_MS);
+
+    size_t sent = 0;   // bytes of req.text handed to the callback
+    size_t seen = 0;   // bytes of req.text observed so far
+    auto last_flush = clock::now() - flush_interval;
+    std::string chunk;
+    bool done = false;
+
+    while (!done) {
+        {
+            std::unique_lock<std::mutex> lk(req.mutex);
+            req.cv.wait(lk, [&] { return req.done || req.text.size() > seen; });
+            req.cv.wait_until(lk, last_flush + flush_interval, [&] {
+                return req.done || req.text.size() - sent >= LLM_STREAM_FLUSH_BYTES;
+            });
+
+            done = req.done;
+            seen = req.text.size();
+            size_t end = done ? seen
+                              : sent + utf8_complete_prefix(req.text.data() + sent,
+                                                            seen - sent);
+            chunk.assign(req.text, sent, end - sent);
+            sent = end;
+            if (done && !req.error.empty() && req.text.empty()) {
+                chunk = "Error: " + req.error;
+            }
+        }
+        if (chunk.empty()) continue;
 
-    std::string prompt = apply_chat_template(user_prompt);
-    LOGD("Prompt after template:\n%s", prompt.c_str());
+        if (env->PushLocalFrame(4) != JNI_OK) break;
+        jstring jPiece = utf8_to_jstring(env, chunk.data(), chunk.size());
+        env->CallObjectMethod(callback, g_invoke_method, jPiece);
+        env->PopLocalFrame(nullptr);
+        if (env->ExceptionCheck()) break;
 
-    // Reset context
-    llama_free(g_ctx);
-    g_ctx = llama_init_from_model(g_model, g_cparams);
-    if (!g_ctx) {
-        LOGD("Failed to reinitialize context for generation");
-        return "Error: context init failed";
+        last_flush = clock::now();
     }
-    g_vocab = llama_model_get_vocab(g_model);
-    g_pos = 0;
-    g_token_bos = llama_vocab_bos(g_vocab);
-    g_token_eos = llama_vocab_eos(g_vocab);
 
-    // Tokenize
-    std::vector<llama_token> tokens(prompt.size() + 8);
-    int32_t n = llama_tokenize(
-            g_vocab,
-            prompt.c_str(),
-            (int32_t)prompt.size(),
-            tokens.data(),
-            (int32_t)tokens.size(),
-            false,
-            false
-    );
-    if (n < 0) n = 0;
-    LOGD("Prompt tokenized into %d tokens", n);
-
-    std::vector<llama_token> input_tokens;
-    input_tokens.reserve(n + 1);
-    if (g_token_bos != -1) {
-        input_tokens.push_back(g_token_bos);
-    }
-    input_tokens.insert(input_tokens.end(), tokens.begin(), tokens.begin() + n);
-
-    if (input_tokens.empty()) {
-        LOGD("No input tokens after tokenization");
-        return "Error: empty prompt tokens";
-    }
-
-    // Decode prompt
-    llama_batch batch = llama_batch_init((int32_t)input_tokens.size(), 0, 1);
-    for (size_t i = 0; i < input_tokens.size(); ++i) {
-        batch.token[i]    = input_tokens[i];
-        batch.pos[i]      = g_pos + (int32_t)i;
-        batch.n_seq_id[i] = 1;
-        batch.seq_id[i][0]= 0;
-        batch.logits[i]   = 1;
-    }
-    batch.n_tokens = (int32_t)input_tokens.size();
-
-    if (llama_decode(g_ctx, batch) != 0) {
-        llama_batch_free(batch);
-        LOGD("Error: decode prompt failed");
-        return "Error: decode prompt failed";
-    }
-    llama_batch_free(batch);
-    g_pos += (int32_t)input_tokens.size();
-    LOGD("Prompt decoded successfully, position now %d", g_pos);
-
-    // Generation loop
-    std::string generated;
-    for (int step = 0; step < n_gen; ++step) {
-        const float *logits = llama_get_logits(g_ctx);
-        if (!logits) {
-            LOGD("Logits null, stopping generation");
-            break;
-        }
+    if (!done) {
+        // Nobody is listening any more; free the slot right away
+        llm_request_cancel(req);
+        llm_request_wait(req);
+    }
+}
 
-        llama_token tok = sample_token_from_logits(g_vocab, logits, temp, top_p, top_k);
-        if (tok == LLAMA_TOKEN_NULL || tok == g_token_eos) {
-            LOGD("EOS or NULL token reached, stopping at step %d", step);
-            break;
-        }
+// Replace the live model by `path`, unavailable while it loads. Caller
+// holds g_load_mutex; unload_gen as for stage_model.
+static jlong load_model(const std::string &path, const std::string &draft_path,
+                        int32_t n_threads, uint64_t unload_gen) {
+    const auto t_start = std::chrono::steady_clock::now();
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
+    LOGD("Loading model...");
 
-        std::string piece = token_to_piece(g_vocab, tok, false);
-        generated += piece;
-
-        llama_batch b = llama_batch_init(1, 0, 1);
-        b.token[0]    = tok;
-        b.pos[0]      = g_pos;
-        b.n_seq_id[0] = 1;
-        b.seq_id[0][0]= 0;
-        b.logits[0]   = 1;
-        b.n_tokens    = 1;
-
-        if (llama_decode(g_ctx, b) != 0) {
-            llama_batch_free(b);
-            LOGD("Error: decode generated token failed at step %d", step);
-            break;
-        }
+    StagedModel old = take_live();
+    free_staged(old);
+    free_threadpool();
+
+    llama_backend_init();
+    create_threadpool();
 
-        llama_batch_free(b);
-        g_pos++;
+    StagedModel next;
+    if (!stage_model(next, path, draft_path, n_threads, unload_gen) || !go_live(next)) {
+        free_threadpool();
+        return 0;
     }
+    g_startup_stats.ready_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t_start).count();
+    LOGD("Ready in %.0f ms", g_startup_stats.ready_ms);
+    return (jlong)(uintptr_t)g_ctx;
+}
 
-    LOGD("Generation complete, total generated chars: %zu", generated.size());
-    return generated;
+// Apply the generation thread count to the live context; the KV cache
+// survives and the batch thread count is left as configured
+static void apply_generate_threads(jint threads) {
+    if (threads <= 0) return;
+    int32_t n_threads = clamp_threads(threads);
+    if (g_n_threads.exchange(n_threads) != n_threads) {
+        llm_scheduler_set_threads(n_threads, g_n_threads_batch.load());
+    }
+}
+
+// Generated token count into stats[0] for throughput reporting; stats may
+// be null
+static void put_generated(JNIEnv *env, jintArray stats, int n_generated) {
+    if (!stats || env->GetArrayLength(stats) < 1) return;
+    const jint n = n_generated;
+    env->SetIntArrayRegion(stats, 0, 1, &n);
 }
 
 // ---------------- JNI Functions ----------------
@@ -391,9 +795,15 @@ jobject thiz,
         jstring j_prompt,
 jfloat j_temp,
         jint j_max_tokens,
-jint j_threads
+jint j_threads,
+jboolean j_prompt_lookup,
+        jlong j_request_id,
+jint j_timeout_ms,
+        jint j_token_budget,
+        jstring j_grammar,
+        jstring j_lora
 ) {
-ScopedLock lock(g_mutex);
+std::shared_lock<std::shared_mutex> lock(g_mutex);
 
 if (!g_ctx || !g_vocab) {
 return env->NewStringUTF("Error: model not loaded");
@@ -401,17 +811,7 @@ return env->NewStringUTF("Error: model not loaded");
 
 // Convert prompt
 std::string prompt = jstring_to_std(env, j_prompt);
-
-// Update thread count
-g_cparams.n_threads       = j_threads;
-g_cparams.n_threads_batch = j_threads;
-
-// Reinitialize context with new thread count
-llama_free(g_ctx);
-g_ctx = llama_init_from_model(g_model, g_cparams);
-if (!g_ctx) {
-return env->NewStringUTF("Error: context init failed");
-}
+apply_generate_threads(j_threads);
 
 // Call your core generator
 std::string out = generate(
@@ -419,130 +819,671 @@ std::string out = generate(
         j_max_tokens,
         j_temp,
         /*top_p=*/0.9f,
-        /*top_k=*/40
+        /*top_k=*/40,
+        j_prompt_lookup,
+        j_request_id,
+        j_timeout_ms,
+        j_token_budget,
+        jstring_to_std(env, j_grammar),
+        jstring_to_std(env, j_lora)
 );
 
-return env->NewStringUTF(out.c_str());
+return utf8_to_jstring(env, out.data(), out.size());
 }
 
-// ---------------- Load Model ----------------
-JNIEXPORT jlong JNICALL
-Java_com_example_llmserverapp_LlamaBridge_loadModel(
-        JNIEnv *env, jobject thiz, jstring j_model_path, jint j_threads) {
-    ScopedLock lock(g_mutex);
-    LOGD("Loading model...");
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_generateChoices(
+        JNIEnv *env, jobject thiz, jstring j_prompt, jfloat j_temp, jint j_max_tokens,
+        jint j_n, jint j_best_of, jlong j_request_id, jint j_timeout_ms, jint j_token_budget,
+        jstring j_grammar, jstring j_lora) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    std::string out = generate_choices(jstring_to_std(env, j_prompt), j_max_tokens, j_temp,
+                                       j_n, j_best_of, j_request_id, j_timeout_ms,
+                                       j_token_budget, jstring_to_std(env, j_grammar),
+                                       jstring_to_std(env, j_lora));
+    return utf8_to_jstring(env, out.data(), out.size());
+}
 
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
-        LOGD("Freed old context");
+// ---------------- Batch generation ----------------
+// Independent prompts in one call, for offline jobs. At most max_concurrent
+// (capped at the slot count) are in flight and each one that finishes is
+// replaced by the next, so the scheduler keeps packing their prefills and
+// decode steps into shared batches. The model lock is only held while a
+// window is tokenized and submitted, so a swap or unload never waits for the
+// whole batch: stopping the scheduler fails the requests in flight, and they
+// are submitted again to the new model. timeout_ms bounds the whole batch.
+// One string per prompt: its text, or "Error: ..." for that prompt alone;
+// the total generated token count goes to j_stats.
+JNIEXPORT jobjectArray JNICALL
+Java_com_example_llmserverapp_LlamaBridge_generateBatch(
+        JNIEnv *env, jobject thiz, jobjectArray j_prompts, jfloat j_temp, jint j_max_tokens,
+        jint j_max_concurrent, jint j_timeout_ms, jstring j_grammar, jstring j_lora,
+        jintArray j_stats) {
+    const jsize n = j_prompts ? env->GetArrayLength(j_prompts) : 0;
+    std::vector<std::string> prompts(n);
+    for (jsize i = 0; i < n; ++i) {
+        auto js = (jstring)env->GetObjectArrayElement(j_prompts, i);
+        prompts[i] = jstring_to_std(env, js);
+        env->DeleteLocalRef(js);
     }
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-        LOGD("Freed old model");
+    const std::string grammar   = jstring_to_std(env, j_grammar);
+    const std::string lora_name = jstring_to_std(env, j_lora);
+    const int64_t t_start  = llm_clock_us();
+    const int64_t deadline = j_timeout_ms > 0 ? t_start + (int64_t)j_timeout_ms * 1000 : 0;
+
+    // Guarded by done_mutex
+    std::mutex done_mutex;
+    std::condition_variable done_cv;
+    jsize n_done = 0;
+    jsize n_in_flight = 0;
+    std::vector<jsize> todo(n);   // prompts to submit, taken from the back
+    for (jsize i = 0; i < n; ++i) todo[i] = n - 1 - i;
+
+    std::vector<std::shared_ptr<LlmRequest>> reqs(n);
+    jsize window = 1;   // in flight at once, from the slot count of the live model
+    std::unique_lock<std::mutex> done_lock(done_mutex);
+    while (n_done < n) {
+        if (!todo.empty() && n_in_flight < window) {
+            done_lock.unlock();
+            std::shared_lock<std::shared_mutex> lock(g_mutex);
+            window = std::max(1, std::min((int)j_max_concurrent, g_n_slots));
+            std::string error;
+            std::shared_ptr<LlmLora> lora;
+            if (!g_ctx || !g_vocab) {
+                error = "model not loaded";
+            } else if (!lora_name.empty()) {
+                lora = llm_lora_acquire(lora_name, error);
+            }
+            // Claim the window's prompts, then tokenize them without
+            // done_mutex, which on_done of the requests in flight takes
+            std::vector<jsize> picked;
+            done_lock.lock();
+            while (!todo.empty() &&
+                   (!error.empty() || n_in_flight + (jsize)picked.size() < window)) {
+                picked.push_back(todo.back());
+                todo.pop_back();
+            }
+            // Without a model or adapter, the rest of the batch cannot run either
+            if (error.empty()) {
+                n_in_flight += (jsize)picked.size();
+            } else {
+                n_done += (jsize)picked.size();
+            }
+            done_lock.unlock();
+
+            std::vector<std::shared_ptr<LlmRequest>> batch;
+            for (const jsize i : picked) {
+                if (!error.empty()) {
+                    reqs[i] = std::make_shared<LlmRequest>();
+                    reqs[i]->error = error;
+                    continue;
+                }
+                reqs[i] = make_request(prompts[i], j_max_tokens, j_temp, 0.9f, 40);
+                reqs[i]->grammar = grammar;
+                reqs[i]->lora    = lora;
+                reqs[i]->deadline_us = deadline;
+                LlmRequest *req = reqs[i].get();
+                reqs[i]->on_done = [&done_mutex, &done_cv, &n_done, &n_in_flight, &todo, req, i]() {
+                    std::lock_guard<std::mutex> done_lock(done_mutex);
+                    n_in_flight--;
+                    if (req->error == "model unloaded") {
+                        todo.push_back(i);   // swapped out from under it, run it again
+                    } else {
+                        n_done++;
+                    }
+                    done_cv.notify_one();
+                };
+                batch.push_back(reqs[i]);
+            }
+            // A rejected request completes (on_done) right away
+            for (const auto &req : batch) llm_scheduler_submit(req);
+            lock.unlock();
+            done_lock.lock();
+        }
+        done_cv.wait(done_lock, [&]() {
+            return n_done == n || (!todo.empty() && n_in_flight < window);
+        });
     }
+    done_lock.unlock();
 
-    g_vocab = nullptr;
-    g_pos = 0;
-    g_token_bos = -1;
-    g_token_eos = -1;
+    std::vector<std::string> results(n);
+    int32_t n_generated = 0;
+    for (jsize i = 0; i < n; ++i) {
+        results[i] = reqs[i]->error.empty() ? reqs[i]->text : "Error: " + reqs[i]->error;
+        n_generated += reqs[i]->n_generated;
+    }
+    const double ms = (llm_clock_us() - t_start) / 1e3;
+    LOGD("Batch of %d prompts (%d in flight): %d tokens in %.0f ms, %.1f tok/s",
+         (int)n, (int)window, n_generated, ms, ms > 0 ? n_generated * 1e3 / ms : 0.0);
+    put_generated(env, j_stats, n_generated);
+
+    jclass string_class = env->FindClass("java/lang/String");
+    jobjectArray out = env->NewObjectArray(n, string_class, nullptr);
+    for (jsize i = 0; i < n; ++i) {
+        jstring js = utf8_to_jstring(env, results[i].data(), results[i].size());
+        env->SetObjectArrayElement(out, i, js);
+        env->DeleteLocalRef(js);
+    }
+    return out;
+}
 
-    std::string path = jstring_to_std(env, j_model_path);
-    LOGD("Model path: %s", path.c_str());
+// ---------------- Embeddings ----------------
+// Embed tokenized inputs into out (`capacity` bytes). JSON: n, dim, tokens,
+// duration_ms since t_start, or error. Callers hold g_mutex (shared).
+static std::string embed_inputs(const std::vector<std::vector<llama_token>> &inputs,
+                                bool normalize, float *out, size_t capacity,
+                                std::chrono::steady_clock::time_point t_start) {
+    size_t n_tokens = 0;
+    for (const auto &input : inputs) n_tokens += input.size();
+    std::string error;
+    if (!llm_embed(g_model, inputs, normalize, out, capacity / sizeof(float), error)) {
+        LOGD("Embedding failed: %s", error.c_str());
+        return "{\"error\":\"" + json_escape(error) + "\"}";
+    }
+    const double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t_start).count();
+    char buf[160];
+    snprintf(buf, sizeof(buf),
+             "{\"n\":%d,\"dim\":%d,\"tokens\":%zu,\"duration_ms\":%.1f}",
+             (int)inputs.size(), llm_embed_dim(g_model), n_tokens, ms);
+    return buf;
+}
 
-    llama_backend_init();
+// pooling: llama_pooling_type (-1 = the model's own). Applies from the next
+// call; the embedding context is rebuilt.
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setEmbeddingOptions(
+        JNIEnv*, jobject thiz, jint j_pooling, jint j_batch_tokens, jint j_max_seqs) {
+    LlmEmbedParams params;
+    params.pooling   = (enum llama_pooling_type)std::max(-1, std::min((int)j_pooling,
+                                                                 (int)LLAMA_POOLING_TYPE_RANK));
+    params.n_batch   = j_batch_tokens > 0 ? j_batch_tokens : params.n_batch;
+    params.n_seq_max = j_max_seqs > 0 ? j_max_seqs : params.n_seq_max;
+    params.n_threads = clamp_threads(g_n_threads_batch.load());
+    llm_embed_configure(params);
+}
 
-    llama_model_params mparams = llama_model_default_params();
-    mparams.vocab_only = false;
+JNIEXPORT jint JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getEmbeddingDim(JNIEnv*, jobject thiz) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    return g_model ? llm_embed_dim(g_model) : 0;
+}
 
-    g_model = llama_model_load_from_file(path.c_str(), mparams);
-    if (!g_model) {
-        LOGD("Failed to load model!");
-        return 0;
+// Embed all texts into `out`, a direct ByteBuffer in native order holding at
+// least texts.length * getEmbeddingDim() floats, vector i at float offset
+// i * dim. Returns JSON stats or {"error": ...}.
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_embed(
+        JNIEnv *env, jobject thiz, jobjectArray j_texts, jobject j_out, jboolean j_normalize) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model || !g_vocab) {
+        return env->NewStringUTF("{\"error\":\"model not loaded\"}");
+    }
+    auto *out = static_cast<float *>(env->GetDirectBufferAddress(j_out));
+    const jlong capacity = env->GetDirectBufferCapacity(j_out);
+    if (!out || capacity < 0) {
+        return env->NewStringUTF("{\"error\":\"output is not a direct buffer\"}");
     }
-    LOGD("Model loaded successfully");
 
-    g_cparams = llama_context_default_params();
-    g_cparams.n_ctx           = 2048;
-    g_cparams.n_threads       = j_threads;
-    g_cparams.n_threads_batch = j_threads;
+    const auto t_start = std::chrono::steady_clock::now();
+    const jsize n = j_texts ? env->GetArrayLength(j_texts) : 0;
+    std::vector<std::vector<llama_token>> inputs(n);
+    for (jsize i = 0; i < n; ++i) {
+        auto j_text = (jstring)env->GetObjectArrayElement(j_texts, i);
+        inputs[i] = llm_embed_tokenize(g_vocab, jstring_to_std(env, j_text));
+        env->DeleteLocalRef(j_text);
+    }
+    return utf8_to_jstring(env, embed_inputs(inputs, j_normalize, out, (size_t)capacity, t_start));
+}
 
-    g_ctx = llama_init_from_model(g_model, g_cparams);
-    if (!g_ctx) {
-        LOGD("Failed to initialize context!");
-        llama_model_free(g_model);
-        g_model = nullptr;
+// ---------------- Load Model ----------------
+JNIEXPORT jlong JNICALL
+Java_com_example_llmserverapp_LlamaBridge_loadModel(
+        JNIEnv *env, jobject thiz, jstring j_model_path, jint j_threads,
+        jstring j_draft_path) {
+    const uint64_t unload_gen = g_unload_gen.load();
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    return load_model(jstring_to_std(env, j_model_path),
+                      j_draft_path ? jstring_to_std(env, j_draft_path) : std::string(),
+                      j_threads, unload_gen);
+}
+
+// ---------------- Hot Swap ----------------
+// Stage the new model while the current one keeps serving, then swap once
+// in-flight requests have drained (the exclusive g_mutex waits for them;
+// new requests wait for the swap and run on the new model). The old model is
+// freed after the swap. Both models are resident meanwhile.
+JNIEXPORT jlong JNICALL
+Java_com_example_llmserverapp_LlamaBridge_swapModel(
+        JNIEnv *env, jobject thiz, jstring j_model_path, jint j_threads,
+        jstring j_draft_path) {
+    const uint64_t unload_gen = g_unload_gen.load();
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    std::string path = jstring_to_std(env, j_model_path);
+    std::string draft_path = j_draft_path ? jstring_to_std(env, j_draft_path) : std::string();
+
+    bool live;
+    {
+        std::shared_lock<std::shared_mutex> lock(g_mutex);
+        live = g_model != nullptr;
+    }
+    if (!live) return load_model(path, draft_path, j_threads, unload_gen);
+
+    LOGD("Swapping model, staging in the background...");
+    const auto t_start = std::chrono::steady_clock::now();
+    StagedModel next;
+    if (!stage_model(next, path, draft_path, j_threads, unload_gen)) {
+        LOGD("Swap aborted, current model keeps serving");
         return 0;
     }
-    LOGD("Context initialized");
 
-    g_vocab     = llama_model_get_vocab(g_model);
-    g_token_bos = llama_vocab_bos(g_vocab);
-    g_token_eos = llama_vocab_eos(g_vocab);
-    LOGD("Vocab loaded, BOS=%d, EOS=%d", g_token_bos, g_token_eos);
+    StagedModel old;
+    jlong handle;
+    double paused_ms;
+    {
+        const auto t_wait = std::chrono::steady_clock::now();
+        std::unique_lock<std::shared_mutex> lock(g_mutex);
+        const auto t_locked = std::chrono::steady_clock::now();
+        old = take_live();
+        if (!go_live(next)) {
+            // Put the old model back rather than leave nothing serving
+            LOGD("Swap failed, restoring the previous model");
+            go_live(old);
+            return 0;
+        }
+        handle = (jlong)(uintptr_t)g_ctx;
+        g_startup_stats.ready_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t_start).count();
+        LOGD("Drained in-flight requests in %.0f ms",
+             std::chrono::duration<double, std::milli>(t_locked - t_wait).count());
+        paused_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t_locked).count();
+    }
+    free_staged(old);
+    LOGD("Model swapped in %.0f ms, serving paused for %.1f ms",
+         std::chrono::duration<double, std::milli>(
+                 std::chrono::steady_clock::now() - t_start).count(), paused_ms);
+    return handle;
+}
 
-    return (jlong)(uintptr_t)g_ctx;
+JNIEXPORT jfloat JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getLoadProgress(JNIEnv*, jobject thiz) {
+    return g_load_progress.load();
+}
+
+// ---------------- Cold Start ----------------
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setStartupOptions(
+        JNIEnv*, jobject thiz, jboolean j_prefetch, jboolean j_mlock, jboolean j_warmup) {
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    g_startup.prefetch = j_prefetch;
+    g_startup.mlock    = j_mlock;
+    g_startup.warmup   = j_warmup;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getStartupStats(JNIEnv* env, jobject thiz) {
+    StartupStats st;
+    StartupOptions opts;
+    double load_ms;
+    const char *profile = "";
+    double kv_mb = 0.0;
+    {
+        std::lock_guard<std::mutex> load_lock(g_load_mutex);
+        st = g_startup_stats;
+        opts = g_startup;
+        std::shared_lock<std::shared_mutex> lock(g_mutex);
+        load_ms = g_model ? g_load_ms : 0.0;
+        if (g_ctx_profile) {
+            profile = g_ctx_profile->name;
+            kv_mb = llm_ctx_profile_kv_bytes(g_model, *g_ctx_profile, g_cparams.n_ctx) / 1048576.0;
+        }
+    }
+    const int64_t ttft_us = llm_scheduler_first_ttft_us();
+    char buf[448];
+    snprintf(buf, sizeof(buf),
+             "{\"ready_ms\":%.1f,\"load_ms\":%.1f,\"prefetch\":%s,\"prefetch_ms\":%.1f,"
+             "\"prefetch_mb\":%.1f,\"mlock\":%s,\"warmup\":%s,\"warmup_ms\":%.1f,"
+             "\"first_ttft_ms\":%.1f,\"profile\":\"%s\",\"kv_mb\":%.1f}",
+             st.ready_ms, load_ms, opts.prefetch ? "true" : "false", st.prefetch_ms,
+             st.prefetch_bytes / 1048576.0, opts.mlock ? "true" : "false",
+             opts.warmup ? "true" : "false", st.warmup_ms,
+             ttft_us >= 0 ? ttft_us / 1000.0 : -1.0, profile, kv_mb);
+    return env->NewStringUTF(buf);
+}
+
+// ---------------- Context profiles ----------------
+// Applies to the next load or swap. n_ctx > 0 overrides the profile's.
+JNIEXPORT jboolean JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setContextProfile(
+        JNIEnv* env, jobject thiz, jstring j_name, jint j_n_ctx) {
+    const LlmCtxProfile *profile = llm_ctx_profile_find(jstring_to_std(env, j_name));
+    if (!profile) return JNI_FALSE;
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    g_next_profile = profile;
+    g_next_n_ctx   = (uint32_t)std::max(0, (int)j_n_ctx);
+    return JNI_TRUE;
+}
+
+// Concurrent sequences of the next load or swap. More slots raise batch
+// throughput; they share the context's KV cells.
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setParallelSlots(JNIEnv*, jobject thiz, jint j_n_slots) {
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    g_next_n_slots = std::max(1, std::min((int)j_n_slots, LLM_MAX_SLOTS));
+}
+
+// All profiles, with their KV size for the live model if one is loaded
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getContextProfiles(JNIEnv* env, jobject thiz) {
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    int n;
+    const LlmCtxProfile *profiles = llm_ctx_profiles(&n);
+
+    std::string out = "{\"active\":";
+    out += g_ctx_profile ? llm_ctx_profile_json(g_model, *g_ctx_profile, g_cparams.n_ctx)
+                         : std::string("null");
+    out += ",\"next\":\"";
+    out += (g_next_profile ? g_next_profile : profiles)->name;
+    out += "\",\"profiles\":[";
+    for (int i = 0; i < n; ++i) {
+        if (i) out += ',';
+        out += llm_ctx_profile_json(g_model, profiles[i]);
+    }
+    out += "]}";
+    return env->NewStringUTF(out.c_str());
 }
 
 JNIEXPORT jint JNICALL
 Java_com_example_llmserverapp_LlamaBridge_getThreadCount(JNIEnv*, jobject thiz) {
-    return g_cparams.n_threads;
+    return g_n_threads.load();
+}
+
+// ---------------- Live thread settings ----------------
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setThreads(
+        JNIEnv*, jobject thiz, jint j_threads, jint j_threads_batch) {
+    // No model lock: the settings UI calls this on every keystroke, from the
+    // main thread, and the scheduler applies it between iterations. Without
+    // a running scheduler it is dropped; a load starts from its own cparams.
+    g_n_threads       = clamp_threads(j_threads);
+    g_n_threads_batch = clamp_threads(j_threads_batch);
+    llm_scheduler_set_threads(g_n_threads, g_n_threads_batch);
+    LOGD("Threads set to %d (generation) / %d (batch)",
+         g_n_threads.load(), g_n_threads_batch.load());
+}
+
+// ---------------- Context shift ----------------
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setContextShift(JNIEnv*, jobject thiz, jint j_n_sink) {
+    llm_scheduler_set_context_shift(j_n_sink);
+}
+
+// ---------------- Speculative decoding ----------------
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setSpeculative(
+        JNIEnv*, jobject thiz, jint j_n_draft) {
+    llm_spec_set_n_draft(j_n_draft);
+    LOGD("Speculative draft length set to %d", llm_spec_n_draft());
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getSpeculativeStats(
+        JNIEnv* env, jobject thiz, jboolean j_reset) {
+    std::string json = llm_spec_stats_json();
+    if (j_reset) llm_spec_reset_stats();
+    return env->NewStringUTF(json.c_str());
+}
+
+// ---------------- Constrained decoding ----------------
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getGrammarStats(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(llm_grammar_stats_json().c_str());
+}
+
+// Constraint cost per token of `grammar` over synthetic logits, against the
+// whole-vocabulary check and unconstrained sampling. Clears the mask cache.
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_runGrammarBenchmark(
+        JNIEnv* env, jobject thiz, jstring j_grammar, jint j_tokens) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_vocab) {
+        return env->NewStringUTF("{\"error\":\"model not loaded\"}");
+    }
+    std::string json = llm_grammar_bench(g_vocab, jstring_to_std(env, j_grammar), j_tokens);
+    return utf8_to_jstring(env, json);
+}
+
+// ---------------- LoRA adapters ----------------
+// Make an adapter selectable by name. Loaded into the next model before its
+// context is created, or into the live one on first use.
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_registerLora(
+        JNIEnv* env, jobject thiz, jstring j_name, jstring j_path, jfloat j_scale) {
+    std::string error;
+    if (!llm_lora_register(jstring_to_std(env, j_name), jstring_to_std(env, j_path),
+                           j_scale, error)) {
+        return utf8_to_jstring(env, "{\"error\":\"" + json_escape(error) + "\"}");
+    }
+    return env->NewStringUTF("{\"ok\":true}");
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_llmserverapp_LlamaBridge_unregisterLora(JNIEnv* env, jobject thiz, jstring j_name) {
+    return llm_lora_unregister(jstring_to_std(env, j_name)) ? JNI_TRUE : JNI_FALSE;
 }
 
-// ---------------- Run Inference with callback ----------------
 JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setLoraBudget(JNIEnv*, jobject thiz, jint j_budget_mb) {
+    llm_lora_set_budget(j_budget_mb > 0 ? (size_t)j_budget_mb << 20 : 0);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getLoraStats(JNIEnv* env, jobject thiz) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    return env->NewStringUTF(llm_lora_stats_json(g_load_ms).c_str());
+}
+
+// ---------------- Model metadata ----------------
+// Header-only GGUF inspection, no model load; see llm_gguf.h
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setModelIndex(JNIEnv* env, jobject thiz, jstring j_path) {
+    llm_gguf_set_index(jstring_to_std(env, j_path));
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_inspectModel(JNIEnv* env, jobject thiz, jstring j_path) {
+    LlmGgufInfo info;
+    bool cached = false;
+    std::string error;
+    std::string out;
+    if (llm_gguf_inspect(jstring_to_std(env, j_path), info, cached, error)) {
+        out = llm_gguf_info_json(info);
+        out.insert(out.size() - 1, cached ? ",\"cached\":true" : ",\"cached\":false");
+    } else {
+        out = "{\"error\":\"" + json_escape(error) + "\"}";
+    }
+    return utf8_to_jstring(env, out.data(), out.size());
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getModelIndexStats(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(llm_gguf_stats_json().c_str());
+}
+
+// ---------------- Prompt cache ----------------
+JNIEXPORT jboolean JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setPromptCache(
+        JNIEnv* env, jobject thiz, jstring j_dir, jint j_budget_mb) {
+    std::string dir = j_dir ? jstring_to_std(env, j_dir) : std::string();
+    size_t budget = j_budget_mb > 0 ? (size_t)j_budget_mb << 20 : 0;
+    bool ok = llm_pcache_open(dir, budget);
+    LOGD("Prompt cache %s (%s, %d MB)", ok ? "enabled" : "disabled", dir.c_str(), j_budget_mb);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getPromptCacheStats(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(llm_pcache_stats_json().c_str());
+}
+
+// ---------------- Chat template ----------------
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getChatTemplate(JNIEnv* env, jobject thiz) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    std::string json = llm_chat_stats_json();
+    return utf8_to_jstring(env, json.data(), json.size());
+}
+
+// ---------------- Sessions ----------------
+JNIEXPORT jlong JNICALL
+Java_com_example_llmserverapp_LlamaBridge_createSession(JNIEnv*, jobject thiz) {
+    return (jlong)llm_session_create();
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_generateInSession(
+        JNIEnv* env, jobject thiz, jlong j_session, jstring j_message,
+        jfloat j_temp, jint j_max_tokens,
+        jlong j_request_id, jint j_timeout_ms, jint j_token_budget, jstring j_grammar,
+        jintArray j_stats) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_ctx || !g_vocab) {
+        return env->NewStringUTF("Error: model not loaded");
+    }
+
+    // Only the new turn is templated and tokenized; the history is reused.
+    // The whole conversation is rendered again instead after a model swap,
+    // or when the template rewrites earlier turns: the KV holds their old
+    // rendering, which a delta against the new one would not follow.
+    std::vector<LlmChatMessage> past;
+    bool rebuild = false;
+    if (!llm_session_messages(j_session, past, rebuild)) {
+        return env->NewStringUTF("Error: unknown session");
+    }
+    LlmChatMessage message{"user", jstring_to_std(env, j_message)};
+    std::vector<LlmChatSegment> turn;
+    if (!rebuild && !llm_chat_render_delta(past, message, turn)) {
+        LOGD("Session %lld: template rewrote earlier turns, rebuilding", (long long)j_session);
+        rebuild = true;
+    }
+    if (rebuild) {
+        std::vector<LlmChatMessage> all = past;
+        all.push_back(message);
+        turn = llm_chat_render(all, true);
+    }
+    auto req = std::make_shared<LlmRequest>();
+    req->n_gen = j_max_tokens;
+    req->temp  = j_temp;
+    req->grammar = jstring_to_std(env, j_grammar);
+    set_request_limits(*req, j_request_id, j_timeout_ms, j_token_budget);
+    std::string error;
+    if (!llm_session_begin(j_session, g_token_bos, message, past.size(), rebuild,
+                           tokenize_prompt(turn, false), *req, error)) {
+        return utf8_to_jstring(env, "Error: " + error);
+    }
+
+    llm_scheduler_submit(req);
+    llm_request_wait(*req);
+    put_generated(env, j_stats, req->n_generated);
+    if (!req->error.empty()) {
+        LOGD("Session %lld turn failed: %s", (long long)j_session, req->error.c_str());
+        return utf8_to_jstring(env, "Error: " + req->error);
+    }
+    LOGD("Session %lld turn: %zu prompt tokens, %d reused, %d generated",
+         (long long)j_session, req->prompt.size(), req->n_prompt_reused, req->n_generated);
+    return utf8_to_jstring(env, req->text.data(), req->text.size());
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_example_llmserverapp_LlamaBridge_closeSession(JNIEnv*, jobject thiz, jlong j_session) {
+    return llm_session_close(j_session) ? JNI_TRUE : JNI_FALSE;
+}
+
+JNIEXPORT void JNICALL
+Java_com_example_llmserverapp_LlamaBridge_setSessionPaging(JNIEnv*, jobject thiz, jint j_budget_mb) {
+    llm_session_set_paging(j_budget_mb > 0 ? (size_t)j_budget_mb << 20 : 0);
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getSessionStats(JNIEnv* env, jobject thiz) {
+    return env->NewStringUTF(llm_session_stats_json().c_str());
+}
+
+// ---------------- Run Inference with callback ----------------
+// Returns the number of tokens generated
+JNIEXPORT jint JNICALL
 Java_com_example_llmserverapp_LlamaBridge_runInference(
         JNIEnv* env,
         jobject thiz,
         jstring jPrompt,
+        jfloat jTemp,
+        jint jMaxTokens,
+        jlong jRequestId,
+        jint jTimeoutMs,
+        jstring jGrammar,
+        jstring jLora,
         jobject jCallback
 ) {
-    ScopedLock lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
 
-    const char* promptChars = env->GetStringUTFChars(jPrompt, nullptr);
-    std::string prompt(promptChars ? promptChars : "");
-    env->ReleaseStringUTFChars(jPrompt, promptChars);
+    std::string prompt = jstring_to_std(env, jPrompt);
 
-    jclass callbackClass = env->GetObjectClass(jCallback);
-    if (callbackClass == nullptr) {
-        return;
+    if (g_invoke_method == nullptr) {
+        jclass fnClass = env->FindClass("kotlin/jvm/functions/Function1");
+        if (fnClass == nullptr) {
+            return 0;
+        }
+        g_invoke_method = env->GetMethodID(
+                fnClass,
+                "invoke",
+                "(Ljava/lang/Object;)Ljava/lang/Object;"
+        );
+        env->DeleteLocalRef(fnClass);
+        if (g_invoke_method == nullptr) {
+            return 0;
+        }
     }
 
-    jmethodID invokeMethod = env->GetMethodID(
-            callbackClass,
-            "invoke",
-            "(Ljava/lang/Object;)Ljava/lang/Object;"
-    );
-    if (invokeMethod == nullptr) {
-        return;
+    if (!g_ctx || !g_vocab) {
+        jstring jError = env->NewStringUTF("Error: model not loaded");
+        env->CallObjectMethod(jCallback, g_invoke_method, jError);
+        return 0;
     }
 
-    std::string result = generate(prompt);
+    auto req = make_request(prompt, jMaxTokens, jTemp, /*top_p=*/0.9f, /*top_k=*/40);
+    req->stream = true;
+    req->grammar = jstring_to_std(env, jGrammar);
+    set_request_limits(*req, jRequestId, jTimeoutMs, /*token_budget=*/0);
+    std::string error;
+    if (!set_request_lora(*req, jstring_to_std(env, jLora), error)) {
+        jstring jError = utf8_to_jstring(env, "Error: " + error);
+        env->CallObjectMethod(jCallback, g_invoke_method, jError);
+        return 0;
+    }
+    llm_scheduler_submit(req);
+    stream_request(env, jCallback, *req);
+    return req->n_generated;
+}
 
-    jstring jResult = env->NewStringUTF(result.c_str());
-    env->CallObjectMethod(jCallback, invokeMethod, jResult);
+// ---------------- Cancellation ----------------
+JNIEXPORT jboolean JNICALL
+Java_com_example_llmserverapp_LlamaBridge_cancelRequest(JNIEnv*, jobject thiz, jlong j_request_id) {
+    return llm_scheduler_cancel((uint64_t)j_request_id) ? JNI_TRUE : JNI_FALSE;
 }
 
 // ---------------- Unload Model ----------------
 JNIEXPORT void JNICALL
 Java_com_example_llmserverapp_LlamaBridge_unloadModel(JNIEnv *, jobject thiz) {
-    ScopedLock lock(g_mutex);
+    g_unload_gen++;   // abandon a load in flight rather than wait it out
+    std::lock_guard<std::mutex> load_lock(g_load_mutex);
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
     LOGD("Unloading model...");
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
-        LOGD("Context freed");
-    }
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-        LOGD("Model freed");
-    }
-    g_vocab = nullptr;
-    g_pos = 0;
-    g_token_bos = -1;
-    g_token_eos = -1;
+    StagedModel old = take_live();
+    free_staged(old);
+    LOGD("Model freed");
+    free_threadpool();
     llama_backend_free();
     LOGD("Backend freed");
 }
@@ -550,34 +1491,22 @@ Java_com_example_llmserverapp_LlamaBridge_unloadModel(JNIEnv *, jobject thiz) {
 // ---------------- Reset Context ----------------
 JNIEXPORT void JNICALL
 Java_com_example_llmserverapp_LlamaBridge_resetContext(JNIEnv *, jclass) {
-    ScopedLock lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
     LOGD("Resetting context...");
     if (!g_model) {
         LOGD("No model loaded, cannot reset");
         return;
     }
-    if (g_ctx) {
-        llama_free(g_ctx);
-        g_ctx = nullptr;
-        LOGD("Old context freed");
-    }
-    g_ctx = llama_init_from_model(g_model, g_cparams);
-    if (!g_ctx) {
-        LOGD("Failed to reinitialize context");
-        return;
-    }
-    g_vocab     = llama_model_get_vocab(g_model);
-    g_pos       = 0;
-    g_token_bos = llama_vocab_bos(g_vocab);
-    g_token_eos = llama_vocab_eos(g_vocab);
-    LOGD("New context initialized, position reset to 0");
+    // Idle slots drop their KV; slots busy with a request keep theirs
+    llm_scheduler_clear_cache();
+    LOGD("Cached prompt prefixes cleared");
 }
 
 // ---------------- Tokenize ----------------
 JNIEXPORT jintArray JNICALL
 Java_com_example_llmserverapp_LlamaBridge_tokenize(
         JNIEnv *env, jclass, jstring j_text, jboolean add_bos) {
-    ScopedLock lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
     if (!g_ctx || !g_vocab) {
         LOGD("Tokenize called but model not loaded");
         return nullptr;
@@ -608,6 +1537,7 @@ Java_com_example_llmserverapp_LlamaBridge_tokenize(
 
     jintArray arr = env->NewIntArray((jsize)out.size());
     if (!arr) return nullptr;
+    llm_metrics_add(LlmCounter::JniCopyBytes, out.size() * sizeof(jint));
     env->SetIntArrayRegion(
             arr,
             0,
@@ -617,25 +1547,241 @@ Java_com_example_llmserverapp_LlamaBridge_tokenize(
     return arr;
 }
 
+// ---------------- Direct buffer I/O ----------------
+// tokenize / generate / embed over direct ByteBuffers: UTF-8 text is read
+// and tokens, text and vectors are written in place, so nothing is converted
+// or copied at the JNI boundary (jni_direct_bytes vs jni_copy_bytes in
+// getMetrics). The Kotlin side owns the buffers and reuses them across calls.
+
+// Address of a direct buffer of at least `len` bytes, else nullptr
+static uint8_t *direct_bytes(JNIEnv *env, jobject buf, jlong len) {
+    if (!buf || len < 0) return nullptr;
+    auto *p = static_cast<uint8_t *>(env->GetDirectBufferAddress(buf));
+    return p && env->GetDirectBufferCapacity(buf) >= len ? p : nullptr;
+}
+
+// Upper bound of the UTF-8 bytes of one generated token
+JNIEXPORT jint JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getMaxTokenBytes(JNIEnv*, jobject thiz) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_vocab) return 0;
+    int32_t n = g_max_piece_bytes.load();
+    if (n == 0) {
+        char buf[256];
+        const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+        for (llama_token t = 0; t < n_vocab; ++t) {
+            const int32_t len = llama_token_to_piece(g_vocab, t, buf, sizeof(buf), 0, true);
+            n = std::max(n, len < 0 ? -len : len);
+        }
+        g_max_piece_bytes = n;
+    }
+    return n;
+}
+
+// Tokens of text[0, len) written to out as int32, BOS first if add_bos.
+// Returns the count, or minus the count needed if out is too small; 0 if no
+// model is loaded or a buffer is not direct.
+JNIEXPORT jint JNICALL
+Java_com_example_llmserverapp_LlamaBridge_tokenizeDirect(
+        JNIEnv *env, jobject thiz, jobject j_text, jint j_len, jboolean j_add_bos, jobject j_out) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    const uint8_t *text = direct_bytes(env, j_text, j_len);
+    auto *out = reinterpret_cast<llama_token *>(direct_bytes(env, j_out, 0));
+    if (!g_vocab || !text || !out) {
+        LOGD("tokenizeDirect: model not loaded or not a direct buffer");
+        return 0;
+    }
+    const int64_t t_start = llm_clock_us();
+    const int32_t capacity = (int32_t)(env->GetDirectBufferCapacity(j_out) / sizeof(llama_token));
+    int32_t n_bos = 0;
+    if (j_add_bos && g_token_bos != -1) {
+        if (capacity > 0) out[0] = g_token_bos;
+        n_bos = 1;
+    }
+    int32_t n = llama_tokenize(g_vocab, (const char *)text, j_len, out + std::min(n_bos, capacity),
+                               std::max(0, capacity - n_bos), false, true);
+    if (n < 0 || n_bos > capacity) return -(std::abs(n) + n_bos);
+    llm_metrics_add(LlmCounter::JniDirectBytes, j_len + (n + n_bos) * sizeof(llama_token));
+    llm_metrics_record(LlmHist::Tokenize, llm_clock_us() - t_start);
+    return n + n_bos;
+}
+
+// generate() with the prompt read from prompt[0, len) and the reply (or
+// "Error: ...") written to out as UTF-8. Returns the bytes written; a reply
+// larger than out is cut at a character boundary, so size out as maxTokens
+// x getMaxTokenBytes.
+JNIEXPORT jint JNICALL
+Java_com_example_llmserverapp_LlamaBridge_generateDirect(
+        JNIEnv *env, jobject thiz, jobject j_prompt, jint j_len, jfloat j_temp, jint j_max_tokens,
+        jint j_threads, jboolean j_prompt_lookup, jlong j_request_id, jint j_timeout_ms,
+        jint j_token_budget, jstring j_grammar, jstring j_lora, jobject j_out,
+        jintArray j_stats) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    const uint8_t *prompt = direct_bytes(env, j_prompt, j_len);
+    uint8_t *out = direct_bytes(env, j_out, 0);
+    if (!prompt || !out) {
+        LOGD("generateDirect: not a direct buffer");
+        return 0;
+    }
+    const size_t capacity = (size_t)env->GetDirectBufferCapacity(j_out);
+
+    std::string text;
+    int n_generated = 0;
+    if (!g_ctx || !g_vocab) {
+        text = "Error: model not loaded";
+    } else {
+        apply_generate_threads(j_threads);
+        text = generate(std::string((const char *)prompt, j_len), j_max_tokens, j_temp,
+                        /*top_p=*/0.9f, /*top_k=*/40, j_prompt_lookup, j_request_id,
+                        j_timeout_ms, j_token_budget, jstring_to_std(env, j_grammar),
+                        jstring_to_std(env, j_lora), &n_generated);
+    }
+    put_generated(env, j_stats, n_generated);
+    size_t n = std::min(text.size(), capacity);
+    if (n < text.size()) {
+        while (n > 0 && ((unsigned char)text[n] & 0xC0) == 0x80) --n;
+        LOGD("generateDirect: reply of %zu bytes cut to %zu", text.size(), n);
+    }
+    memcpy(out, text.data(), n);
+    llm_metrics_add(LlmCounter::JniDirectBytes, j_len + n);
+    return (jint)n;
+}
+
+// embed() with n texts packed as UTF-8 in `utf8`, text i spanning
+// [offsets[i], offsets[i + 1]) of the n + 1 int32 offsets
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_embedDirect(
+        JNIEnv *env, jobject thiz, jobject j_utf8, jobject j_offsets, jint j_n,
+        jobject j_out, jboolean j_normalize) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model || !g_vocab) {
+        return env->NewStringUTF("{\"error\":\"model not loaded\"}");
+    }
+    const auto *utf8    = (const char *)direct_bytes(env, j_utf8, 0);
+    const auto *offsets = (const int32_t *)direct_bytes(env, j_offsets,
+                                                        ((jlong)j_n + 1) * sizeof(int32_t));
+    auto *out = (float *)direct_bytes(env, j_out, 0);
+    if (j_n < 0 || !utf8 || !offsets || !out) {
+        return env->NewStringUTF("{\"error\":\"inputs and output must be direct buffers\"}");
+    }
+    const jlong text_bytes = env->GetDirectBufferCapacity(j_utf8);
+    for (jint i = 0; i < j_n; ++i) {
+        if (offsets[i] < 0 || offsets[i] > offsets[i + 1] || offsets[i + 1] > text_bytes) {
+            return env->NewStringUTF("{\"error\":\"offsets out of range\"}");
+        }
+    }
+
+    const auto t_start = std::chrono::steady_clock::now();
+    std::vector<std::vector<llama_token>> inputs(j_n);
+    for (jint i = 0; i < j_n; ++i) {
+        inputs[i] = llm_embed_tokenize(g_vocab, utf8 + offsets[i],
+                                       (size_t)(offsets[i + 1] - offsets[i]));
+    }
+    const size_t capacity = (size_t)env->GetDirectBufferCapacity(j_out);
+    std::string json = embed_inputs(inputs, j_normalize, out, capacity, t_start);
+    llm_metrics_add(LlmCounter::JniDirectBytes,
+                    (size_t)offsets[j_n] - (size_t)offsets[0] + (j_n + 1) * sizeof(int32_t) +
+                    (size_t)j_n * llm_embed_dim(g_model) * sizeof(float));
+    return utf8_to_jstring(env, json);
+}
+
 // ---------------- Generate with Stats (JSON) ----------------
 JNIEXPORT jstring JNICALL
 Java_com_example_llmserverapp_LlamaBridge_generateWithStats(
         JNIEnv *env, jobject thiz, jstring j_prompt) {
-    ScopedLock lock(g_mutex);
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
     if (!g_ctx || !g_vocab) {
         LOGD("Generate called but model not loaded");
         return env->NewStringUTF("{\"error\":\"model not loaded\"}");
     }
 
     std::string user = jstring_to_std(env, j_prompt);
-    // Reuse core generate with smaller n_gen for stats
-    std::string generated = generate(user, /*n_gen=*/16, 0.7f, 0.9f, 40);
+    auto req = make_request(user, /*n_gen=*/16, 0.7f, 0.9f, 40);
+    const auto t0 = std::chrono::steady_clock::now();
+    llm_scheduler_submit(req);
+    llm_request_wait(*req);
+    const double duration_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t0).count();
+    if (!req->error.empty()) {
+        return utf8_to_jstring(env, "{\"error\":\"" + json_escape(req->error) + "\"}");
+    }
 
-    std::string escaped = json_escape(generated);
-    std::string json = "{\"text\":\"" + escaped +
-                       "\",\"generated\":" + std::to_string((int)generated.size()) +
+    // "generated" counts tokens, timed around the request only
+    std::string json = "{\"text\":\"" + json_escape(req->text) +
+                       "\",\"generated\":" + std::to_string(req->n_generated) +
+                       ",\"prompt_tokens\":" + std::to_string(req->prompt.size()) +
+                       ",\"duration_ms\":" + std::to_string(duration_ms) +
                        "}";
 
+    return utf8_to_jstring(env, json);
+}
+
+// ---------------- Metrics (JSON) ----------------
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_getMetrics(JNIEnv *env, jobject thiz, jboolean j_reset) {
+    std::string json = llm_metrics_json();
+    if (j_reset) llm_metrics_reset();
+    return env->NewStringUTF(json.c_str());
+}
+
+// ---------------- Benchmark (JSON) ----------------
+static std::vector<int> jint_array_to_vector(JNIEnv *env, jintArray arr) {
+    std::vector<int> out;
+    if (!arr) return out;
+    out.resize(env->GetArrayLength(arr));
+    env->GetIntArrayRegion(arr, 0, (jsize)out.size(), reinterpret_cast<jint *>(out.data()));
+    return out;
+}
+
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_runBenchmark(
+        JNIEnv *env, jobject thiz, jintArray j_threads, jintArray j_prompt_lens,
+        jintArray j_batch_sizes, jint j_gen_tokens, jint j_reps, jobjectArray j_profiles) {
+    // Exclusive, so new requests wait, and the scheduler paused: batch
+    // requests stay in flight without the model lock, and the benchmark
+    // contexts must not compete with them
+    std::unique_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model) {
+        return env->NewStringUTF("{\"error\":\"model not loaded\"}");
+    }
+
+    LlmBenchParams params;
+    auto threads = jint_array_to_vector(env, j_threads);
+    auto prompt_lens = jint_array_to_vector(env, j_prompt_lens);
+    auto batch_sizes = jint_array_to_vector(env, j_batch_sizes);
+    if (!threads.empty()) params.threads = threads;
+    if (!prompt_lens.empty()) params.n_prompt = prompt_lens;
+    if (!batch_sizes.empty()) params.n_batch = batch_sizes;
+    params.n_gen  = std::max(0, (int)j_gen_tokens);
+    params.n_reps = std::max(1, (int)j_reps);
+    const jsize n_profiles = j_profiles ? env->GetArrayLength(j_profiles) : 0;
+    for (jsize i = 0; i < n_profiles; ++i) {
+        auto j_name = (jstring)env->GetObjectArrayElement(j_profiles, i);
+        params.profiles.push_back(jstring_to_std(env, j_name));
+        env->DeleteLocalRef(j_name);
+    }
+
+    LOGD("Benchmark: %zu configurations",
+         params.threads.size() * params.n_prompt.size() * params.n_batch.size() *
+         std::max<size_t>(1, params.profiles.size()));
+    llm_scheduler_pause();
+    std::string json = llm_bench_run(g_model, params, g_load_ms);
+    llm_scheduler_resume();
+    LOGD("Benchmark: %s", json.c_str());
+    return env->NewStringUTF(json.c_str());
+}
+
+// Embedding throughput for each max number of inputs per decode
+JNIEXPORT jstring JNICALL
+Java_com_example_llmserverapp_LlamaBridge_runEmbeddingBenchmark(
+        JNIEnv *env, jobject thiz, jintArray j_seqs, jint j_texts, jint j_tokens) {
+    std::shared_lock<std::shared_mutex> lock(g_mutex);
+    if (!g_model) {
+        return env->NewStringUTF("{\"error\":\"model not loaded\"}");
+    }
+    std::string json = llm_embed_bench(g_model, jint_array_to_vector(env, j_seqs),
+                                       j_texts, j_tokens);
+    LOGD("Embedding benchmark: %s", json.c_str());
     return env->NewStringUTF(json.c_str());
 }
 
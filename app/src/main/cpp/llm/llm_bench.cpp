@@ -0,0 +1,317 @@
+#include "llm_bench.h"
+#include "llm_ctx_profile.h"
+#include "llm_sampling.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <random>
+
+using bench_clock = std::chrono::steady_clock;
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static double ms_between(bench_clock::time_point a, bench_clock::time_point b) {
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+// Nearest-rank percentile of an unsorted sample
+static double percentile(std::vector<double> v, double q) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    size_t rank = (size_t)std::ceil(q * v.size());
+    return v[rank > 0 ? rank - 1 : 0];
+}
+
+static void mean_std(const std::vector<double> &v, double &mean, double &sd) {
+    mean = sd = 0.0;
+    if (v.empty()) return;
+    for (double x : v) mean += x;
+    mean /= v.size();
+    if (v.size() < 2) return;
+    for (double x : v) sd += (x - mean) * (x - mean);
+    sd = std::sqrt(sd / (v.size() - 1));
+}
+
+static std::string json_string(const char *s) {
+    std::string out = "\"";
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') out += '\\';
+        if ((unsigned char)*s >= 0x20) out += *s;
+    }
+    return out + "\"";
+}
+
+// KL(ref || p) of the softmax distributions of two logit vectors
+static double kl_divergence(const std::vector<float> &ref, const std::vector<float> &p) {
+    if (ref.empty() || ref.size() != p.size()) return -1.0;
+    const float ref_max = *std::max_element(ref.begin(), ref.end());
+    const float p_max   = *std::max_element(p.begin(), p.end());
+    double ref_sum = 0.0, p_sum = 0.0;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        ref_sum += std::exp((double)ref[i] - ref_max);
+        p_sum   += std::exp((double)p[i] - p_max);
+    }
+    const double ref_lse = ref_max + std::log(ref_sum);
+    const double p_lse   = p_max + std::log(p_sum);
+    double kl = 0.0;
+    for (size_t i = 0; i < ref.size(); ++i) {
+        const double lr = ref[i] - ref_lse;
+        kl += std::exp(lr) * (lr - (p[i] - p_lse));
+    }
+    return std::max(0.0, kl);
+}
+
+// Fraction of the reference's greedy tokens reproduced before the first
+// mismatch, -1 without a reference
+static double greedy_match(const std::vector<llama_token> &ref,
+                           const std::vector<llama_token> &out) {
+    if (ref.empty()) return -1.0;
+    size_t n = 0;
+    while (n < ref.size() && n < out.size() && ref[n] == out[n]) ++n;
+    return (double)n / ref.size();
+}
+
+// -----------------------------------------------------------------------------
+// One configuration
+// -----------------------------------------------------------------------------
+
+struct BenchRun {
+    double prefill_ms = 0.0;
+    double decode_ms  = 0.0;
+    double ttft_ms    = 0.0;
+    llama_perf_context_data perf{};
+    std::vector<float> logits;         // after the prompt, when captured
+    std::vector<llama_token> tokens;   // greedy output
+};
+
+// Output of the reference profile for one prompt length
+struct BenchRef {
+    std::vector<float> logits;
+    std::vector<llama_token> tokens;
+};
+
+// Decode the prompt from position 0 in chunks of n_batch; logits for the last
+// token only
+static bool decode_prompt(llama_context *ctx, llama_batch &batch,
+                          const std::vector<llama_token> &tokens, int n_batch) {
+    for (size_t i = 0; i < tokens.size(); i += n_batch) {
+        const int n = (int)std::min<size_t>(n_batch, tokens.size() - i);
+        batch.n_tokens = n;
+        for (int j = 0; j < n; ++j) {
+            batch.token[j]     = tokens[i + j];
+            batch.pos[j]       = (llama_pos)(i + j);
+            batch.n_seq_id[j]  = 1;
+            batch.seq_id[j][0] = 0;
+            batch.logits[j]    = i + j + 1 == tokens.size();
+        }
+        if (llama_decode(ctx, batch) != 0) return false;
+    }
+    return true;
+}
+
+static bool bench_once(llama_context *ctx, llama_batch &batch, LlmSampler &smpl,
+                       const std::vector<llama_token> &prompt, int n_batch, int n_gen,
+                       bool capture, BenchRun &run, std::vector<double> &itl) {
+    llama_memory_clear(llama_get_memory(ctx), true);
+    llama_perf_context_reset(ctx);
+    run.tokens.clear();
+
+    const auto t0 = bench_clock::now();
+    if (!decode_prompt(ctx, batch, prompt, n_batch)) return false;
+    const auto t1 = bench_clock::now();
+    llama_token tok = llm_sampler_sample(smpl, llama_get_logits_ith(ctx, -1), 0.0f, 1.0f, 0);
+    auto last = bench_clock::now();
+
+    run.prefill_ms = ms_between(t0, t1);
+    run.ttft_ms    = ms_between(t0, last);
+    run.tokens.push_back(tok);
+    if (capture) {
+        // Outside the timed spans: the copy is n_vocab floats
+        const float *logits = llama_get_logits_ith(ctx, -1);
+        run.logits.assign(logits, logits + llama_vocab_n_tokens(
+                llama_model_get_vocab(llama_get_model(ctx))));
+        last = bench_clock::now();
+    }
+
+    const auto t2 = last;
+    for (int i = 0; i < n_gen; ++i) {
+        batch.n_tokens     = 1;
+        batch.token[0]     = tok;
+        batch.pos[0]       = (llama_pos)(prompt.size() + i);
+        batch.n_seq_id[0]  = 1;
+        batch.seq_id[0][0] = 0;
+        batch.logits[0]    = true;
+        if (llama_decode(ctx, batch) != 0) return false;
+        tok = llm_sampler_sample(smpl, llama_get_logits_ith(ctx, -1), 0.0f, 1.0f, 0);
+        run.tokens.push_back(tok);
+
+        const auto now = bench_clock::now();
+        itl.push_back(ms_between(last, now));
+        last = now;
+    }
+    run.decode_ms = ms_between(t2, last);
+    run.perf      = llama_perf_context(ctx);
+    return true;
+}
+
+// `ref_out`: capture this run's output as the quality reference.
+// `ref_in`: compare this run's output against it.
+static std::string bench_config(llama_model *model, const LlmCtxProfile *profile,
+                                int n_threads, int n_batch, int n_prompt,
+                                const LlmBenchParams &params,
+                                BenchRef *ref_out, const BenchRef *ref_in) {
+    llama_context_params cparams = llama_context_default_params();
+    if (profile) llm_ctx_profile_apply(*profile, cparams);
+    // n_batch 0: the profile's own batch sizes
+    if (n_batch > 0 || !profile) {
+        cparams.n_batch  = (uint32_t)n_batch;
+        cparams.n_ubatch = (uint32_t)n_batch;
+    }
+    n_batch = (int)cparams.n_batch;
+
+    char buf[1024];
+    int n = snprintf(buf, sizeof(buf), "{\"threads\":%d,\"n_batch\":%d,\"n_ubatch\":%u,\"n_prompt\":%d",
+                     n_threads, n_batch, cparams.n_ubatch, n_prompt);
+    std::string out(buf, n);
+    if (profile) out += ",\"profile\":" + llm_ctx_profile_json(model, *profile);
+
+    cparams.n_ctx           = (uint32_t)(n_prompt + params.n_gen + 1);
+    cparams.n_seq_max       = 1;
+    cparams.n_threads       = n_threads;
+    cparams.n_threads_batch = n_threads;
+    cparams.no_perf         = false;
+
+    const auto t_init = bench_clock::now();
+    llama_context *ctx = llama_init_from_model(model, cparams);
+    const double init_ms = ms_between(t_init, bench_clock::now());
+    if (!ctx) return out + ",\"error\":\"context creation failed\"}";
+
+    const llama_vocab *vocab = llama_model_get_vocab(model);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    // Synthetic prompt: BOS + random tokens, the same for every configuration
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<llama_token> pick(0, n_vocab - 1);
+    std::vector<llama_token> prompt;
+    prompt.reserve(n_prompt);
+    if (llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL) prompt.push_back(llama_vocab_bos(vocab));
+    while ((int)prompt.size() < n_prompt) prompt.push_back(pick(rng));
+
+    LlmSampler smpl;
+    llm_sampler_init(smpl, n_vocab, 1234);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    // Warmup: first decode pays for graph allocation and page faults
+    std::vector<double> itl;
+    BenchRun run;
+    bool ok = bench_once(ctx, batch, smpl, {prompt[0]}, n_batch, 1, false, run, itl);
+
+    std::vector<double> prefill_tps, decode_tps, perf_prefill_tps, perf_decode_tps, ttft;
+    itl.clear();
+    itl.reserve((size_t)params.n_reps * params.n_gen);
+    BenchRun first;
+    for (int r = 0; ok && r < params.n_reps; ++r) {
+        const bool capture = r == 0 && (ref_out || ref_in);
+        ok = bench_once(ctx, batch, smpl, prompt, n_batch, params.n_gen, capture, run, itl);
+        if (!ok) break;
+        if (capture) first = run;
+        prefill_tps.push_back(1e3 * n_prompt / run.prefill_ms);
+        if (params.n_gen > 0) decode_tps.push_back(1e3 * params.n_gen / run.decode_ms);
+        if (run.perf.t_p_eval_ms > 0) {
+            perf_prefill_tps.push_back(1e3 * run.perf.n_p_eval / run.perf.t_p_eval_ms);
+        }
+        if (run.perf.t_eval_ms > 0) {
+            perf_decode_tps.push_back(1e3 * run.perf.n_eval / run.perf.t_eval_ms);
+        }
+        ttft.push_back(run.ttft_ms);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    if (!ok) return out + ",\"error\":\"llama_decode failed\"}";
+
+    double pf_mean, pf_sd, dc_mean, dc_sd, ppf, ppf_sd, pdc, pdc_sd;
+    mean_std(prefill_tps, pf_mean, pf_sd);
+    mean_std(decode_tps, dc_mean, dc_sd);
+    mean_std(perf_prefill_tps, ppf, ppf_sd);
+    mean_std(perf_decode_tps, pdc, pdc_sd);
+
+    n = snprintf(buf, sizeof(buf),
+                 ",\"ctx_init_ms\":%.2f"
+                 ",\"prefill_tps\":{\"mean\":%.2f,\"std\":%.2f}"
+                 ",\"decode_tps\":{\"mean\":%.2f,\"std\":%.2f}"
+                 ",\"perf_prefill_tps\":%.2f,\"perf_decode_tps\":%.2f"
+                 ",\"ttft_ms\":{\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f}"
+                 ",\"itl_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}}",
+                 init_ms, pf_mean, pf_sd, dc_mean, dc_sd, ppf, pdc,
+                 percentile(ttft, 0.50), percentile(ttft, 0.90), percentile(ttft, 0.99),
+                 percentile(itl, 0.50), percentile(itl, 0.90), percentile(itl, 0.99),
+                 percentile(itl, 1.0));
+    out.append(buf, n - 1);   // reopen the object
+
+    if (ref_out) {
+        ref_out->logits = std::move(first.logits);
+        ref_out->tokens = std::move(first.tokens);
+    } else if (ref_in) {
+        n = snprintf(buf, sizeof(buf), ",\"quality\":{\"kl\":%.6f,\"greedy_match\":%.3f}",
+                     kl_divergence(ref_in->logits, first.logits),
+                     greedy_match(ref_in->tokens, first.tokens));
+        out.append(buf, n);
+    }
+    return out + "}";
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+std::string llm_bench_run(llama_model *model, const LlmBenchParams &params, double load_ms) {
+    char desc[128];
+    llama_model_desc(model, desc, sizeof(desc));
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             ",\"size_bytes\":%llu,\"n_params\":%llu,\"load_ms\":%.2f,\"n_gen\":%d,\"n_reps\":%d",
+             (unsigned long long)llama_model_size(model),
+             (unsigned long long)llama_model_n_params(model),
+             load_ms, params.n_gen, params.n_reps);
+    std::string out = "{\"model\":" + json_string(desc) + buf + ",\"results\":[";
+
+    // No profiles: one pass with llama's default context
+    std::vector<const LlmCtxProfile *> profiles;
+    for (const std::string &name : params.profiles) {
+        if (const LlmCtxProfile *p = llm_ctx_profile_find(name)) profiles.push_back(p);
+    }
+    if (profiles.empty()) profiles.push_back(nullptr);
+
+    // Reference output of the first profile, per prompt length
+    std::map<int, BenchRef> refs;
+    bool first = true;
+    for (const LlmCtxProfile *profile : profiles) {
+        const bool is_ref = profile && profile == profiles.front() && profiles.size() > 1;
+        for (int t : params.threads) {
+            for (int b : params.n_batch) {
+                for (int p : params.n_prompt) {
+                    if (t <= 0 || b < 0 || (b == 0 && !profile) || p <= 0) continue;
+                    BenchRef *ref_out = nullptr;
+                    const BenchRef *ref_in = nullptr;
+                    auto it = refs.find(p);
+                    if (is_ref && it == refs.end()) {
+                        ref_out = &refs[p];
+                    } else if (!is_ref && it != refs.end()) {
+                        ref_in = &it->second;
+                    }
+                    if (!first) out += ',';
+                    first = false;
+                    out += bench_config(model, profile, t, b, p, params, ref_out, ref_in);
+                }
+            }
+        }
+    }
+    return out + "]}";
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// ============================================================================
+// Benchmark
+// ============================================================================
+//
+// Measures prompt evaluation and decoding separately over a grid of context
+// profiles, thread counts, prompt lengths and batch sizes. Each configuration gets a fresh
+// context (its creation time is reported, not counted), one warmup decode,
+// then `n_reps` runs of: prefill a synthetic prompt in n_batch chunks, then
+// decode n_gen tokens one at a time with greedy sampling.
+//
+// Every llama_decode is timed with steady_clock; TTFT is the prefill plus the
+// first sampled token, inter-token latency (ITL) the time of each following
+// decode + sample. Throughput is reported from those timers and, as a cross
+// check, from llama_perf_context.
+//
+// With context profiles (llm_ctx_profile.h) each configuration runs with the
+// profile's KV cache types and flash attention, and reports the profile's KV
+// size at its own n_ctx. The first profile is the quality reference: for the
+// others, `kl` is the KL divergence of the next-token distribution after the
+// prompt from the reference's, and `greedy_match` the fraction of the n_gen
+// greedy tokens produced before diverging from the reference's output.
+//
+// Shared by the JNI entry point and the host CLI (tools/llm_bench.cpp), so it
+// only depends on llama.h, the sampler and the profile table.
+// ============================================================================
+
+struct LlmBenchParams {
+    std::vector<int> threads  = {4};
+    std::vector<int> n_prompt = {128};
+    std::vector<int> n_batch  = {512};
+    std::vector<std::string> profiles;   // empty: llama's default context
+    int n_gen  = 32;
+    int n_reps = 3;
+};
+
+// Run the grid on `model` and return the results as JSON. `load_ms` is the
+// model load time measured by the caller and is reported as is.
+std::string llm_bench_run(llama_model *model, const LlmBenchParams &params, double load_ms);
@@ -0,0 +1,209 @@
+#include "llm_chat.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <android/log.h>
+
+#define LOGC(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_CHAT", __VA_ARGS__)
+
+// Template of the live model; empty means the Alpaca fallback
+static std::string g_template;
+
+static std::atomic<uint64_t> g_renders{0};
+static std::atomic<uint64_t> g_render_us{0};
+static std::atomic<uint64_t> g_deltas{0};
+static std::atomic<uint64_t> g_unstable{0};   // deltas whose past did not render as a prefix
+static std::atomic<uint64_t> g_fallbacks{0};  // renders whose placeholders the template lost
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Alpaca instruction format, the format used before templates came from
+// the model
+static std::string render_fallback(const std::vector<LlmChatMessage> &messages,
+                                   bool add_assistant) {
+    std::string out;
+    for (const LlmChatMessage &m : messages) {
+        if (m.role == "system") {
+            out += m.content + "\n\n";
+        } else if (m.role == "assistant") {
+            out += "### Response:\n" + m.content + "\n\n";
+        } else {
+            out += "### Instruction:\n" + m.content + "\n\n";
+        }
+    }
+    if (add_assistant) out += "### Response:\n";
+    return out;
+}
+
+// llama_chat_apply_template with g_template; false if it rejects the template
+static bool render_template(const std::vector<LlmChatMessage> &messages, bool add_assistant,
+                            std::string &out) {
+    std::vector<llama_chat_message> chat;
+    chat.reserve(messages.size());
+    size_t n_chars = 0;
+    for (const LlmChatMessage &m : messages) {
+        chat.push_back({m.role.c_str(), m.content.c_str()});
+        n_chars += m.role.size() + m.content.size();
+    }
+    out.resize(2 * n_chars + 256);
+    int32_t n = llama_chat_apply_template(g_template.c_str(), chat.data(), chat.size(),
+                                          add_assistant, &out[0], (int32_t)out.size());
+    if (n > (int32_t)out.size()) {
+        out.resize(n);
+        n = llama_chat_apply_template(g_template.c_str(), chat.data(), chat.size(),
+                                      add_assistant, &out[0], (int32_t)out.size());
+    }
+    if (n < 0) return false;
+    out.resize(n);
+    return true;
+}
+
+// Stands in for the content of message i while the template is applied: no
+// whitespace for a template to trim, nothing it would escape
+static std::string placeholder(size_t i) {
+    return "\x1f" + std::to_string(i) + "\x1f";
+}
+
+// Apply the template (or the Alpaca format) to `messages` with their content
+// replaced by placeholders, then put the content back as separate segments.
+// False if the rendering does not hold every placeholder once, in order.
+static bool render_segments(const std::vector<LlmChatMessage> &messages, bool add_assistant,
+                            bool fallback, std::vector<LlmChatSegment> &out) {
+    std::vector<LlmChatMessage> masked = messages;
+    for (size_t i = 0; i < masked.size(); ++i) masked[i].content = placeholder(i);
+    std::string text;
+    if (fallback) {
+        text = render_fallback(masked, add_assistant);
+    } else if (!render_template(masked, add_assistant, text)) {
+        return false;
+    }
+
+    out.clear();
+    size_t pos = 0;
+    for (size_t i = 0; i < messages.size(); ++i) {
+        const std::string mark = placeholder(i);
+        const size_t at = text.find(mark, pos);
+        if (at == std::string::npos) return false;
+        if (at > pos) out.push_back({text.substr(pos, at - pos), false});
+        if (!messages[i].content.empty()) out.push_back({messages[i].content, true});
+        pos = at + mark.size();
+    }
+    if (pos < text.size()) out.push_back({text.substr(pos), false});
+    for (const LlmChatSegment &seg : out) {
+        if (!seg.content && seg.text.find('\x1f') != std::string::npos) return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+void llm_chat_init(const llama_model *model) {
+    const char *tmpl = model ? llama_model_chat_template(model, nullptr) : nullptr;
+    g_template = tmpl ? tmpl : "";
+    if (g_template.empty()) {
+        LOGC("Model has no chat template, using the Alpaca format");
+        return;
+    }
+    std::vector<LlmChatSegment> probe;
+    if (!render_segments({{"user", "hi"}}, true, false, probe)) {
+        LOGC("Chat template not supported by llama_chat_apply_template, using the Alpaca format");
+        g_template.clear();
+        return;
+    }
+    LOGC("Using the model's chat template (%zu bytes)", g_template.size());
+}
+
+void llm_chat_reset() {
+    g_template.clear();
+}
+
+std::vector<LlmChatSegment> llm_chat_render(const std::vector<LlmChatMessage> &messages,
+                                            bool add_assistant) {
+    const int64_t t0 = now_us();
+    std::vector<LlmChatSegment> out;
+    if (g_template.empty() || !render_segments(messages, add_assistant, false, out)) {
+        if (!g_template.empty()) {
+            g_fallbacks++;
+            LOGC("Template lost a message placeholder, using the Alpaca format");
+        }
+        render_segments(messages, add_assistant, true, out);
+    }
+    g_renders++;
+    g_render_us += (uint64_t)(now_us() - t0);
+    return out;
+}
+
+bool llm_chat_render_delta(const std::vector<LlmChatMessage> &past,
+                           const LlmChatMessage &message, std::vector<LlmChatSegment> &out) {
+    g_deltas++;
+    if (past.empty()) {
+        out = llm_chat_render({message}, true);
+        return true;
+    }
+
+    std::vector<LlmChatMessage> all = past;
+    all.push_back(message);
+    const std::string before = llm_chat_text(llm_chat_render(past, false));
+    const std::vector<LlmChatSegment> after = llm_chat_render(all, true);
+    if (llm_chat_text(after).compare(0, before.size(), before) != 0) {
+        g_unstable++;
+        return false;
+    }
+    // The segments past `before`, the first one cut where it starts
+    out.clear();
+    size_t pos = 0;
+    for (const LlmChatSegment &seg : after) {
+        const size_t end = pos + seg.text.size();
+        if (end > before.size()) {
+            const size_t skip = pos < before.size() ? before.size() - pos : 0;
+            out.push_back({seg.text.substr(skip), seg.content});
+        }
+        pos = end;
+    }
+    return true;
+}
+
+std::string llm_chat_text(const std::vector<LlmChatSegment> &segments) {
+    std::string out;
+    for (const LlmChatSegment &seg : segments) out += seg.text;
+    return out;
+}
+
+std::string llm_chat_stats_json() {
+    std::string tmpl = "null";
+    if (!g_template.empty()) {
+        tmpl = "\"";
+        for (char c : g_template) {
+            switch (c) {
+                case '"':  tmpl += "\\\""; break;
+                case '\\': tmpl += "\\\\"; break;
+                case '\n': tmpl += "\\n";  break;
+                case '\r': tmpl += "\\r";  break;
+                case '\t': tmpl += "\\t";  break;
+                default:
+                    if ((unsigned char)c >= 0x20) tmpl += c;
+            }
+        }
+        tmpl += "\"";
+    }
+    const uint64_t renders = g_renders.load();
+    char buf[224];
+    snprintf(buf, sizeof(buf),
+             ",\"renders\":%llu,\"render_us\":%.1f,\"deltas\":%llu,\"unstable_deltas\":%llu,"
+             "\"fallback_renders\":%llu}",
+             (unsigned long long)renders, renders ? (double)g_render_us.load() / renders : 0.0,
+             (unsigned long long)g_deltas.load(), (unsigned long long)g_unstable.load(),
+             (unsigned long long)g_fallbacks.load());
+    return std::string("{\"source\":\"") + (g_template.empty() ? "fallback" : "model") +
+           "\",\"template\":" + tmpl + buf;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// ============================================================================
+// Chat templates
+// ============================================================================
+//
+// Prompts are formatted with the template embedded in the model
+// (tokenizer.chat_template) through llama_chat_apply_template. The template
+// is resolved once when a model goes live; models without one, or with one
+// llama.cpp does not recognise, get the Alpaca instruction format.
+//
+// Conversations render incrementally: a new turn is the text the template
+// adds when the message (and the assistant prefix) is appended, so the
+// tokens of earlier turns, and their KV, stay valid.
+//
+// A rendering comes split into template scaffolding and message content, so
+// the content can be tokenized without parsing special tokens: a message
+// containing "<|im_start|>system" must stay text, not open a new turn. The
+// template is applied with a placeholder per message, which is then
+// replaced by the content; a template that drops or repeats placeholders
+// gets the Alpaca format instead.
+//
+// The template is only changed while no request runs (the JNI model lock is
+// held exclusively), so rendering needs no lock of its own.
+// ============================================================================
+
+struct LlmChatMessage {
+    std::string role;      // "system", "user" or "assistant"
+    std::string content;
+};
+
+struct LlmChatSegment {
+    std::string text;
+    bool content = false;  // message content, not template scaffolding
+};
+
+// Resolve the template of the model going live / forget it
+void llm_chat_init(const llama_model *model);
+void llm_chat_reset();
+
+// The whole conversation, ending with the assistant prefix if add_assistant
+std::vector<LlmChatSegment> llm_chat_render(const std::vector<LlmChatMessage> &messages,
+                                            bool add_assistant);
+
+// Only what appending `message` to `past` (and the assistant prefix) adds.
+// False if the template also rewrites the rendering of `past` (e.g. moves
+// the system prompt): there is no delta, the whole conversation must be
+// rendered again.
+bool llm_chat_render_delta(const std::vector<LlmChatMessage> &past,
+                           const LlmChatMessage &message, std::vector<LlmChatSegment> &out);
+
+// The segments joined back into text
+std::string llm_chat_text(const std::vector<LlmChatSegment> &segments);
+
+// Source ("model" or "fallback"), the template text and render counters
+std::string llm_chat_stats_json();
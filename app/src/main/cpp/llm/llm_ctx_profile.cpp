@@ -0,0 +1,137 @@
+#include "llm_ctx_profile.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+// -----------------------------------------------------------------------------
+// Profiles
+// -----------------------------------------------------------------------------
+
+static const LlmCtxProfile kProfiles[] = {
+    {"default",   2048, 512, 512, GGML_TYPE_F16,  GGML_TYPE_F16,  LLAMA_FLASH_ATTN_TYPE_AUTO,
+     "f16 KV, flash attention where supported"},
+    {"f16_fa",    2048, 512, 512, GGML_TYPE_F16,  GGML_TYPE_F16,  LLAMA_FLASH_ATTN_TYPE_ENABLED,
+     "f16 KV, flash attention forced on"},
+    {"q8_0",      4096, 512, 512, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, LLAMA_FLASH_ATTN_TYPE_ENABLED,
+     "q8_0 KV: twice the context in about the default KV memory"},
+    {"q4_0_long", 8192, 512, 256, GGML_TYPE_Q4_0, GGML_TYPE_Q4_0, LLAMA_FLASH_ATTN_TYPE_ENABLED,
+     "q4_0 KV: long context, some quality loss"},
+    {"low_mem",   1024, 256, 128, GGML_TYPE_Q8_0, GGML_TYPE_Q8_0, LLAMA_FLASH_ATTN_TYPE_ENABLED,
+     "q8_0 KV, short context and small batches for low-RAM devices"},
+};
+
+// Bytes per element as a fraction: block size in bytes / elements per block
+static void type_size(ggml_type t, uint64_t &num, uint64_t &den) {
+    switch (t) {
+        case GGML_TYPE_F32:    num = 4;  den = 1;  return;
+        case GGML_TYPE_F16:
+        case GGML_TYPE_BF16:   num = 2;  den = 1;  return;
+        case GGML_TYPE_Q8_0:   num = 34; den = 32; return;
+        case GGML_TYPE_Q5_1:   num = 24; den = 32; return;
+        case GGML_TYPE_Q5_0:   num = 22; den = 32; return;
+        case GGML_TYPE_Q4_1:   num = 20; den = 32; return;
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_IQ4_NL: num = 18; den = 32; return;
+        default:               num = 2;  den = 1;  return;
+    }
+}
+
+static const char *type_name(ggml_type t) {
+    switch (t) {
+        case GGML_TYPE_F32:  return "f32";
+        case GGML_TYPE_F16:  return "f16";
+        case GGML_TYPE_BF16: return "bf16";
+        case GGML_TYPE_Q8_0: return "q8_0";
+        case GGML_TYPE_Q5_1: return "q5_1";
+        case GGML_TYPE_Q5_0: return "q5_0";
+        case GGML_TYPE_Q4_1: return "q4_1";
+        case GGML_TYPE_Q4_0: return "q4_0";
+        default:             return "other";
+    }
+}
+
+// Integer metadata "<arch>.<key>", or fallback if the model does not set it
+static int64_t arch_meta(const llama_model *model, const char *key, int64_t fallback) {
+    char arch[64], name[128], val[32];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) < 0) {
+        return fallback;
+    }
+    snprintf(name, sizeof(name), "%s.%s", arch, key);
+    if (llama_model_meta_val_str(model, name, val, sizeof(val)) < 0) return fallback;
+    return strtoll(val, nullptr, 10);
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+const LlmCtxProfile *llm_ctx_profiles(int *n) {
+    *n = (int)(sizeof(kProfiles) / sizeof(kProfiles[0]));
+    return kProfiles;
+}
+
+const LlmCtxProfile *llm_ctx_profile_find(const std::string &name) {
+    for (const LlmCtxProfile &p : kProfiles) {
+        if (name == p.name) return &p;
+    }
+    return nullptr;
+}
+
+void llm_ctx_profile_apply(const LlmCtxProfile &p, llama_context_params &cparams,
+                           uint32_t n_ctx) {
+    cparams.n_ctx           = n_ctx > 0 ? n_ctx : p.n_ctx;
+    cparams.n_batch         = p.n_batch;
+    cparams.n_ubatch        = p.n_ubatch;
+    cparams.type_k          = p.type_k;
+    cparams.type_v          = p.type_v;
+    cparams.flash_attn_type = p.flash_attn;
+    // Quantized V is only implemented in the flash attention kernels
+    if (p.type_v != GGML_TYPE_F16 && p.type_v != GGML_TYPE_F32) {
+        cparams.flash_attn_type = LLAMA_FLASH_ATTN_TYPE_ENABLED;
+    }
+}
+
+uint64_t llm_ctx_profile_kv_bytes(const llama_model *model, const LlmCtxProfile &p,
+                                  uint32_t n_ctx) {
+    if (llama_model_is_recurrent(model)) return 0;
+    if (n_ctx == 0) n_ctx = p.n_ctx;
+
+    const int64_t n_layer   = llama_model_n_layer(model);
+    const int64_t n_head    = llama_model_n_head(model);
+    const int64_t n_head_kv = llama_model_n_head_kv(model);
+    const int64_t n_embd    = llama_model_n_embd(model);
+    const int64_t head_k = arch_meta(model, "attention.key_length",
+                                     n_head > 0 ? n_embd / n_head : 0);
+    const int64_t head_v = arch_meta(model, "attention.value_length", head_k);
+
+    uint64_t k_num, k_den, v_num, v_den;
+    type_size(p.type_k, k_num, k_den);
+    type_size(p.type_v, v_num, v_den);
+    const uint64_t k = (uint64_t)(n_head_kv * head_k) * k_num / k_den;
+    const uint64_t v = (uint64_t)(n_head_kv * head_v) * v_num / v_den;
+    return (uint64_t)n_layer * n_ctx * (k + v);
+}
+
+std::string llm_ctx_profile_json(const llama_model *model, const LlmCtxProfile &p,
+                                 uint32_t n_ctx) {
+    if (n_ctx == 0) n_ctx = p.n_ctx;
+    llama_context_params cp = llama_context_default_params();
+    llm_ctx_profile_apply(p, cp, n_ctx);
+
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf),
+                     "{\"name\":\"%s\",\"n_ctx\":%u,\"n_batch\":%u,\"n_ubatch\":%u,"
+                     "\"type_k\":\"%s\",\"type_v\":\"%s\",\"flash_attn\":\"%s\","
+                     "\"summary\":\"%s\"",
+                     p.name, n_ctx, p.n_batch, p.n_ubatch, type_name(p.type_k),
+                     type_name(p.type_v), llama_flash_attn_type_name(cp.flash_attn_type),
+                     p.summary);
+    std::string out(buf, n);
+    if (model) {
+        const uint64_t kv = llm_ctx_profile_kv_bytes(model, p, n_ctx);
+        n = snprintf(buf, sizeof(buf), ",\"kv_mb\":%.1f,\"kv_bytes_per_token\":%llu",
+                     kv / 1048576.0, (unsigned long long)(n_ctx ? kv / n_ctx : 0));
+        out.append(buf, n);
+    }
+    return out + "}";
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "llama.h"
+
+// ============================================================================
+// Context profiles
+// ============================================================================
+//
+// Named presets for the context shape: n_ctx, n_batch/n_ubatch, the KV cache
+// types and flash attention. The KV cache is the largest allocation after
+// the weights and grows linearly with n_ctx; storing it as q8_0 halves it
+// (vs f16) at a negligible quality cost, q4_0 quarters it at a measurable
+// one. llama.cpp only supports a quantized V cache with flash attention, so
+// those profiles force it on.
+//
+// The KV size reported here is an estimate from the model hyperparameters
+// (layers x KV heads x head size x n_ctx x bytes per element). It is exact
+// for plain attention and an upper bound for sliding-window models.
+// ============================================================================
+
+struct LlmCtxProfile {
+    const char *name;
+    uint32_t n_ctx;
+    uint32_t n_batch;
+    uint32_t n_ubatch;
+    ggml_type type_k;
+    ggml_type type_v;
+    llama_flash_attn_type flash_attn;
+    const char *summary;
+};
+
+// All profiles; the first is the default
+const LlmCtxProfile *llm_ctx_profiles(int *n);
+
+// nullptr if there is no profile of that name
+const LlmCtxProfile *llm_ctx_profile_find(const std::string &name);
+
+// Copy the profile into cparams. n_ctx > 0 overrides the profile's n_ctx.
+void llm_ctx_profile_apply(const LlmCtxProfile &p, llama_context_params &cparams,
+                           uint32_t n_ctx = 0);
+
+// Estimated KV cache bytes of `model` with the profile's cache types at
+// n_ctx cells (0: the profile's n_ctx). 0 for recurrent models.
+uint64_t llm_ctx_profile_kv_bytes(const llama_model *model, const LlmCtxProfile &p,
+                                  uint32_t n_ctx = 0);
+
+// One JSON object describing the profile, with kv_mb when model is set
+std::string llm_ctx_profile_json(const llama_model *model, const LlmCtxProfile &p,
+                                 uint32_t n_ctx = 0);
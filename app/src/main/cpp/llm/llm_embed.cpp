@@ -0,0 +1,288 @@
+#include "llm_embed.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <android/log.h>
+
+#define LOGEM(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_EMBED", __VA_ARGS__)
+
+// llama.cpp's limit on sequences per context
+static constexpr int kMaxSeq = 256;
+
+static std::mutex         g_mutex;
+static LlmEmbedParams     g_params;
+static llama_context     *g_ctx   = nullptr;
+static const llama_model *g_model = nullptr;   // model of g_ctx
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static llama_context *create_ctx(llama_model *model, const LlmEmbedParams &p) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.embeddings      = true;
+    cparams.pooling_type    = p.pooling;
+    cparams.n_ctx           = (uint32_t)p.n_batch;   // one batch of inputs at a time
+    cparams.n_batch         = (uint32_t)p.n_batch;
+    cparams.n_ubatch        = (uint32_t)p.n_batch;   // a sequence must fit one ubatch
+    cparams.n_seq_max       = (uint32_t)std::max(1, std::min(p.n_seq_max, kMaxSeq));
+    cparams.kv_unified      = true;
+    cparams.n_threads       = p.n_threads;
+    cparams.n_threads_batch = p.n_threads;
+    return llama_init_from_model(model, cparams);
+}
+
+// Caller holds g_mutex
+static bool ensure_ctx(llama_model *model, std::string &error) {
+    if (g_ctx && g_model == model) return true;
+    if (g_ctx) llama_free(g_ctx);
+    g_ctx   = create_ctx(model, g_params);
+    g_model = g_ctx ? model : nullptr;
+    if (!g_ctx) {
+        error = "failed to create the embedding context";
+        return false;
+    }
+    LOGEM("Embedding context: pooling %d, n_batch %d, n_seq_max %u",
+         (int)llama_pooling_type(g_ctx), g_params.n_batch, llama_n_seq_max(g_ctx));
+    return true;
+}
+
+static int ctx_dim(llama_context *ctx) {
+    const llama_model *model = llama_get_model(ctx);
+    return llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK
+           ? (int)llama_model_n_cls_out(model) : llama_model_n_embd(model);
+}
+
+static void l2_normalize(float *v, int n) {
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) sum += (double)v[i] * v[i];
+    if (sum <= 0.0) return;
+    const float inv = (float)(1.0 / std::sqrt(sum));
+    for (int i = 0; i < n; ++i) v[i] *= inv;
+}
+
+// Copy the vectors of the n_seqs inputs in the batch to out, one per seq id.
+// Without pooling, average the per-token outputs of each sequence. Empty
+// inputs have no tokens in the batch and get a zero vector.
+static bool read_outputs(llama_context *ctx, const llama_batch &batch, int n_seqs,
+                         int dim, float *out) {
+    const bool pooled = llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE;
+    std::fill(out, out + (size_t)n_seqs * dim, 0.0f);
+    std::vector<int> counts(n_seqs, 0);
+    if (pooled) {
+        for (int i = 0; i < batch.n_tokens; ++i) counts[batch.seq_id[i][0]]++;
+        for (int s = 0; s < n_seqs; ++s) {
+            if (counts[s] == 0) continue;
+            const float *v = llama_get_embeddings_seq(ctx, s);
+            if (!v) return false;
+            memcpy(out + (size_t)s * dim, v, sizeof(float) * dim);
+        }
+        return true;
+    }
+
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        const float *v = llama_get_embeddings_ith(ctx, i);
+        if (!v) return false;
+        const llama_seq_id s = batch.seq_id[i][0];
+        float *dst = out + (size_t)s * dim;
+        for (int k = 0; k < dim; ++k) dst[k] += v[k];
+        counts[s]++;
+    }
+    for (int s = 0; s < n_seqs; ++s) {
+        if (counts[s] == 0) continue;
+        const float inv = 1.0f / counts[s];
+        float *dst = out + (size_t)s * dim;
+        for (int k = 0; k < dim; ++k) dst[k] *= inv;
+    }
+    return true;
+}
+
+// Pack inputs greedily into batches of at most n_batch tokens and n_seq_max
+// sequences, decode each and write the vectors in input order. Reports the
+// number of decodes in n_decodes if set.
+static bool embed_all(llama_context *ctx, const std::vector<std::vector<llama_token>> &inputs,
+                      int n_seq_max, bool normalize, float *out, std::string &error,
+                      int *n_decodes = nullptr) {
+    const int n_batch = (int)llama_n_batch(ctx);
+    n_seq_max = std::min(n_seq_max, (int)llama_n_seq_max(ctx));
+    const int dim = ctx_dim(ctx);
+    const bool rank = llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK;
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    bool ok = true;
+    size_t first = 0;   // first input of the current batch
+    while (ok && first < inputs.size()) {
+        batch.n_tokens = 0;
+        size_t next = first;
+        while (next < inputs.size() && (int)(next - first) < n_seq_max) {
+            const int n = std::min((int)inputs[next].size(), n_batch);
+            if (batch.n_tokens > 0 && batch.n_tokens + n > n_batch) break;
+            const llama_seq_id seq = (llama_seq_id)(next - first);
+            for (int i = 0; i < n; ++i) {
+                const int j = batch.n_tokens++;
+                batch.token[j]     = inputs[next][i];
+                batch.pos[j]       = i;
+                batch.n_seq_id[j]  = 1;
+                batch.seq_id[j][0] = seq;
+                batch.logits[j]    = true;
+            }
+            ++next;
+        }
+
+        const int n_seqs = (int)(next - first);
+        float *dst = out + first * dim;
+        if (batch.n_tokens == 0) {
+            // Only empty inputs
+            std::fill(dst, dst + (size_t)n_seqs * dim, 0.0f);
+        } else {
+            if (mem) llama_memory_clear(mem, true);
+            if (llama_decode(ctx, batch) != 0) {
+                error = "llama_decode failed";
+                ok = false;
+                break;
+            }
+            if (n_decodes) ++*n_decodes;
+            if (!read_outputs(ctx, batch, n_seqs, dim, dst)) {
+                error = "no embeddings in the output";
+                ok = false;
+                break;
+            }
+        }
+        if (normalize && !rank) {
+            for (int s = 0; s < n_seqs; ++s) l2_normalize(dst + (size_t)s * dim, dim);
+        }
+        first = next;
+    }
+    llama_batch_free(batch);
+    return ok;
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+void llm_embed_configure(const LlmEmbedParams &params) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_params = params;
+    g_params.n_batch   = std::max(32, params.n_batch);
+    g_params.n_seq_max = std::max(1, std::min(params.n_seq_max, kMaxSeq));
+    g_params.n_threads = std::max(1, params.n_threads);
+    if (g_ctx) llama_free(g_ctx);
+    g_ctx   = nullptr;
+    g_model = nullptr;
+}
+
+void llm_embed_detach() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (g_ctx) llama_free(g_ctx);
+    g_ctx   = nullptr;
+    g_model = nullptr;
+}
+
+int llm_embed_dim(const llama_model *model) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    std::string error;
+    if (!ensure_ctx(const_cast<llama_model *>(model), error)) return 0;
+    return ctx_dim(g_ctx);
+}
+
+std::vector<llama_token> llm_embed_tokenize(const llama_vocab *vocab, const char *text, size_t len) {
+    std::vector<llama_token> tokens(len + 4);
+    int32_t n = llama_tokenize(vocab, text, (int32_t)len, tokens.data(),
+                               (int32_t)tokens.size(), /*add_special=*/true,
+                               /*parse_special=*/false);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, text, (int32_t)len, tokens.data(),
+                           (int32_t)tokens.size(), true, false);
+    }
+    tokens.resize(std::max(0, n));
+    return tokens;
+}
+
+bool llm_embed(llama_model *model, const std::vector<std::vector<llama_token>> &inputs,
+               bool normalize, float *out, size_t out_len, std::string &error) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!ensure_ctx(model, error)) return false;
+    if (inputs.size() * (size_t)ctx_dim(g_ctx) > out_len) {
+        error = "output buffer too small";
+        return false;
+    }
+    return embed_all(g_ctx, inputs, g_params.n_seq_max, normalize, out, error);
+}
+
+std::string llm_embed_bench(llama_model *model, const std::vector<int> &n_seqs,
+                            int n_texts, int n_tokens) {
+    LlmEmbedParams params;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        params = g_params;
+    }
+    n_tokens = std::max(1, std::min(n_tokens, params.n_batch));
+    n_texts  = std::max(1, n_texts);
+
+    // Synthetic inputs, different per text so nothing can be shared
+    const int32_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<llama_token> pick(0, n_vocab - 1);
+    std::vector<std::vector<llama_token>> inputs(n_texts);
+    for (auto &in : inputs) {
+        in.resize(n_tokens);
+        for (auto &t : in) t = pick(rng);
+    }
+
+    char buf[512];
+    snprintf(buf, sizeof(buf), "{\"n_texts\":%d,\"n_tokens\":%d,\"n_batch\":%d,\"results\":[",
+             n_texts, n_tokens, params.n_batch);
+    std::string out = buf;
+    bool first = true;
+    for (int n : n_seqs) {
+        if (n <= 0) continue;
+        if (!first) out += ',';
+        first = false;
+
+        params.n_seq_max = std::min(n, kMaxSeq);
+        const auto t_init = std::chrono::steady_clock::now();
+        llama_context *ctx = create_ctx(model, params);
+        if (!ctx) {
+            snprintf(buf, sizeof(buf), "{\"n_seqs\":%d,\"error\":\"context creation failed\"}", n);
+            out += buf;
+            continue;
+        }
+        const double init_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t_init).count();
+
+        std::vector<float> vectors((size_t)n_texts * ctx_dim(ctx));
+        std::string error;
+        // Warmup: graph allocation for this batch shape
+        std::vector<std::vector<llama_token>> warm(inputs.begin(),
+                                                   inputs.begin() + std::min(n, n_texts));
+        bool ok = embed_all(ctx, warm, n, true, vectors.data(), error);
+
+        int n_decodes = 0;
+        const auto t0 = std::chrono::steady_clock::now();
+        ok = ok && embed_all(ctx, inputs, n, true, vectors.data(), error, &n_decodes);
+        const double ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - t0).count();
+        llama_free(ctx);
+
+        if (!ok) {
+            snprintf(buf, sizeof(buf), "{\"n_seqs\":%d,\"error\":\"%s\"}", n, error.c_str());
+        } else {
+            snprintf(buf, sizeof(buf),
+                     "{\"n_seqs\":%d,\"ctx_init_ms\":%.1f,\"decodes\":%d,\"total_ms\":%.1f,"
+                     "\"ms_per_decode\":%.2f,\"texts_per_s\":%.1f,\"tokens_per_s\":%.1f}",
+                     n, init_ms, n_decodes, ms, n_decodes ? ms / n_decodes : 0.0,
+                     ms > 0 ? 1e3 * n_texts / ms : 0.0,
+                     ms > 0 ? 1e3 * n_texts * n_tokens / ms : 0.0);
+        }
+        out += buf;
+    }
+    return out + "]}";
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// ============================================================================
+// Embeddings
+// ============================================================================
+//
+// Pooled text embeddings from the loaded model, on a context of its own
+// (embeddings=true, a configurable pooling type) next to the generation
+// context. Many inputs are packed into each llama_batch, one seq id per
+// input, up to n_batch tokens and n_seq_max inputs, so a call embeds as many
+// texts per decode as fit; throughput in texts/s is the goal, not the latency
+// of one text. An input must fit one ubatch (non-causal models attend over
+// the whole sequence), so longer ones are truncated to n_batch tokens.
+//
+// With pooling NONE (the default of generative models) the per-token
+// outputs are mean-pooled here. RANK pooling (rerankers) yields n_cls_out
+// scores per input instead of n_embd floats.
+//
+// The context is created on first use and freed by llm_embed_detach, which
+// must be called before the model is freed. Calls are serialized.
+// ============================================================================
+
+struct LlmEmbedParams {
+    enum llama_pooling_type pooling = LLAMA_POOLING_TYPE_UNSPECIFIED;   // the model's own
+    int n_batch   = 2048;   // tokens per decode (also the max input length)
+    int n_seq_max = 64;     // inputs per decode
+    int n_threads = 4;
+};
+
+// Apply to the next context; the current one is dropped
+void llm_embed_configure(const LlmEmbedParams &params);
+void llm_embed_detach();
+
+// Floats per output vector for `model`
+int llm_embed_dim(const llama_model *model);
+
+// Tokenize one input with the model's special tokens (BOS/CLS, EOS/SEP)
+std::vector<llama_token> llm_embed_tokenize(const llama_vocab *vocab, const char *text, size_t len);
+inline std::vector<llama_token> llm_embed_tokenize(const llama_vocab *vocab, const std::string &text) {
+    return llm_embed_tokenize(vocab, text.data(), text.size());
+}
+
+// Embed every input into out[i * dim .. (i + 1) * dim), L2-normalized if
+// `normalize`; an input with no tokens gets a zero vector. `out_len` is the
+// capacity of out in floats. Returns false with `error` set on failure.
+bool llm_embed(llama_model *model, const std::vector<std::vector<llama_token>> &inputs,
+               bool normalize, float *out, size_t out_len, std::string &error);
+
+// Throughput of n_texts synthetic inputs of n_tokens each, embedded with at
+// most n_seqs inputs per decode for each entry of `n_seqs`. JSON.
+std::string llm_embed_bench(llama_model *model, const std::vector<int> &n_seqs,
+                            int n_texts, int n_tokens);
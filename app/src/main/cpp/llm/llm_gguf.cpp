@@ -0,0 +1,335 @@
+#include "llm_gguf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+#include <android/log.h>
+
+#include "ggml.h"
+#include "gguf.h"
+
+#define LOGG(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_GGUF", __VA_ARGS__)
+
+static const uint32_t kMagic   = 0x58494747;   // "GGIX"
+static const uint32_t kVersion = 1;
+
+// Everything below is guarded by g_mutex
+static std::mutex g_mutex;
+static std::string g_index_path;
+static std::vector<LlmGgufInfo> g_index;
+static uint64_t g_hits = 0, g_misses = 0;
+static int64_t  g_hit_us = 0, g_miss_us = 0;
+
+// llama_ftype names, by value (see llama.h)
+static const char *kFileTypes[] = {
+        "F32", "F16", "Q4_0", "Q4_1", nullptr, nullptr, nullptr, "Q8_0", "Q5_0", "Q5_1",
+        "Q2_K", "Q3_K_S", "Q3_K_M", "Q3_K_L", "Q4_K_S", "Q4_K_M", "Q5_K_S", "Q5_K_M", "Q6_K",
+        "IQ2_XXS", "IQ2_XS", "Q2_K_S", "IQ3_XS", "IQ3_XXS", "IQ1_S", "IQ4_NL", "IQ3_S", "IQ3_M",
+        "IQ2_S", "IQ2_M", "IQ4_XS", "IQ1_M", "BF16", nullptr, nullptr, nullptr, "TQ1_0", "TQ2_0",
+        "MXFP4_MOE",
+};
+
+// -----------------------------------------------------------------------------
+// Reading a model file
+// -----------------------------------------------------------------------------
+
+static std::string get_str(const gguf_context *ctx, const std::string &key) {
+    const int64_t id = gguf_find_key(ctx, key.c_str());
+    if (id < 0 || gguf_get_kv_type(ctx, id) != GGUF_TYPE_STRING) return {};
+    return gguf_get_val_str(ctx, id);
+}
+
+static uint64_t get_uint(const gguf_context *ctx, const std::string &key, uint64_t def) {
+    const int64_t id = gguf_find_key(ctx, key.c_str());
+    if (id < 0) return def;
+    switch (gguf_get_kv_type(ctx, id)) {
+        case GGUF_TYPE_UINT8:  return gguf_get_val_u8(ctx, id);
+        case GGUF_TYPE_UINT16: return gguf_get_val_u16(ctx, id);
+        case GGUF_TYPE_UINT32: return gguf_get_val_u32(ctx, id);
+        case GGUF_TYPE_UINT64: return gguf_get_val_u64(ctx, id);
+        case GGUF_TYPE_INT32:  return (uint64_t)std::max(0, gguf_get_val_i32(ctx, id));
+        case GGUF_TYPE_INT64:  return (uint64_t)std::max<int64_t>(0, gguf_get_val_i64(ctx, id));
+        default:               return def;
+    }
+}
+
+static bool read_info(const std::string &path, LlmGgufInfo &info, std::string &error) {
+    gguf_init_params params = {/*no_alloc=*/true, /*ctx=*/nullptr};
+    gguf_context *ctx = gguf_init_from_file(path.c_str(), params);
+    if (!ctx) {
+        error = "not a readable GGUF file";
+        return false;
+    }
+
+    const std::string arch = get_str(ctx, "general.architecture");
+    info.architecture     = arch;
+    info.name             = get_str(ctx, "general.name");
+    info.context_length   = (uint32_t)get_uint(ctx, arch + ".context_length", 0);
+    info.embedding_length = (uint32_t)get_uint(ctx, arch + ".embedding_length", 0);
+    info.block_count      = (uint32_t)get_uint(ctx, arch + ".block_count", 0);
+    info.head_count       = (uint32_t)get_uint(ctx, arch + ".attention.head_count", 0);
+    info.chat_template    = get_str(ctx, "tokenizer.chat_template");
+    info.file_type        = gguf_find_key(ctx, "general.file_type") >= 0
+                            ? (int32_t)get_uint(ctx, "general.file_type", 0) : -1;
+
+    std::map<std::string, uint64_t> by_type;
+    info.n_tensors    = (uint32_t)gguf_get_n_tensors(ctx);
+    info.n_params     = 0;
+    info.tensor_bytes = 0;
+    for (int64_t i = 0; i < (int64_t)info.n_tensors; ++i) {
+        const ggml_type type  = gguf_get_tensor_type(ctx, i);
+        const size_t    bytes = gguf_get_tensor_size(ctx, i);
+        const size_t    tsize = ggml_type_size(type);
+        if (tsize > 0) info.n_params += bytes / tsize * (uint64_t)ggml_blck_size(type);
+        info.tensor_bytes += bytes;
+        by_type[ggml_type_name(type)] += bytes;
+    }
+    gguf_free(ctx);
+
+    info.bytes_by_type.assign(by_type.begin(), by_type.end());
+    std::sort(info.bytes_by_type.begin(), info.bytes_by_type.end(),
+              [](const auto &a, const auto &b) { return a.second > b.second; });
+
+    const int n_names = (int)(sizeof(kFileTypes) / sizeof(kFileTypes[0]));
+    if (info.file_type >= 0 && info.file_type < n_names && kFileTypes[info.file_type]) {
+        info.quantization = kFileTypes[info.file_type];
+    } else if (!info.bytes_by_type.empty()) {
+        info.quantization = info.bytes_by_type.front().first;
+        std::transform(info.quantization.begin(), info.quantization.end(),
+                       info.quantization.begin(), ::toupper);
+    }
+    if (arch.empty()) {
+        error = "GGUF file without general.architecture";
+        return false;
+    }
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Index file: magic, version, entry count, entries. Strings are a u32 length
+// and the bytes.
+// -----------------------------------------------------------------------------
+
+static bool write_all(FILE *f, const void *data, size_t n) {
+    return fwrite(data, 1, n, f) == n;
+}
+
+static bool read_all(FILE *f, void *data, size_t n) {
+    return fread(data, 1, n, f) == n;
+}
+
+template <typename T>
+static bool write_pod(FILE *f, const T &v) { return write_all(f, &v, sizeof(v)); }
+
+template <typename T>
+static bool read_pod(FILE *f, T &v) { return read_all(f, &v, sizeof(v)); }
+
+static bool write_str(FILE *f, const std::string &s) {
+    return write_pod(f, (uint32_t)s.size()) && write_all(f, s.data(), s.size());
+}
+
+static bool read_str(FILE *f, std::string &s) {
+    uint32_t n = 0;
+    if (!read_pod(f, n) || n > (1u << 20)) return false;
+    s.resize(n);
+    return n == 0 || read_all(f, &s[0], n);
+}
+
+static bool write_entry(FILE *f, const LlmGgufInfo &e) {
+    bool ok = write_str(f, e.path) && write_pod(f, e.file_bytes) && write_pod(f, e.mtime_ns) &&
+              write_str(f, e.architecture) && write_str(f, e.name) &&
+              write_pod(f, e.n_params) && write_pod(f, e.file_type) &&
+              write_str(f, e.quantization) && write_pod(f, e.context_length) &&
+              write_pod(f, e.embedding_length) && write_pod(f, e.block_count) &&
+              write_pod(f, e.head_count) && write_str(f, e.chat_template) &&
+              write_pod(f, e.n_tensors) && write_pod(f, e.tensor_bytes) &&
+              write_pod(f, (uint32_t)e.bytes_by_type.size());
+    for (const auto &t : e.bytes_by_type) {
+        ok = ok && write_str(f, t.first) && write_pod(f, t.second);
+    }
+    return ok;
+}
+
+static bool read_entry(FILE *f, LlmGgufInfo &e) {
+    uint32_t n_types = 0;
+    bool ok = read_str(f, e.path) && read_pod(f, e.file_bytes) && read_pod(f, e.mtime_ns) &&
+              read_str(f, e.architecture) && read_str(f, e.name) &&
+              read_pod(f, e.n_params) && read_pod(f, e.file_type) &&
+              read_str(f, e.quantization) && read_pod(f, e.context_length) &&
+              read_pod(f, e.embedding_length) && read_pod(f, e.block_count) &&
+              read_pod(f, e.head_count) && read_str(f, e.chat_template) &&
+              read_pod(f, e.n_tensors) && read_pod(f, e.tensor_bytes) &&
+              read_pod(f, n_types) && n_types <= GGML_TYPE_COUNT;
+    e.bytes_by_type.resize(ok ? n_types : 0);
+    for (auto &t : e.bytes_by_type) {
+        ok = ok && read_str(f, t.first) && read_pod(f, t.second);
+    }
+    return ok;
+}
+
+// Caller holds g_mutex
+static void load_index() {
+    g_index.clear();
+    FILE *f = fopen(g_index_path.c_str(), "rb");
+    if (!f) return;
+    uint32_t magic = 0, version = 0, n = 0;
+    bool ok = read_pod(f, magic) && magic == kMagic &&
+              read_pod(f, version) && version == kVersion && read_pod(f, n);
+    for (uint32_t i = 0; ok && i < n; ++i) {
+        LlmGgufInfo e;
+        ok = read_entry(f, e);
+        if (ok) g_index.push_back(std::move(e));
+    }
+    fclose(f);
+    if (!ok) {
+        LOGG("Discarding unreadable index %s", g_index_path.c_str());
+        g_index.clear();
+    }
+}
+
+// Caller holds g_mutex. Entries of deleted files are dropped.
+static void save_index() {
+    g_index.erase(std::remove_if(g_index.begin(), g_index.end(),
+                                 [](const LlmGgufInfo &e) {
+                                     struct stat st{};
+                                     return stat(e.path.c_str(), &st) != 0;
+                                 }),
+                  g_index.end());
+    const std::string tmp = g_index_path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    bool ok = f && write_pod(f, kMagic) && write_pod(f, kVersion) &&
+              write_pod(f, (uint32_t)g_index.size());
+    for (const LlmGgufInfo &e : g_index) ok = ok && write_entry(f, e);
+    if (f) ok = (fclose(f) == 0) && ok;
+    ok = ok && rename(tmp.c_str(), g_index_path.c_str()) == 0;
+    if (!ok) {
+        LOGG("Failed to write index %s", g_index_path.c_str());
+        remove(tmp.c_str());
+    }
+}
+
+static std::string json_str(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out + "\"";
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+void llm_gguf_set_index(const std::string &path) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (path == g_index_path) return;
+    g_index_path = path;
+    if (path.empty()) {
+        g_index.clear();
+        return;
+    }
+    load_index();
+    LOGG("Index %s: %zu models", path.c_str(), g_index.size());
+}
+
+bool llm_gguf_inspect(const std::string &path, LlmGgufInfo &info, bool &cached,
+                      std::string &error) {
+    const auto t0 = std::chrono::steady_clock::now();
+    auto elapsed_us = [&t0]() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+    };
+
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0) {
+        error = "file not found";
+        return false;
+    }
+    const uint64_t file_bytes = (uint64_t)st.st_size;
+    const int64_t  mtime_ns   = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (const LlmGgufInfo &e : g_index) {
+            if (e.path != path || e.file_bytes != file_bytes || e.mtime_ns != mtime_ns) continue;
+            info   = e;
+            cached = true;
+            g_hits++;
+            g_hit_us += elapsed_us();
+            return true;
+        }
+    }
+
+    info = LlmGgufInfo{};
+    info.path       = path;
+    info.file_bytes = file_bytes;
+    info.mtime_ns   = mtime_ns;
+    cached = false;
+    if (!read_info(path, info, error)) return false;
+    const int64_t us = elapsed_us();
+    LOGG("Read %s in %.1f ms: %s %s", path.c_str(), us / 1e3, info.architecture.c_str(),
+         info.quantization.c_str());
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_misses++;
+    g_miss_us += us;
+    if (g_index_path.empty()) return true;
+    g_index.erase(std::remove_if(g_index.begin(), g_index.end(),
+                                 [&path](const LlmGgufInfo &e) { return e.path == path; }),
+                  g_index.end());
+    g_index.push_back(info);
+    save_index();
+    return true;
+}
+
+std::string llm_gguf_info_json(const LlmGgufInfo &info) {
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             ",\"file_bytes\":%llu,\"parameters\":%llu,\"file_type\":%d,"
+             "\"context_length\":%u,\"embedding_length\":%u,\"block_count\":%u,"
+             "\"head_count\":%u,\"n_tensors\":%u,\"tensor_bytes\":%llu",
+             (unsigned long long)info.file_bytes, (unsigned long long)info.n_params,
+             info.file_type, info.context_length, info.embedding_length, info.block_count,
+             info.head_count, info.n_tensors, (unsigned long long)info.tensor_bytes);
+    std::string out = "{\"path\":" + json_str(info.path) +
+                      ",\"architecture\":" + json_str(info.architecture) +
+                      ",\"name\":" + json_str(info.name) +
+                      ",\"quantization\":" + json_str(info.quantization) + buf +
+                      ",\"bytes_by_type\":{";
+    for (size_t i = 0; i < info.bytes_by_type.size(); ++i) {
+        snprintf(buf, sizeof(buf), ":%llu", (unsigned long long)info.bytes_by_type[i].second);
+        out += (i ? "," : "") + json_str(info.bytes_by_type[i].first) + buf;
+    }
+    out += "},\"chat_template\":";
+    out += info.chat_template.empty() ? "null" : json_str(info.chat_template);
+    return out + "}";
+}
+
+std::string llm_gguf_stats_json() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "{\"entries\":%zu,\"hits\":%llu,\"misses\":%llu,"
+             "\"hit_ms\":%.3f,\"read_ms\":%.1f}",
+             g_index.size(), (unsigned long long)g_hits, (unsigned long long)g_misses,
+             g_hits ? g_hit_us / 1e3 / g_hits : 0.0,
+             g_misses ? g_miss_us / 1e3 / g_misses : 0.0);
+    return buf;
+}
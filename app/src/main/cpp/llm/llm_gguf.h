@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ============================================================================
+// GGUF metadata
+// ============================================================================
+//
+// What a model file is, without loading it: gguf_init_from_file with no_alloc
+// reads the header, the KV section and the tensor infos, never the weights.
+// That still walks the tokenizer arrays, so results are kept in a small
+// on-disk index keyed by path, file size and mtime; listing downloaded models
+// or checking one before a load is then a stat and a lookup.
+// ============================================================================
+
+struct LlmGgufInfo {
+    std::string path;
+    uint64_t file_bytes = 0;
+    int64_t  mtime_ns   = 0;
+
+    std::string architecture;         // general.architecture, e.g. "llama"
+    std::string name;                 // general.name, may be empty
+    uint64_t n_params   = 0;          // elements over all tensors
+    int32_t  file_type  = -1;         // llama_ftype, -1 if not recorded
+    std::string quantization;         // "Q4_K_M", or the dominant tensor type
+    uint32_t context_length   = 0;    // training context
+    uint32_t embedding_length = 0;
+    uint32_t block_count      = 0;
+    uint32_t head_count       = 0;
+    std::string chat_template;        // tokenizer.chat_template, may be empty
+    uint32_t n_tensors    = 0;
+    uint64_t tensor_bytes = 0;
+    std::vector<std::pair<std::string, uint64_t>> bytes_by_type;   // largest first
+};
+
+// Keep the index in `path` (loaded now). Empty disables it.
+void llm_gguf_set_index(const std::string &path);
+
+// Metadata of the model at `path`, from the index if the file is unchanged,
+// otherwise read from the file and indexed. false with `error` set if it is
+// not a readable GGUF file. `cached` tells which.
+bool llm_gguf_inspect(const std::string &path, LlmGgufInfo &info, bool &cached,
+                      std::string &error);
+
+std::string llm_gguf_info_json(const LlmGgufInfo &info);
+
+// Index size, hits and misses, and lookup vs read time
+std::string llm_gguf_stats_json();
@@ -0,0 +1,328 @@
+#include "llm_grammar.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <android/log.h>
+
+#define LOGG(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_GRAMMAR", __VA_ARGS__)
+
+// Bytes of cached masks; least recently used ones are evicted beyond this.
+// A mask is n_vocab bits, ~19 KB for a 150k vocabulary.
+#define LLM_GRAMMAR_CACHE_BYTES (32u << 20)
+
+// -----------------------------------------------------------------------------
+// Mask cache
+// -----------------------------------------------------------------------------
+
+struct LlmMask {
+    std::vector<uint64_t> bits;   // bit i: token i is allowed
+    int32_t n_allowed = 0;
+};
+
+struct CacheEntry {
+    std::shared_ptr<const LlmMask> mask;
+    std::list<uint64_t>::iterator  lru;
+};
+
+static std::mutex g_mutex;   // guards everything below
+static std::unordered_map<uint64_t, CacheEntry> g_masks;
+static std::list<uint64_t> g_lru;   // most recently used first
+static size_t   g_bytes     = 0;
+static uint64_t g_hits      = 0;    // rejected draws served by a cached mask
+static uint64_t g_builds    = 0;    // full-vocab scans
+static uint64_t g_checks    = 0;    // draws checked on their own
+static uint64_t g_rejects   = 0;    // draws the grammar rejected
+static uint64_t g_evictions = 0;
+
+static std::shared_ptr<const LlmMask> cache_find(uint64_t state) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_masks.find(state);
+    if (it == g_masks.end()) return nullptr;
+    g_lru.splice(g_lru.begin(), g_lru, it->second.lru);
+    return it->second.mask;
+}
+
+static void cache_put(uint64_t state, const std::shared_ptr<const LlmMask> &mask) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (g_masks.count(state)) return;
+    g_lru.push_front(state);
+    g_masks[state] = {mask, g_lru.begin()};
+    g_bytes += mask->bits.size() * sizeof(uint64_t);
+    while (g_bytes > LLM_GRAMMAR_CACHE_BYTES && g_lru.size() > 1) {
+        auto victim = g_masks.find(g_lru.back());
+        g_bytes -= victim->second.mask->bits.size() * sizeof(uint64_t);
+        g_masks.erase(victim);
+        g_lru.pop_back();
+        g_evictions++;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// splitmix64 finalizer over h ^ v
+static uint64_t mix(uint64_t h, uint64_t v) {
+    uint64_t z = h ^ (v + 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t hash_text(const std::string &s) {
+    uint64_t h = 0xcbf29ce484222325ull;   // FNV-1a
+    for (unsigned char c : s) h = (h ^ c) * 0x100000001b3ull;
+    return h;
+}
+
+static bool mask_test(const LlmMask &m, llama_token t) {
+    return (m.bits[(size_t)t >> 6] >> (t & 63)) & 1;
+}
+
+// Whether the grammar accepts `token` in its current state: one candidate
+static bool check_one(LlmGrammar &g, llama_token token) {
+    llama_token_data td = {token, 0.0f, 0.0f};
+    llama_token_data_array cur = {&td, 1, -1, false};
+    llama_sampler_apply(g.smpl, &cur);
+    return std::isfinite(td.logit);
+}
+
+// Allowed tokens of the current state: the grammar over the whole vocabulary
+static std::shared_ptr<const LlmMask> build_mask(LlmGrammar &g, int32_t n_vocab) {
+    std::vector<llama_token_data> cands(n_vocab);
+    for (int32_t i = 0; i < n_vocab; ++i) cands[i] = {i, 0.0f, 0.0f};
+    llama_token_data_array cur = {cands.data(), cands.size(), -1, false};
+    llama_sampler_apply(g.smpl, &cur);
+
+    auto mask = std::make_shared<LlmMask>();
+    mask->bits.assign(((size_t)n_vocab + 63) / 64, 0);
+    for (size_t i = 0; i < cur.size; ++i) {
+        if (!std::isfinite(cur.data[i].logit)) continue;
+        const llama_token t = cur.data[i].id;
+        mask->bits[(size_t)t >> 6] |= 1ull << (t & 63);
+        mask->n_allowed++;
+    }
+    return mask;
+}
+
+// Sample from the logits with every token outside the mask at -inf
+static llama_token sample_masked(LlmGrammar &g, LlmSampler &smpl, const LlmMask &mask,
+                                 const float *logits, float temp, float top_p, int top_k) {
+    if (mask.n_allowed == 0) return LLAMA_TOKEN_NULL;
+    const int32_t n_vocab = smpl.n_vocab;
+    g.masked.resize(n_vocab);
+    float *dst = g.masked.data();
+    for (int32_t i = 0; i < n_vocab; ++i) {
+        dst[i] = mask_test(mask, i) ? logits[i] : -INFINITY;
+    }
+    return llm_sampler_sample(smpl, dst, temp, top_p, top_k);
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+bool llm_grammar_init(LlmGrammar &g, const llama_vocab *vocab, const std::string &gbnf,
+                      std::string &error) {
+    llm_grammar_free(g);
+    if (gbnf.empty()) return true;
+    g.smpl = llama_sampler_init_grammar(vocab, gbnf.c_str(), "root");
+    if (!g.smpl) {
+        error = "invalid grammar";
+        return false;
+    }
+    g.root  = mix(hash_text(gbnf), (uint64_t)(uintptr_t)vocab);
+    g.state = g.root;
+    g.last_us = 0;
+    return true;
+}
+
+void llm_grammar_free(LlmGrammar &g) {
+    if (g.smpl) llama_sampler_free(g.smpl);
+    g.smpl  = nullptr;
+    g.root  = 0;
+    g.state = 0;
+}
+
+llama_token llm_grammar_sample(LlmGrammar &g, LlmSampler &smpl, const float *logits,
+                               float temp, float top_p, int top_k) {
+    llama_token tok = llm_sampler_sample(smpl, logits, temp, top_p, top_k);
+    if (!g.smpl) return tok;
+
+    // Constraint work only, not the draw above
+    const int64_t t_start = now_us();
+    std::shared_ptr<const LlmMask> mask = cache_find(g.state);
+    bool allowed = false;
+    if (tok != LLAMA_TOKEN_NULL) {
+        allowed = mask ? mask_test(*mask, tok) : check_one(g, tok);
+    }
+    bool hit = false, built = false;
+    if (!allowed) {
+        hit = mask != nullptr;
+        if (!mask) {
+            mask = build_mask(g, smpl.n_vocab);
+            cache_put(g.state, mask);
+            built = true;
+        }
+        tok = sample_masked(g, smpl, *mask, logits, temp, top_p, top_k);
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        g_checks++;
+        if (!allowed) g_rejects++;
+        if (hit) g_hits++;
+        if (built) g_builds++;
+    }
+    g.last_us = now_us() - t_start;
+    return tok;
+}
+
+void llm_grammar_accept(LlmGrammar &g, llama_token token) {
+    if (!g.smpl || token == LLAMA_TOKEN_NULL) return;
+    const int64_t t_start = now_us();
+    llama_sampler_accept(g.smpl, token);
+    g.state = mix(g.state, (uint64_t)token);
+    g.last_us += now_us() - t_start;
+}
+
+void llm_grammar_clear_cache() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_masks.clear();
+    g_lru.clear();
+    g_bytes = 0;
+}
+
+std::string llm_grammar_stats_json() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    char buf[320];
+    snprintf(buf, sizeof(buf),
+             "{\"checks\":%llu,\"rejects\":%llu,\"mask_hits\":%llu,\"mask_builds\":%llu,"
+             "\"masks\":%zu,\"cache_kb\":%zu,\"evictions\":%llu}",
+             (unsigned long long)g_checks, (unsigned long long)g_rejects,
+             (unsigned long long)g_hits, (unsigned long long)g_builds,
+             g_masks.size(), g_bytes / 1024, (unsigned long long)g_evictions);
+    return buf;
+}
+
+// -----------------------------------------------------------------------------
+// Benchmark
+// -----------------------------------------------------------------------------
+
+enum class BenchMode { None, FullScan, Cached };
+
+// Sampling settings of an ordinary request
+static const float kBenchTemp = 0.7f, kBenchTopP = 0.9f;
+static const int   kBenchTopK = 40;
+
+// n_tokens constrained steps over a few synthetic logit rows. The grammar
+// restarts whenever it completes or nothing is allowed.
+static std::string bench_mode(const char *name, BenchMode mode, LlmGrammar &g,
+                              const std::vector<std::vector<float>> &rows, int n_tokens,
+                              const llama_vocab *vocab) {
+    const int32_t n_vocab = (int32_t)rows[0].size();
+    LlmSampler smpl;
+    llm_sampler_init(smpl, n_vocab, 1234);
+    llama_sampler_reset(g.smpl);
+    g.state = g.root;
+
+    uint64_t checks, rejects, hits, builds;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        checks = g_checks; rejects = g_rejects; hits = g_hits; builds = g_builds;
+    }
+
+    std::vector<llama_token_data> cands(n_vocab);
+    std::vector<float> masked(n_vocab);
+    std::vector<double> us;
+    us.reserve(n_tokens);
+    int n_restarts = 0;
+    for (int i = 0; i < n_tokens; ++i) {
+        const float *logits = rows[i % rows.size()].data();
+        const int64_t t0 = now_us();
+        llama_token tok;
+        if (mode == BenchMode::None) {
+            tok = llm_sampler_sample(smpl, logits, kBenchTemp, kBenchTopP, kBenchTopK);
+        } else if (mode == BenchMode::FullScan) {
+            for (int32_t t = 0; t < n_vocab; ++t) cands[t] = {t, logits[t], 0.0f};
+            llama_token_data_array cur = {cands.data(), cands.size(), -1, false};
+            llama_sampler_apply(g.smpl, &cur);
+            for (size_t t = 0; t < cur.size; ++t) masked[cur.data[t].id] = cur.data[t].logit;
+            tok = llm_sampler_sample(smpl, masked.data(), kBenchTemp, kBenchTopP, kBenchTopK);
+        } else {
+            tok = llm_grammar_sample(g, smpl, logits, kBenchTemp, kBenchTopP, kBenchTopK);
+        }
+        if (mode != BenchMode::None) {
+            if (tok == LLAMA_TOKEN_NULL || llama_vocab_is_eog(vocab, tok)) {
+                llama_sampler_reset(g.smpl);
+                g.state = g.root;
+                n_restarts++;
+            } else {
+                llm_grammar_accept(g, tok);
+            }
+        }
+        us.push_back((double)(now_us() - t0));
+    }
+
+    double sum = 0.0;
+    for (double v : us) sum += v;
+    std::sort(us.begin(), us.end());
+    char buf[384];
+    int n = snprintf(buf, sizeof(buf),
+                     "{\"mode\":\"%s\",\"us_per_token\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,"
+                     "\"max_us\":%.1f,\"restarts\":%d",
+                     name, sum / us.size(), us[us.size() / 2],
+                     us[std::min(us.size() - 1, us.size() * 99 / 100)], us.back(), n_restarts);
+    std::string out(buf, n);
+    if (mode == BenchMode::Cached) {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        n = snprintf(buf, sizeof(buf),
+                     ",\"checks\":%llu,\"rejects\":%llu,\"mask_hits\":%llu,\"mask_builds\":%llu",
+                     (unsigned long long)(g_checks - checks),
+                     (unsigned long long)(g_rejects - rejects),
+                     (unsigned long long)(g_hits - hits),
+                     (unsigned long long)(g_builds - builds));
+        out.append(buf, n);
+    }
+    return out + "}";
+}
+
+std::string llm_grammar_bench(const llama_vocab *vocab, const std::string &gbnf, int n_tokens) {
+    LlmGrammar g;
+    std::string error;
+    if (!llm_grammar_init(g, vocab, gbnf, error) || !llm_grammar_active(g)) {
+        return "{\"error\":\"" + (error.empty() ? std::string("empty grammar") : error) + "\"}";
+    }
+    n_tokens = std::max(1, n_tokens);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    // A few rows of model-like logits, reused cyclically
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+    std::vector<std::vector<float>> rows(4, std::vector<float>(n_vocab));
+    for (auto &row : rows) {
+        for (float &v : row) v = dist(rng);
+    }
+
+    llm_grammar_clear_cache();
+    std::string out = "{\"n_vocab\":" + std::to_string(n_vocab) +
+                      ",\"n_tokens\":" + std::to_string(n_tokens) + ",\"results\":[";
+    out += bench_mode("none", BenchMode::None, g, rows, n_tokens, vocab) + ",";
+    out += bench_mode("full_scan", BenchMode::FullScan, g, rows, n_tokens, vocab) + ",";
+    out += bench_mode("cached_cold", BenchMode::Cached, g, rows, n_tokens, vocab) + ",";
+    out += bench_mode("cached_warm", BenchMode::Cached, g, rows, n_tokens, vocab) + "]}";
+    llm_grammar_free(g);
+    LOGG("Grammar benchmark: %s", out.c_str());
+    return out;
+}
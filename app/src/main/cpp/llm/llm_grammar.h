@@ -0,0 +1,68 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+#include "llm_sampling.h"
+
+// ============================================================================
+// Constrained decoding
+// ============================================================================
+//
+// Restricts sampling to the tokens a GBNF grammar allows next (JSON schemas
+// are converted to GBNF on the Kotlin side). The parse state is tracked by
+// llama.cpp's grammar sampler, but its check of a candidate token walks the
+// grammar stacks for that token's text, so applying it to the whole
+// vocabulary costs milliseconds per token. Two things avoid that scan:
+//
+//   - Sample first, check later: the token drawn from the unconstrained
+//     logits is checked alone and kept if the grammar accepts it. With full
+//     softmax sampling this is exact (rejection sampling); with top-k/top-p
+//     the truncation is applied before the mask on this path, after it on
+//     the masked one.
+//   - Mask cache: when the draw is rejected, the allowed-token bitmask of the
+//     current state is computed once and cached, keyed by a hash of the
+//     grammar and every token accepted so far (the state is a function of
+//     both). States such as the fixed scaffolding of a schema recur across
+//     requests and forks and then cost a bit test instead of a scan.
+//
+// The scheduler records the constraint time of each token (LlmGrammar::
+// last_us) in LlmHist::Grammar.
+// ============================================================================
+
+struct LlmGrammar {
+    llama_sampler *smpl  = nullptr;   // llama.cpp grammar sampler, the parse state
+    uint64_t       root  = 0;         // hash of vocab + grammar text
+    uint64_t       state = 0;         // root + accepted tokens
+    int64_t        last_us = 0;       // constraint time of the last sample + accept
+    std::vector<float> masked;        // [n_vocab] logits with disallowed tokens at -inf
+};
+
+// Parse `gbnf` (start symbol "root") for `vocab`. Returns false with `error`
+// set if it does not parse. An empty grammar leaves g inactive.
+bool llm_grammar_init(LlmGrammar &g, const llama_vocab *vocab, const std::string &gbnf,
+                      std::string &error);
+void llm_grammar_free(LlmGrammar &g);
+
+inline bool llm_grammar_active(const LlmGrammar &g) { return g.smpl != nullptr; }
+
+// Sample one token the grammar allows from the raw logits of a position, with
+// the llm_sampler_sample rules. LLAMA_TOKEN_NULL if nothing is allowed. An
+// inactive grammar samples unconstrained.
+llama_token llm_grammar_sample(LlmGrammar &g, LlmSampler &smpl, const float *logits,
+                               float temp, float top_p, int top_k);
+
+// Advance the parse state past a sampled token
+void llm_grammar_accept(LlmGrammar &g, llama_token token);
+
+// Drop the cached masks, e.g. when the vocabulary goes away
+void llm_grammar_clear_cache();
+
+// Mask cache counters as JSON
+std::string llm_grammar_stats_json();
+
+// Per-token cost of the constraint over n_tokens steps of synthetic logits
+// for: no grammar, the grammar applied to the whole vocabulary every step,
+// and llm_grammar_sample with a cold and then a warm mask cache. JSON.
+std::string llm_grammar_bench(const llama_vocab *vocab, const std::string &gbnf, int n_tokens);
@@ -0,0 +1,318 @@
+#include "llm_lora.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <sys/stat.h>
+#include <android/log.h>
+
+#define LOGL(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_LORA", __VA_ARGS__)
+
+struct Registered {
+    std::string name;
+    std::string path;
+    float  scale = 1.0f;
+    size_t bytes = 0;
+};
+
+static std::mutex g_mutex;   // guards everything below
+static std::vector<Registered> g_registry;   // in registration order
+static llama_model *g_model = nullptr;       // live model of g_resident
+static std::vector<std::shared_ptr<LlmLora>> g_resident;
+static size_t   g_budget = 0;
+static uint64_t g_tick   = 0;
+static std::atomic<uint64_t> g_next_id{1};
+
+// Latency counters
+static uint64_t g_switches = 0;
+static int64_t  g_switch_us_sum = 0, g_switch_us_max = 0;
+static bool     g_time_decode = false;   // the next decode follows a switch
+static uint64_t g_first_decodes = 0;
+static int64_t  g_first_decode_us_sum = 0, g_first_decode_us_max = 0;
+static uint64_t g_loads = 0;
+static double   g_load_ms_sum = 0.0, g_load_ms_max = 0.0;
+static uint64_t g_evictions = 0;
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static Registered *find_registered(const std::string &name) {
+    for (auto &r : g_registry) {
+        if (r.name == name) return &r;
+    }
+    return nullptr;
+}
+
+static size_t resident_bytes() {
+    size_t n = 0;
+    for (const auto &l : g_resident) n += l->bytes;
+    return n;
+}
+
+static std::shared_ptr<LlmLora> load(llama_model *model, const Registered &r) {
+    const auto t0 = std::chrono::steady_clock::now();
+    llama_adapter_lora *adapter = llama_adapter_lora_init(model, r.path.c_str());
+    if (!adapter) {
+        LOGL("Failed to load adapter %s from %s", r.name.c_str(), r.path.c_str());
+        return nullptr;
+    }
+    auto lora = std::make_shared<LlmLora>();
+    lora->name    = r.name;
+    lora->id      = g_next_id++;
+    lora->adapter = adapter;
+    lora->scale   = r.scale;
+    lora->bytes   = r.bytes;
+    lora->load_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t0).count();
+    LOGL("Adapter %s loaded in %.0f ms (%.1f MiB)", r.name.c_str(), lora->load_ms,
+         r.bytes / 1048576.0);
+    return lora;
+}
+
+// Adapters normally live until their model is freed; this is the only way
+// to give the memory back earlier
+static void free_adapter(LlmLora &lora) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    llama_adapter_lora_free(lora.adapter);
+#pragma GCC diagnostic pop
+    lora.adapter = nullptr;
+}
+
+// Drop the resident copy of `name`. Freed now if nothing else holds it,
+// otherwise with the model. Caller holds g_mutex.
+static void drop_resident(const std::string &name) {
+    for (auto it = g_resident.begin(); it != g_resident.end(); ++it) {
+        if ((*it)->name != name) continue;
+        if (it->use_count() == 1) free_adapter(**it);
+        g_resident.erase(it);
+        return;
+    }
+}
+
+// Free unused adapters, least recently used first, until `need` more bytes
+// fit the budget. Caller holds g_mutex.
+static void make_room(size_t need) {
+    if (g_budget == 0) return;
+    while (resident_bytes() + need > g_budget) {
+        auto victim = g_resident.end();
+        for (auto it = g_resident.begin(); it != g_resident.end(); ++it) {
+            if (it->use_count() > 1) continue;   // held by a request or the context
+            if (victim == g_resident.end() || (*it)->last_used < (*victim)->last_used) {
+                victim = it;
+            }
+        }
+        if (victim == g_resident.end()) return;
+        LOGL("Evicting adapter %s", (*victim)->name.c_str());
+        free_adapter(**victim);
+        g_resident.erase(victim);
+        g_evictions++;
+    }
+}
+
+static std::string json_str(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if ((unsigned char)c >= 0x20) out += c;
+    }
+    return out + "\"";
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+bool llm_lora_register(const std::string &name, const std::string &path, float scale,
+                       std::string &error) {
+    struct stat st;
+    if (name.empty() || stat(path.c_str(), &st) != 0) {
+        error = name.empty() ? "missing adapter name" : "adapter file not found";
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    drop_resident(name);
+    Registered *r = find_registered(name);
+    if (!r) {
+        g_registry.push_back({});
+        r = &g_registry.back();
+    }
+    *r = {name, path, scale, (size_t)st.st_size};
+    LOGL("Registered adapter %s (scale %.2f): %s", name.c_str(), scale, path.c_str());
+    return true;
+}
+
+bool llm_lora_unregister(const std::string &name) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    drop_resident(name);
+    auto it = std::find_if(g_registry.begin(), g_registry.end(),
+                           [&name](const Registered &r) { return r.name == name; });
+    if (it == g_registry.end()) return false;
+    g_registry.erase(it);
+    return true;
+}
+
+void llm_lora_set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_budget = bytes;
+    make_room(0);
+}
+
+std::vector<std::shared_ptr<LlmLora>> llm_lora_preload(llama_model *model) {
+    std::vector<Registered> registry;
+    size_t budget;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        registry = g_registry;
+        budget   = g_budget;
+    }
+    std::vector<std::shared_ptr<LlmLora>> out;
+    size_t bytes = 0;
+    for (const Registered &r : registry) {
+        if (budget > 0 && bytes + r.bytes > budget) continue;   // loaded on first use
+        if (auto lora = load(model, r)) {
+            bytes += lora->bytes;
+            out.push_back(std::move(lora));
+        }
+    }
+    return out;
+}
+
+void llm_lora_attach(llama_model *model, std::vector<std::shared_ptr<LlmLora>> loaded) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_model    = model;
+    g_resident = std::move(loaded);
+    // Adapters unregistered while the model was staged
+    g_resident.erase(std::remove_if(g_resident.begin(), g_resident.end(),
+                                    [](const std::shared_ptr<LlmLora> &l) {
+                                        return !find_registered(l->name);
+                                    }),
+                     g_resident.end());
+}
+
+std::vector<std::shared_ptr<LlmLora>> llm_lora_detach() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_model = nullptr;
+    g_time_decode = false;
+    std::vector<std::shared_ptr<LlmLora>> out;
+    out.swap(g_resident);
+    return out;
+}
+
+// The adapter file is read with g_mutex released: the scheduler takes it
+// on every decode (llm_lora_record_decode) and switch. Callers hold the
+// model lock, so g_model cannot be freed meanwhile.
+std::shared_ptr<LlmLora> llm_lora_acquire(const std::string &name, std::string &error) {
+    for (;;) {
+        Registered r;
+        llama_model *model;
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            if (!g_model) {
+                error = "model not loaded";
+                return nullptr;
+            }
+            for (auto &l : g_resident) {
+                if (l->name != name) continue;
+                l->last_used = ++g_tick;
+                return l;
+            }
+            const Registered *reg = find_registered(name);
+            if (!reg) {
+                error = "unknown adapter: " + name;
+                return nullptr;
+            }
+            r     = *reg;
+            model = g_model;
+        }
+
+        auto lora = load(model, r);
+        if (!lora) {
+            error = "failed to load adapter: " + name;
+            return nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(g_mutex);
+        const Registered *reg = find_registered(name);
+        std::shared_ptr<LlmLora> raced;
+        for (auto &l : g_resident) {
+            if (l->name == name) raced = l;
+        }
+        if (g_model != model || raced || !reg || reg->path != r.path ||
+            reg->scale != r.scale) {
+            // Loaded by another request, or re-registered meanwhile: look again
+            free_adapter(*lora);
+            continue;
+        }
+        make_room(r.bytes);
+        lora->last_used = ++g_tick;
+        g_resident.push_back(lora);
+        g_loads++;
+        g_load_ms_sum += lora->load_ms;
+        g_load_ms_max = std::max(g_load_ms_max, lora->load_ms);
+        return lora;
+    }
+}
+
+void llm_lora_apply(llama_context *ctx, const LlmLora *lora) {
+    const auto t0 = std::chrono::steady_clock::now();
+    llama_clear_adapter_lora(ctx);
+    if (lora && llama_set_adapter_lora(ctx, lora->adapter, lora->scale) != 0) {
+        LOGL("Failed to apply adapter %s", lora->name.c_str());
+    }
+    const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - t0).count();
+    LOGL("Switched to %s in %lld us", lora ? lora->name.c_str() : "the base model",
+         (long long)us);
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_switches++;
+    g_switch_us_sum += us;
+    g_switch_us_max = std::max(g_switch_us_max, us);
+    g_time_decode = true;
+}
+
+void llm_lora_record_decode(int64_t us) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!g_time_decode) return;
+    g_time_decode = false;
+    g_first_decodes++;
+    g_first_decode_us_sum += us;
+    g_first_decode_us_max = std::max(g_first_decode_us_max, us);
+}
+
+std::string llm_lora_stats_json(double model_load_ms) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    std::string out = "{\"adapters\":[";
+    for (size_t i = 0; i < g_registry.size(); ++i) {
+        const Registered &r = g_registry[i];
+        bool resident = false;
+        for (const auto &l : g_resident) resident = resident || l->name == r.name;
+        char buf[128];
+        snprintf(buf, sizeof(buf), ",\"scale\":%.2f,\"mb\":%.1f,\"resident\":%s}",
+                 r.scale, r.bytes / 1048576.0, resident ? "true" : "false");
+        out += (i ? ",{\"name\":" : "{\"name\":") + json_str(r.name) + buf;
+    }
+
+    const double switch_ms = g_switches ? g_switch_us_sum / 1e3 / g_switches : 0.0;
+    const double first_decode_ms =
+            g_first_decodes ? g_first_decode_us_sum / 1e3 / g_first_decodes : 0.0;
+    char buf[640];
+    snprintf(buf, sizeof(buf),
+             "],\"budget_mb\":%.0f,\"resident_mb\":%.1f,\"switches\":%llu,"
+             "\"switch_ms\":{\"mean\":%.3f,\"max\":%.3f},"
+             "\"first_decode_ms\":{\"mean\":%.1f,\"max\":%.1f},"
+             "\"loads\":%llu,\"load_ms\":{\"mean\":%.1f,\"max\":%.1f},\"evictions\":%llu,"
+             "\"model_load_ms\":%.1f,\"reload_vs_switch\":%.0f}",
+             g_budget / 1048576.0, resident_bytes() / 1048576.0,
+             (unsigned long long)g_switches, switch_ms, g_switch_us_max / 1e3,
+             first_decode_ms, g_first_decode_us_max / 1e3,
+             (unsigned long long)g_loads, g_loads ? g_load_ms_sum / g_loads : 0.0,
+             g_load_ms_max, (unsigned long long)g_evictions, model_load_ms,
+             switch_ms + first_decode_ms > 0 ? model_load_ms / (switch_ms + first_decode_ms)
+                                             : 0.0);
+    return out + buf;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// ============================================================================
+// LoRA adapters
+// ============================================================================
+//
+// Fine-tuned variants of the live model as resident LoRA adapters, selected
+// per request instead of reloading gigabytes of weights. Adapters are
+// registered by name; registered adapters are loaded into a model while it
+// is staged, before its context is created (as llama.h asks), and adapters
+// registered later are loaded on first use. Resident adapters are kept
+// within a byte budget (file size is the estimate of their tensors) by
+// freeing the least recently used one that no request or context holds.
+//
+// An adapter applies to the whole context, not to one sequence, so the
+// scheduler decodes requests of one adapter (or of the base model) at a
+// time and switches with llama_set_adapter_lora when the batch has drained.
+// Switch and load times are reported next to the model load time.
+// ============================================================================
+
+struct LlmLora {
+    std::string name;
+    uint64_t id = 0;                         // unique per load, never 0
+    llama_adapter_lora *adapter = nullptr;   // freed with its model
+    float    scale   = 1.0f;
+    size_t   bytes   = 0;
+    double   load_ms = 0.0;
+    uint64_t last_used = 0;
+};
+
+// Known adapters, independent of any model. register replaces an adapter of
+// the same name; its resident copy, if unused, is dropped.
+bool llm_lora_register(const std::string &name, const std::string &path, float scale,
+                       std::string &error);
+bool llm_lora_unregister(const std::string &name);
+void llm_lora_set_budget(size_t bytes);   // 0 = unlimited
+
+// Load the registered adapters into a model being staged, within the budget
+std::vector<std::shared_ptr<LlmLora>> llm_lora_preload(llama_model *model);
+
+// Adopt the adapters of the model going live / give them back when it stops
+void llm_lora_attach(llama_model *model, std::vector<std::shared_ptr<LlmLora>> loaded);
+std::vector<std::shared_ptr<LlmLora>> llm_lora_detach();
+
+// Resident adapter `name` of the live model, loaded now if needed. nullptr
+// with `error` set if it is not registered or fails to load. Holding the
+// pointer keeps the adapter from being evicted.
+std::shared_ptr<LlmLora> llm_lora_acquire(const std::string &name, std::string &error);
+
+// Scheduler thread: make `lora` (nullptr: the base model) the only adapter
+// of ctx, and time the first decode after a switch with record_decode
+void llm_lora_apply(llama_context *ctx, const LlmLora *lora);
+void llm_lora_record_decode(int64_t us);
+
+// Registered and resident adapters, switch and load latency, and
+// `model_load_ms` for comparison, as JSON
+std::string llm_lora_stats_json(double model_load_ms);
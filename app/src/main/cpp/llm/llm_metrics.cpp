@@ -0,0 +1,131 @@
+#include "llm_metrics.h"
+
+#include <atomic>
+#include <cstdio>
+
+// -----------------------------------------------------------------------------
+// Storage
+// -----------------------------------------------------------------------------
+
+static constexpr int kBuckets = 32;   // last bucket: >= 2^30 us (~18 min)
+
+struct Histogram {
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+    std::atomic<uint64_t> buckets[kBuckets] = {};
+};
+
+static Histogram g_hist[(int)LlmHist::Count];
+static std::atomic<uint64_t> g_counters[(int)LlmCounter::Count];
+
+static const char *const kHistNames[] = {
+    "queue_wait", "tokenize", "prefill", "ttft",
+    "token_latency", "decode", "sample", "detokenize", "grammar",
+};
+static const char *const kCounterNames[] = {
+    "requests", "requests_failed", "requests_cancelled",
+    "prompt_tokens", "prompt_tokens_reused", "generated_tokens",
+    "context_shifts", "prompts_truncated", "jni_copy_bytes", "jni_direct_bytes",
+};
+static_assert(sizeof(kHistNames) / sizeof(kHistNames[0]) == (int)LlmHist::Count, "");
+static_assert(sizeof(kCounterNames) / sizeof(kCounterNames[0]) == (int)LlmCounter::Count, "");
+
+static int bucket_of(uint64_t us) {
+    if (us == 0) return 0;
+    int b = 64 - __builtin_clzll(us);
+    return b < kBuckets ? b : kBuckets - 1;
+}
+
+// -----------------------------------------------------------------------------
+// Snapshot helpers
+// -----------------------------------------------------------------------------
+
+// Estimate the q-quantile from a bucket snapshot by linear interpolation
+// inside the bucket that holds it
+static double quantile(const uint64_t *buckets, uint64_t count, uint64_t max, double q) {
+    if (count == 0) return 0.0;
+    const double target = q * count;
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i) {
+        if (buckets[i] == 0) continue;
+        if (seen + buckets[i] >= target) {
+            const double lo = i == 0 ? 0.0 : (double)(1ull << (i - 1));
+            const double hi = i == 0 ? 1.0 : (double)(1ull << i);
+            double v = lo + (hi - lo) * (target - seen) / buckets[i];
+            return v < (double)max ? v : (double)max;
+        }
+        seen += buckets[i];
+    }
+    return (double)max;
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+void llm_metrics_record(LlmHist h, int64_t us) {
+    const uint64_t v = us > 0 ? (uint64_t)us : 0;
+    Histogram &hist = g_hist[(int)h];
+    hist.sum.fetch_add(v, std::memory_order_relaxed);
+    hist.buckets[bucket_of(v)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t prev = hist.max.load(std::memory_order_relaxed);
+    while (v > prev && !hist.max.compare_exchange_weak(prev, v, std::memory_order_relaxed)) {
+    }
+}
+
+void llm_metrics_add(LlmCounter c, uint64_t n) {
+    g_counters[(int)c].fetch_add(n, std::memory_order_relaxed);
+}
+
+std::string llm_metrics_json() {
+    char buf[512];
+    std::string out = "{\"counters\":{";
+    for (int c = 0; c < (int)LlmCounter::Count; ++c) {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%llu", c ? "," : "", kCounterNames[c],
+                 (unsigned long long)g_counters[c].load(std::memory_order_relaxed));
+        out += buf;
+    }
+    out += "},\"histograms_us\":{";
+
+    for (int h = 0; h < (int)LlmHist::Count; ++h) {
+        // Not an atomic snapshot across fields; concurrent records may skew
+        // one histogram by a sample or two
+        const Histogram &hist = g_hist[h];
+        uint64_t buckets[kBuckets];
+        uint64_t count = 0;
+        int last = -1;
+        for (int i = 0; i < kBuckets; ++i) {
+            buckets[i] = hist.buckets[i].load(std::memory_order_relaxed);
+            count += buckets[i];
+            if (buckets[i]) last = i;
+        }
+        const uint64_t sum = hist.sum.load(std::memory_order_relaxed);
+        const uint64_t max = hist.max.load(std::memory_order_relaxed);
+
+        snprintf(buf, sizeof(buf),
+                 "%s\"%s\":{\"count\":%llu,\"sum\":%llu,\"mean\":%.1f,\"max\":%llu,"
+                 "\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"buckets\":[",
+                 h ? "," : "", kHistNames[h],
+                 (unsigned long long)count, (unsigned long long)sum,
+                 count ? (double)sum / count : 0.0, (unsigned long long)max,
+                 quantile(buckets, count, max, 0.50),
+                 quantile(buckets, count, max, 0.90),
+                 quantile(buckets, count, max, 0.99));
+        out += buf;
+        for (int i = 0; i <= last; ++i) {
+            snprintf(buf, sizeof(buf), "%s%llu", i ? "," : "", (unsigned long long)buckets[i]);
+            out += buf;
+        }
+        out += "]}";
+    }
+    return out + "}}";
+}
+
+void llm_metrics_reset() {
+    for (auto &c : g_counters) c.store(0, std::memory_order_relaxed);
+    for (auto &hist : g_hist) {
+        hist.sum.store(0, std::memory_order_relaxed);
+        hist.max.store(0, std::memory_order_relaxed);
+        for (auto &b : hist.buckets) b.store(0, std::memory_order_relaxed);
+    }
+}
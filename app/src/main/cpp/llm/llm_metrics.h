@@ -0,0 +1,50 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// ============================================================================
+// Metrics
+// ============================================================================
+//
+// Process-wide counters and latency histograms, always on. Recording is a few
+// relaxed atomic adds (no locks, no allocation), so it can be called on the
+// decode path. Histograms have fixed log2 buckets over microseconds: bucket i
+// counts samples in [2^(i-1), 2^i) us, bucket 0 counts 0 us. Percentiles in
+// the snapshot are interpolated within a bucket, so they are estimates with
+// at most 2x resolution; count, sum and max are exact.
+// ============================================================================
+
+enum class LlmHist {
+    QueueWait,     // submit -> slot admission
+    Tokenize,      // prompt tokenization (JNI side)
+    Prefill,       // admission -> last prompt token decoded
+    Ttft,          // submit -> first generated token
+    TokenLatency,  // interval between consecutive tokens of a request
+    Decode,        // one llama_decode of the scheduler
+    Sample,        // sampling (or draft verification) of one slot
+    Detokenize,    // token -> text piece
+    Grammar,       // constraint checks of one constrained token, beyond sampling
+    Count
+};
+
+enum class LlmCounter {
+    Requests,          // completed, successfully or not
+    RequestsFailed,    // completed with an error, incl. cancellations
+    RequestsCancelled, // cancelled or past their deadline
+    PromptTokens,
+    PromptTokensReused,
+    GeneratedTokens,
+    ContextShifts,     // sliding-window shifts of a generating slot
+    PromptsTruncated,  // prompts cut to fit the context
+    JniCopyBytes,      // bytes copied converting strings and arrays across JNI
+    JniDirectBytes,    // bytes read or written in place through direct buffers
+    Count
+};
+
+void llm_metrics_record(LlmHist h, int64_t us);
+void llm_metrics_add(LlmCounter c, uint64_t n = 1);
+
+// Counters, then per histogram: count, sum, mean, max, p50/p90/p99 and the
+// non-empty tail of the buckets, as JSON
+std::string llm_metrics_json();
+void llm_metrics_reset();
@@ -0,0 +1,122 @@
+#include "llm_prefetch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <android/log.h>
+
+#include "gguf.h"
+
+#define LOGPF(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_PREFETCH", __VA_ARGS__)
+
+static constexpr size_t kChunk  = 4u << 20;    // readahead granularity
+static constexpr size_t kMaxGap = 64u << 10;   // merge tensors closer than this
+
+struct Range {
+    size_t offset;
+    size_t size;
+};
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Absolute file ranges of all tensor data, sorted and merged
+static bool tensor_ranges(const std::string &path, std::vector<Range> &out) {
+    gguf_init_params params = { /*no_alloc=*/true, /*ctx=*/nullptr };
+    gguf_context *g = gguf_init_from_file(path.c_str(), params);
+    if (!g) return false;
+
+    const size_t base = gguf_get_data_offset(g);
+    const int64_t n = gguf_get_n_tensors(g);
+    std::vector<Range> ranges;
+    ranges.reserve(n);
+    for (int64_t i = 0; i < n; ++i) {
+        ranges.push_back({base + gguf_get_tensor_offset(g, i), gguf_get_tensor_size(g, i)});
+    }
+    gguf_free(g);
+
+    std::sort(ranges.begin(), ranges.end(),
+              [](const Range &a, const Range &b) { return a.offset < b.offset; });
+    out.clear();
+    for (const Range &r : ranges) {
+        if (!out.empty() && r.offset <= out.back().offset + out.back().size + kMaxGap) {
+            out.back().size = std::max(out.back().size, r.offset + r.size - out.back().offset);
+        } else {
+            out.push_back(r);
+        }
+    }
+    return true;
+}
+
+static void prefetch_chunks(LlmPrefetch *p, std::vector<Range> chunks) {
+    if (chunks.empty()) return;
+    // Announce the whole share first so the kernel can queue it
+    const size_t first = chunks.front().offset;
+    const size_t last  = chunks.back().offset + chunks.back().size;
+    posix_fadvise(p->fd, (off_t)first, (off_t)(last - first), POSIX_FADV_WILLNEED);
+
+    for (const Range &c : chunks) {
+        if (readahead(p->fd, (off64_t)c.offset, c.size) != 0) {
+            LOGPF("readahead failed at %zu, stopping this share", c.offset);
+            return;
+        }
+        p->bytes.fetch_add(c.size, std::memory_order_relaxed);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+bool llm_prefetch_begin(LlmPrefetch &p, const std::string &path, int n_threads) {
+    const int64_t t_start = now_us();
+    std::vector<Range> ranges;
+    if (!tensor_ranges(path, ranges)) {
+        LOGPF("Cannot index %s, no prefetch", path.c_str());
+        return false;
+    }
+    p.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (p.fd < 0) return false;
+    p.t_start_us = t_start;
+    p.bytes = 0;
+
+    // Cut into chunks, then give each thread a contiguous run of them so
+    // every thread reads sequentially
+    std::vector<Range> chunks;
+    size_t total = 0;
+    for (const Range &r : ranges) {
+        for (size_t off = 0; off < r.size; off += kChunk) {
+            chunks.push_back({r.offset + off, std::min(kChunk, r.size - off)});
+        }
+        total += r.size;
+    }
+    n_threads = std::max(1, std::min(n_threads, (int)chunks.size()));
+    for (int t = 0; t < n_threads; ++t) {
+        auto from = chunks.begin() + chunks.size() * t / n_threads;
+        auto to   = chunks.begin() + chunks.size() * (t + 1) / n_threads;
+        p.threads.emplace_back(prefetch_chunks, &p, std::vector<Range>(from, to));
+    }
+    LOGPF("Prefetching %zu MiB in %zu ranges on %d threads",
+          total >> 20, ranges.size(), n_threads);
+    return true;
+}
+
+double llm_prefetch_wait(LlmPrefetch &p) {
+    if (p.fd < 0) return 0.0;
+    for (auto &t : p.threads) t.join();
+    p.threads.clear();
+    close(p.fd);
+    p.fd = -1;
+
+    const double ms = (now_us() - p.t_start_us) / 1000.0;
+    LOGPF("Prefetched %llu MiB in %.0f ms",
+          (unsigned long long)(p.bytes.load() >> 20), ms);
+    return ms;
+}
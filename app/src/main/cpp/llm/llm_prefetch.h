@@ -0,0 +1,34 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ============================================================================
+// Weight prefetch
+// ============================================================================
+//
+// llama.cpp maps the GGUF file and lets the first decodes page the weights
+// in, one fault at a time. Prefetch reads the tensor data ranges (from the
+// GGUF index) into the page cache up front, split across a few threads so
+// that flash storage sees several outstanding requests: posix_fadvise
+// WILLNEED for each thread's share, then readahead(2) chunk by chunk, which
+// blocks until the pages are cached without copying them out. llama's
+// mapping then hits the page cache. It runs alongside model loading.
+// ============================================================================
+
+struct LlmPrefetch {
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> bytes{0};   // bytes brought into the page cache
+    int     fd = -1;
+    int64_t t_start_us = 0;
+};
+
+// Start prefetching the tensor data of the GGUF at `path` on n_threads
+// threads. Returns false (and starts nothing) if the file cannot be indexed.
+bool llm_prefetch_begin(LlmPrefetch &p, const std::string &path, int n_threads);
+
+// Wait for the prefetch threads. Returns the elapsed time since begin in ms,
+// or 0 if nothing was started.
+double llm_prefetch_wait(LlmPrefetch &p);
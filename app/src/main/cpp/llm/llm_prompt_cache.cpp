@@ -0,0 +1,471 @@
+#include "llm_prompt_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <android/log.h>
+
+#define LOGPC(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_PCACHE", __VA_ARGS__)
+
+// Prefixes shorter than this are cheaper to prefill than to load
+#define LLM_PCACHE_MIN_TOKENS 64
+
+static const uint32_t kMagic   = 0x43504c4c;   // "LLPC"
+static const uint32_t kVersion = 1;
+
+// -----------------------------------------------------------------------------
+// Index
+// -----------------------------------------------------------------------------
+
+struct PcacheEntry {
+    std::string model_id;
+    uint64_t    hash = 0;              // of tokens
+    std::vector<llama_token> tokens;
+    std::string path;
+    uint64_t    bytes = 0;
+    int64_t     last_used = 0;         // file mtime, seconds
+};
+
+struct PcacheJob {
+    PcacheEntry entry;
+    std::vector<uint8_t> state;
+};
+
+// Everything below is guarded by g_mutex
+static std::mutex g_mutex;
+static std::string g_dir;
+static uint64_t    g_budget = 0;
+static std::vector<PcacheEntry> g_entries;
+static uint64_t    g_total_bytes = 0;
+
+static std::condition_variable g_writer_cv;
+static std::deque<PcacheJob>   g_jobs;
+static bool        g_writer_running = false;
+static std::thread g_writer;
+
+// Scheduler thread only
+static std::string g_model_id;
+static PcacheEntry g_pinned;           // held by the scratch sequence, path empty = none
+
+static std::atomic<uint64_t> g_n_restores{0};
+static std::atomic<uint64_t> g_restored_tokens{0};
+static std::atomic<uint64_t> g_restore_us{0};
+static std::atomic<uint64_t> g_n_stores{0};
+static std::atomic<uint64_t> g_n_evictions{0};
+static std::atomic<uint64_t> g_prefill_tokens{0};
+static std::atomic<uint64_t> g_prefill_us{0};
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static uint64_t fnv1a(const void *data, size_t n, uint64_t h = 1469598103934665603ull) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool write_all(FILE *f, const void *data, size_t n) {
+    return fwrite(data, 1, n, f) == n;
+}
+
+static bool read_all(FILE *f, void *data, size_t n) {
+    return fread(data, 1, n, f) == n;
+}
+
+// Header: magic, version, model id, token count, tokens, state size.
+// The state blob follows.
+static bool write_header(FILE *f, const PcacheEntry &e, uint64_t state_size) {
+    uint32_t id_len = (uint32_t)e.model_id.size();
+    uint32_t n_tokens = (uint32_t)e.tokens.size();
+    return write_all(f, &kMagic, sizeof(kMagic)) &&
+           write_all(f, &kVersion, sizeof(kVersion)) &&
+           write_all(f, &id_len, sizeof(id_len)) &&
+           write_all(f, e.model_id.data(), id_len) &&
+           write_all(f, &n_tokens, sizeof(n_tokens)) &&
+           write_all(f, e.tokens.data(), n_tokens * sizeof(llama_token)) &&
+           write_all(f, &state_size, sizeof(state_size));
+}
+
+static bool read_header(FILE *f, PcacheEntry &e, uint64_t &state_size) {
+    uint32_t magic = 0, version = 0, id_len = 0, n_tokens = 0;
+    if (!read_all(f, &magic, sizeof(magic)) || magic != kMagic) return false;
+    if (!read_all(f, &version, sizeof(version)) || version != kVersion) return false;
+    if (!read_all(f, &id_len, sizeof(id_len)) || id_len > 256) return false;
+    e.model_id.resize(id_len);
+    if (!read_all(f, &e.model_id[0], id_len)) return false;
+    if (!read_all(f, &n_tokens, sizeof(n_tokens)) || n_tokens > (1u << 24)) return false;
+    e.tokens.resize(n_tokens);
+    if (!read_all(f, e.tokens.data(), n_tokens * sizeof(llama_token))) return false;
+    if (!read_all(f, &state_size, sizeof(state_size))) return false;
+    e.hash = fnv1a(e.tokens.data(), n_tokens * sizeof(llama_token));
+    return true;
+}
+
+// Caller holds g_mutex
+static void remove_entry(size_t i) {
+    remove(g_entries[i].path.c_str());
+    g_total_bytes -= g_entries[i].bytes;
+    g_entries.erase(g_entries.begin() + i);
+}
+
+static void drop_entry(const std::string &path) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (size_t i = 0; i < g_entries.size(); ++i) {
+        if (g_entries[i].path == path) {
+            remove_entry(i);
+            break;
+        }
+    }
+}
+
+// Caller holds g_mutex
+static void enforce_budget() {
+    while (g_total_bytes > g_budget && !g_entries.empty()) {
+        size_t lru = 0;
+        for (size_t i = 1; i < g_entries.size(); ++i) {
+            if (g_entries[i].last_used < g_entries[lru].last_used) lru = i;
+        }
+        LOGPC("Evicting %s (%llu bytes)", g_entries[lru].path.c_str(),
+              (unsigned long long)g_entries[lru].bytes);
+        remove_entry(lru);
+        g_n_evictions++;
+    }
+}
+
+static void scan_dir() {
+    g_entries.clear();
+    g_total_bytes = 0;
+    DIR *d = opendir(g_dir.c_str());
+    if (!d) return;
+    while (dirent *de = readdir(d)) {
+        const std::string name = de->d_name;
+        const std::string path = g_dir + "/" + name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            remove(path.c_str());   // interrupted write
+            continue;
+        }
+        if (name.size() < 6 || name.compare(name.size() - 5, 5, ".llpc") != 0) continue;
+
+        PcacheEntry e;
+        uint64_t state_size = 0;
+        FILE *f = fopen(path.c_str(), "rb");
+        bool ok = f && read_header(f, e, state_size);
+        if (f) fclose(f);
+        struct stat st{};
+        if (!ok || stat(path.c_str(), &st) != 0) {
+            remove(path.c_str());
+            continue;
+        }
+        e.path = path;
+        e.bytes = (uint64_t)st.st_size;
+        e.last_used = (int64_t)st.st_mtime;
+        g_total_bytes += e.bytes;
+        g_entries.push_back(std::move(e));
+    }
+    closedir(d);
+}
+
+// -----------------------------------------------------------------------------
+// Writer thread
+// -----------------------------------------------------------------------------
+
+static void writer_loop() {
+    std::unique_lock<std::mutex> lock(g_mutex);
+    while (true) {
+        g_writer_cv.wait(lock, [] { return !g_writer_running || !g_jobs.empty(); });
+        if (g_jobs.empty()) break;   // stopping, queue drained
+
+        PcacheJob job = std::move(g_jobs.front());
+        g_jobs.pop_front();
+        lock.unlock();
+
+        const std::string tmp = job.entry.path + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        bool ok = f && write_header(f, job.entry, job.state.size()) &&
+                  write_all(f, job.state.data(), job.state.size());
+        if (f) ok = (fclose(f) == 0) && ok;
+        ok = ok && rename(tmp.c_str(), job.entry.path.c_str()) == 0;
+        struct stat st{};
+        ok = ok && stat(job.entry.path.c_str(), &st) == 0;
+        if (!ok) {
+            LOGPC("Failed to write %s", job.entry.path.c_str());
+            remove(tmp.c_str());
+        }
+
+        lock.lock();
+        if (ok) {
+            job.entry.bytes = (uint64_t)st.st_size;
+            job.entry.last_used = (int64_t)st.st_mtime;
+            g_total_bytes += job.entry.bytes;
+            g_entries.push_back(std::move(job.entry));
+            g_n_stores++;
+            enforce_budget();
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+bool llm_pcache_open(const std::string &dir, size_t budget_bytes) {
+    if (dir.empty() || budget_bytes == 0) {
+        llm_pcache_close();
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (g_writer_running && dir == g_dir) {
+            g_budget = budget_bytes;
+            enforce_budget();
+            return true;
+        }
+    }
+    llm_pcache_close();
+
+    mkdir(dir.c_str(), 0700);
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_dir = dir;
+    g_budget = budget_bytes;
+    scan_dir();
+    enforce_budget();
+    g_writer_running = true;
+    g_writer = std::thread(writer_loop);
+    LOGPC("Opened %s: %zu entries, %llu bytes", dir.c_str(), g_entries.size(),
+          (unsigned long long)g_total_bytes);
+    return true;
+}
+
+void llm_pcache_close() {
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (!g_writer_running) return;
+        g_writer_running = false;
+    }
+    g_writer_cv.notify_all();
+    g_writer.join();
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_entries.clear();
+    g_total_bytes = 0;
+    g_dir.clear();
+}
+
+void llm_pcache_attach(llama_context *ctx, const llama_context_params &cparams) {
+    const llama_model *model = llama_get_model(ctx);
+    char desc[256];
+    llama_model_desc(model, desc, sizeof(desc));
+    uint64_t h = fnv1a(desc, strlen(desc));
+    const uint64_t dims[] = {
+            llama_model_n_params(model), llama_model_size(model),
+            (uint64_t)llama_model_n_embd(model), (uint64_t)llama_model_n_layer(model),
+            (uint64_t)llama_vocab_n_tokens(llama_model_get_vocab(model)),
+            // The sequence state is only readable into the same KV layout;
+            // flash attention decides whether V is stored transposed
+            (uint64_t)cparams.type_k, (uint64_t)cparams.type_v,
+            (uint64_t)cparams.flash_attn_type,
+    };
+    h = fnv1a(dims, sizeof(dims), h);
+
+    char id[32];
+    snprintf(id, sizeof(id), "%016llx", (unsigned long long)h);
+    g_model_id = id;
+}
+
+void llm_pcache_detach() {
+    g_model_id.clear();
+    g_pinned = PcacheEntry{};
+}
+
+size_t llm_pcache_restore(llama_context *ctx, llama_seq_id seq,
+                          const std::vector<llama_token> &prompt, size_t n_have,
+                          std::vector<llama_token> &cache_tokens) {
+    if (g_model_id.empty()) return 0;
+    const int64_t t_start = now_us();
+
+    // Longest common prefix among this model's entries. The last prompt
+    // token is always decoded again, so it does not count.
+    PcacheEntry best;
+    size_t best_lcp = n_have + LLM_PCACHE_MIN_TOKENS - 1;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (!g_writer_running) return 0;
+        for (const auto &e : g_entries) {
+            if (e.model_id != g_model_id) continue;
+            size_t n = std::min(e.tokens.size(), prompt.size() - 1);
+            size_t lcp = 0;
+            while (lcp < n && e.tokens[lcp] == prompt[lcp]) ++lcp;
+            if (lcp > best_lcp) {
+                best = e;
+                best_lcp = lcp;
+            }
+        }
+    }
+    if (best.path.empty()) return 0;
+
+    // Read the whole file before touching the sequence, so an I/O error
+    // leaves the slot's own cache intact. The buffer is as large as the
+    // state and only lives for this restore.
+    PcacheEntry hdr;
+    uint64_t state_size = 0;
+    std::vector<uint8_t> state;
+    FILE *f = fopen(best.path.c_str(), "rb");
+    bool ok = f && read_header(f, hdr, state_size) && hdr.hash == best.hash;
+    if (ok) {
+        state.resize(state_size);
+        ok = read_all(f, state.data(), state_size);
+    }
+    if (f) fclose(f);
+    if (!ok) {
+        LOGPC("Dropping unreadable entry %s", best.path.c_str());
+        drop_entry(best.path);
+        return 0;
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_memory_seq_rm(mem, seq, -1, -1);
+    cache_tokens.clear();
+    const size_t n_read = llama_state_seq_set_data(ctx, state.data(), state.size(), seq);
+    state = std::vector<uint8_t>();   // give the memory back before decoding
+    if (n_read == 0 || !llama_memory_seq_rm(mem, seq, (llama_pos)best_lcp, -1)) {
+        // The slot's cache is gone by now; at least do not pay for the read
+        // again on the next request
+        LOGPC("Failed to restore %s, dropping it", best.path.c_str());
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        drop_entry(best.path);
+        return 0;
+    }
+    cache_tokens.assign(best.tokens.begin(), best.tokens.begin() + best_lcp);
+
+    // Refresh the LRU position, on disk too so it survives restarts
+    utime(best.path.c_str(), nullptr);
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        for (auto &e : g_entries) {
+            if (e.path == best.path) e.last_used = (int64_t)time(nullptr);
+        }
+    }
+
+    const int64_t us = now_us() - t_start;
+    g_n_restores++;
+    g_restored_tokens += best_lcp;
+    g_restore_us += (uint64_t)us;
+    LOGPC("Restored %zu tokens for seq %d in %.1f ms", best_lcp, seq, us / 1000.0);
+    return best_lcp;
+}
+
+void llm_pcache_store(llama_context *ctx, llama_seq_id seq, llama_seq_id scratch,
+                      const std::vector<llama_token> &tokens, size_t n) {
+    if (g_model_id.empty() || n < LLM_PCACHE_MIN_TOKENS || n > tokens.size()) return;
+
+    PcacheEntry e;
+    e.model_id = g_model_id;
+    e.tokens.assign(tokens.begin(), tokens.begin() + n);
+    e.hash = fnv1a(e.tokens.data(), n * sizeof(llama_token));
+    char name[80];
+    snprintf(name, sizeof(name), "/%s-%016llx-%zu.llpc", g_model_id.c_str(),
+             (unsigned long long)e.hash, n);
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (!g_writer_running) return;
+        e.path = g_dir + name;
+        if (e.path == g_pinned.path) return;
+        for (const auto &x : g_entries) {
+            if (x.path == e.path) return;
+        }
+        for (const auto &j : g_jobs) {
+            if (j.entry.path == e.path) return;
+        }
+    }
+
+    // Share the prefix cells with the scratch sequence; they stay put even
+    // if the slot moves on before the flush
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_memory_seq_rm(mem, scratch, -1, -1);
+    llama_memory_seq_cp(mem, seq, scratch, 0, (llama_pos)n);
+    g_pinned = std::move(e);
+}
+
+void llm_pcache_flush(llama_context *ctx, llama_seq_id scratch) {
+    if (g_pinned.path.empty()) return;
+    const int64_t t_start = now_us();
+    PcacheJob job;
+    job.state.resize(llama_state_seq_get_size(ctx, scratch));
+    size_t written = llama_state_seq_get_data(ctx, job.state.data(), job.state.size(), scratch);
+    llama_memory_seq_rm(llama_get_memory(ctx), scratch, -1, -1);
+    job.entry = std::move(g_pinned);
+    g_pinned = PcacheEntry{};
+    if (written == 0) return;
+    job.state.resize(written);
+    LOGPC("Snapshot of %zu tokens, %zu bytes in %.1f ms", job.entry.tokens.size(), written,
+          (now_us() - t_start) / 1000.0);
+
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        if (!g_writer_running) return;
+        g_jobs.push_back(std::move(job));
+    }
+    g_writer_cv.notify_one();
+}
+
+bool llm_pcache_drop_pinned(llama_context *ctx, llama_seq_id scratch) {
+    if (g_pinned.path.empty()) return false;
+    llama_memory_seq_rm(llama_get_memory(ctx), scratch, -1, -1);
+    g_pinned = PcacheEntry{};
+    return true;
+}
+
+void llm_pcache_record_prefill(int32_t n_tokens, int64_t us) {
+    g_prefill_tokens += (uint64_t)n_tokens;
+    g_prefill_us += (uint64_t)us;
+}
+
+std::string llm_pcache_stats_json() {
+    size_t n_entries;
+    uint64_t bytes, budget;
+    bool enabled;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        n_entries = g_entries.size();
+        bytes = g_total_bytes;
+        budget = g_budget;
+        enabled = g_writer_running;
+    }
+    const uint64_t restored = g_restored_tokens.load();
+    const uint64_t prefilled = g_prefill_tokens.load();
+    const double restore_us_tok = restored ? (double)g_restore_us.load() / restored : 0.0;
+    const double prefill_us_tok = prefilled ? (double)g_prefill_us.load() / prefilled : 0.0;
+
+    char buf[640];
+    snprintf(buf, sizeof(buf),
+             "{\"enabled\":%s,\"entries\":%zu,\"bytes\":%llu,\"budget\":%llu,"
+             "\"restores\":%llu,\"restored_tokens\":%llu,\"restore_ms\":%.1f,"
+             "\"restore_us_per_token\":%.2f,\"prefill_tokens\":%llu,\"prefill_ms\":%.1f,"
+             "\"prefill_us_per_token\":%.2f,\"est_saved_ms\":%.1f,"
+             "\"stores\":%llu,\"evictions\":%llu}",
+             enabled ? "true" : "false", n_entries, (unsigned long long)bytes,
+             (unsigned long long)budget, (unsigned long long)g_n_restores.load(),
+             (unsigned long long)restored, g_restore_us.load() / 1000.0, restore_us_tok,
+             (unsigned long long)prefilled, g_prefill_us.load() / 1000.0, prefill_us_tok,
+             prefilled ? restored * (prefill_us_tok - restore_us_tok) / 1000.0 : 0.0,
+             (unsigned long long)g_n_stores.load(), (unsigned long long)g_n_evictions.load());
+    return buf;
+}
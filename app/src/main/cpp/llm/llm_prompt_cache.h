@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// ============================================================================
+// Disk prompt cache
+// ============================================================================
+//
+// Persists the KV state of evaluated prompt prefixes (typically a shared
+// system prompt) so that they are restored instead of re-prefilled after an
+// app restart or a model reload. Entries are keyed by model identity plus a
+// hash of the token prefix; each file holds the tokens and the sequence state
+// from llama_state_seq_get_data. The directory is kept under a byte budget by
+// evicting the least recently used entries.
+//
+// A prefix to store is first pinned in a scratch sequence (shared cells, no
+// copy). The snapshot, a memory copy of up to hundreds of MB, is taken on
+// the scheduler thread once no slot is decoding, and written by a background
+// writer, so neither the copy nor disk latency stalls decoding. Restores read
+// the file synchronously on admission, then trim to the common prefix.
+// ============================================================================
+
+// Use `dir` with a size budget. Calling again with the same dir only changes
+// the budget; an empty dir or a zero budget disables the cache.
+bool llm_pcache_open(const std::string &dir, size_t budget_bytes);
+void llm_pcache_close();
+
+// Identify the model and KV format (cache types, flash attention) of `ctx`,
+// created with `cparams`; only entries of that model and format are matched.
+// Called by the scheduler when it takes over a context.
+void llm_pcache_attach(llama_context *ctx, const llama_context_params &cparams);
+void llm_pcache_detach();
+
+// Replace the KV of `seq` with the cached entry sharing the longest prefix
+// with `prompt`, if that beats `n_have` tokens already in place. Returns the
+// number of restored tokens, or 0. `cache_tokens` always mirrors the sequence
+// afterwards: it is only changed when the sequence was. Entries that cannot
+// be read or restored are dropped.
+size_t llm_pcache_restore(llama_context *ctx, llama_seq_id seq,
+                          const std::vector<llama_token> &prompt, size_t n_have,
+                          std::vector<llama_token> &cache_tokens);
+
+// Pin the first n tokens of `seq` in the scratch sequence for the next
+// llm_pcache_flush, unless an equal entry already exists. Replaces a prefix
+// pinned earlier and not flushed yet.
+void llm_pcache_store(llama_context *ctx, llama_seq_id seq, llama_seq_id scratch,
+                      const std::vector<llama_token> &tokens, size_t n);
+
+// Snapshot the pinned prefix, if any, and queue it for writing. Call while
+// no slot is decoding.
+void llm_pcache_flush(llama_context *ctx, llama_seq_id scratch);
+
+// Unpin the prefix without storing it, to free KV cells. Returns true if
+// one was pinned.
+bool llm_pcache_drop_pinned(llama_context *ctx, llama_seq_id scratch);
+
+// Prefill work done by the scheduler, for the restore-vs-prefill comparison
+void llm_pcache_record_prefill(int32_t n_tokens, int64_t us);
+
+// Entries, bytes, restores and stores, and restore vs prefill time per token
+std::string llm_pcache_stats_json();
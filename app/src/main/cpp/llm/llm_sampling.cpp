@@ -0,0 +1,368 @@
+#include "llm_sampling.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LLM_SAMPLER_NEON 1
+#endif
+
+// -----------------------------------------------------------------------------
+// exp(x) for x <= 0 (inputs are always shifted by the max logit).
+// Cephes-style range reduction + polynomial, ~1e-7 relative error. Inputs
+// below -87 (and NaN) give exactly 0, so masked -inf logits never get drawn.
+// -----------------------------------------------------------------------------
+
+static const float kExpLo = -87.0f;
+static const float kLog2e = 1.44269504088896341f;
+static const float kExpC1 = 0.693359375f;
+static const float kExpC2 = -2.12194440e-4f;
+static const float kExpP0 = 1.9875691500e-4f;
+static const float kExpP1 = 1.3981999507e-3f;
+static const float kExpP2 = 8.3334519073e-3f;
+static const float kExpP3 = 4.1665795894e-2f;
+static const float kExpP4 = 1.6666665459e-1f;
+static const float kExpP5 = 5.0000001201e-1f;
+
+static inline float exp_scalar(float x) {
+    if (!(x >= kExpLo)) return 0.0f;
+    float n = std::floor(x * kLog2e + 0.5f);
+    float r = x - n * kExpC1 - n * kExpC2;
+    float p = kExpP0;
+    p = p * r + kExpP1;
+    p = p * r + kExpP2;
+    p = p * r + kExpP3;
+    p = p * r + kExpP4;
+    p = p * r + kExpP5;
+    p = p * r * r + r + 1.0f;
+    int32_t bits = ((int32_t)n + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+#ifdef LLM_SAMPLER_NEON
+static inline float32x4_t exp_neon(float32x4_t x) {
+    uint32x4_t valid = vcgeq_f32(x, vdupq_n_f32(kExpLo));
+    x = vmaxq_f32(x, vdupq_n_f32(kExpLo));
+    float32x4_t n = vrndnq_f32(vmulq_n_f32(x, kLog2e));
+    float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(kExpC1));
+    r = vfmsq_f32(r, n, vdupq_n_f32(kExpC2));
+    float32x4_t p = vdupq_n_f32(kExpP0);
+    p = vfmaq_f32(vdupq_n_f32(kExpP1), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP2), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP3), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP4), p, r);
+    p = vfmaq_f32(vdupq_n_f32(kExpP5), p, r);
+    p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, vmulq_f32(r, r));
+    int32x4_t e = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+    float32x4_t res = vmulq_f32(p, vreinterpretq_f32_s32(e));
+    return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(res), valid));
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// Full-vocab passes
+// -----------------------------------------------------------------------------
+
+static float max_value(const float *x, int n) {
+    int i = 0;
+    float mx = -INFINITY;
+#ifdef LLM_SAMPLER_NEON
+    if (n >= 16) {
+        float32x4_t m0 = vld1q_f32(x),      m1 = vld1q_f32(x + 4);
+        float32x4_t m2 = vld1q_f32(x + 8),  m3 = vld1q_f32(x + 12);
+        for (i = 16; i + 16 <= n; i += 16) {
+            m0 = vmaxq_f32(m0, vld1q_f32(x + i));
+            m1 = vmaxq_f32(m1, vld1q_f32(x + i + 4));
+            m2 = vmaxq_f32(m2, vld1q_f32(x + i + 8));
+            m3 = vmaxq_f32(m3, vld1q_f32(x + i + 12));
+        }
+        mx = vmaxvq_f32(vmaxq_f32(vmaxq_f32(m0, m1), vmaxq_f32(m2, m3)));
+    }
+#endif
+    for (; i < n; ++i) {
+        if (x[i] > mx) mx = x[i];
+    }
+    return mx;
+}
+
+static llama_token argmax(const float *x, int n) {
+#ifdef LLM_SAMPLER_NEON
+    // Vector max, then locate its first occurrence
+    float mx = max_value(x, n);
+    for (int i = 0; i < n; ++i) {
+        if (x[i] == mx) return (llama_token)i;
+    }
+    return LLAMA_TOKEN_NULL;   // all NaN
+#else
+    llama_token best = LLAMA_TOKEN_NULL;
+    float mx = -INFINITY;
+    for (int i = 0; i < n; ++i) {
+        if (x[i] > mx) {
+            mx = x[i];
+            best = (llama_token)i;
+        }
+    }
+    return best;
+#endif
+}
+
+// out[i] = exp((x[i] - mx) * inv_temp); returns the sum
+static float exp_sum(const float *x, float *out, int n, float mx, float inv_temp) {
+    int i = 0;
+    float sum = 0.0f;
+#ifdef LLM_SAMPLER_NEON
+    float32x4_t vmx = vdupq_n_f32(mx);
+    float32x4_t s0 = vdupq_n_f32(0.0f), s1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        float32x4_t e0 = exp_neon(vmulq_n_f32(vsubq_f32(vld1q_f32(x + i), vmx), inv_temp));
+        float32x4_t e1 = exp_neon(vmulq_n_f32(vsubq_f32(vld1q_f32(x + i + 4), vmx), inv_temp));
+        vst1q_f32(out + i, e0);
+        vst1q_f32(out + i + 4, e1);
+        s0 = vaddq_f32(s0, e0);
+        s1 = vaddq_f32(s1, e1);
+    }
+    sum = vaddvq_f32(vaddq_f32(s0, s1));
+#endif
+    for (; i < n; ++i) {
+        out[i] = exp_scalar((x[i] - mx) * inv_temp);
+        sum += out[i];
+    }
+    return sum;
+}
+
+// -----------------------------------------------------------------------------
+// Top-k: bounded min-heap over one pass. The heap root is the admission
+// threshold; blocks of values that cannot beat it are skipped with one
+// vector compare. Leaves heap sorted by descending value.
+// -----------------------------------------------------------------------------
+
+static bool heap_less(const LlmCandidate &a, const LlmCandidate &b) {
+    return a.value > b.value;   // min-heap on value
+}
+
+static inline void heap_offer(std::vector<LlmCandidate> &heap, float v, int id) {
+    if (v <= heap.front().value) return;
+    std::pop_heap(heap.begin(), heap.end(), heap_less);
+    heap.back() = {v, (llama_token)id};
+    std::push_heap(heap.begin(), heap.end(), heap_less);
+}
+
+static void top_k(const float *x, int n, int k, std::vector<LlmCandidate> &heap) {
+    heap.clear();
+    for (int i = 0; i < k; ++i) {
+        heap.push_back({x[i], (llama_token)i});
+    }
+    std::make_heap(heap.begin(), heap.end(), heap_less);
+
+    int i = k;
+#ifdef LLM_SAMPLER_NEON
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t v = vld1q_f32(x + i);
+        if (vmaxvq_u32(vcgtq_f32(v, vdupq_n_f32(heap.front().value))) == 0) continue;
+        for (int j = i; j < i + 4; ++j) heap_offer(heap, x[j], j);
+    }
+#endif
+    for (; i < n; ++i) {
+        heap_offer(heap, x[i], i);
+    }
+    std::sort_heap(heap.begin(), heap.end(), heap_less);
+}
+
+// -----------------------------------------------------------------------------
+// Helpers over an unnormalized, descending probability prefix
+// -----------------------------------------------------------------------------
+
+// Number of leading entries whose cumulative mass reaches top_p * sum
+static int top_p_cut(const float *p, int n, float sum, float top_p) {
+    if (!(top_p > 0.0f && top_p < 1.0f)) return n;
+    const float target = top_p * sum;
+    float cum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        cum += p[i];
+        if (cum >= target) return i + 1;
+    }
+    return n;
+}
+
+static int draw(std::mt19937 &rng, const float *p, int n, float sum) {
+    std::uniform_real_distribution<float> dist(0.0f, sum);
+    float u = dist(rng);
+    float cum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        cum += p[i];
+        if (u < cum) return i;
+    }
+    // Rounding: fall back to the last entry with non-zero mass
+    for (int i = n - 1; i >= 0; --i) {
+        if (p[i] > 0.0f) return i;
+    }
+    return -1;
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+void llm_sampler_init(LlmSampler &smpl, int32_t n_vocab, uint32_t seed) {
+    smpl.n_vocab = n_vocab;
+    smpl.rng.seed(seed);
+    smpl.probs.assign(n_vocab > 0 ? n_vocab : 0, 0.0f);
+    smpl.heap.clear();
+    smpl.heap.reserve(n_vocab > 0 ? n_vocab : 0);
+}
+
+llama_token llm_sampler_sample(LlmSampler &smpl, const float *logits,
+                               float temp, float top_p, int top_k_n) {
+    const int n_vocab = smpl.n_vocab;
+    if (n_vocab <= 0 || !logits) {
+        return LLAMA_TOKEN_NULL;
+    }
+
+    // Greedy fallback if temp <= 0
+    if (temp <= 0.0f) {
+        return argmax(logits, n_vocab);
+    }
+    const float inv_temp = 1.0f / temp;
+    float *probs = smpl.probs.data();
+
+    // Top-k, then softmax and top-p over the k survivors only
+    if (top_k_n > 0 && top_k_n < n_vocab) {
+        top_k(logits, n_vocab, top_k_n, smpl.heap);
+        const float mx = smpl.heap[0].value;
+        float sum = 0.0f;
+        for (int i = 0; i < top_k_n; ++i) {
+            probs[i] = exp_scalar((smpl.heap[i].value - mx) * inv_temp);
+            sum += probs[i];
+        }
+        int n_keep = top_p_cut(probs, top_k_n, sum, top_p);
+        float kept = 0.0f;
+        for (int i = 0; i < n_keep; ++i) kept += probs[i];
+
+        int idx = draw(smpl.rng, probs, n_keep, kept);
+        return idx < 0 ? LLAMA_TOKEN_NULL : smpl.heap[idx].id;
+    }
+
+    // No top-k: softmax over the whole vocabulary
+    const float mx = max_value(logits, n_vocab);
+    if (!std::isfinite(mx)) {
+        return argmax(logits, n_vocab);
+    }
+    const float sum = exp_sum(logits, probs, n_vocab, mx, inv_temp);
+
+    if (!(top_p > 0.0f && top_p < 1.0f)) {
+        int idx = draw(smpl.rng, probs, n_vocab, sum);
+        return idx < 0 ? LLAMA_TOKEN_NULL : (llama_token)idx;
+    }
+
+    // Top-p: widen a top-m selection until it covers the nucleus
+    for (int m = std::min(64, n_vocab); ; m = std::min(m * 4, n_vocab)) {
+        top_k(probs, n_vocab, m, smpl.heap);
+        float cum = 0.0f;
+        int n_keep = 0;
+        while (n_keep < m && cum < top_p * sum) {
+            cum += smpl.heap[n_keep].value;
+            ++n_keep;
+        }
+        if (cum >= top_p * sum || m == n_vocab) {
+            // Draw over the kept heap values
+            std::uniform_real_distribution<float> dist(0.0f, cum);
+            float u = dist(smpl.rng);
+            float acc = 0.0f;
+            for (int i = 0; i < n_keep; ++i) {
+                acc += smpl.heap[i].value;
+                if (u < acc) return smpl.heap[i].id;
+            }
+            return n_keep > 0 ? smpl.heap[n_keep - 1].id : LLAMA_TOKEN_NULL;
+        }
+    }
+}
+
+int llm_sampler_dist(LlmSampler &smpl, const float *logits, float temp,
+                     float top_p, int top_k_n, std::vector<LlmCandidate> &out) {
+    out.clear();
+    const int n_vocab = smpl.n_vocab;
+    if (n_vocab <= 0 || !logits) {
+        return 0;
+    }
+
+    const float mx = max_value(logits, n_vocab);
+    if (temp <= 0.0f || !std::isfinite(mx)) {
+        llama_token best = argmax(logits, n_vocab);
+        if (best != LLAMA_TOKEN_NULL) out.push_back({1.0f, best});
+        return (int)out.size();
+    }
+    const float inv_temp = 1.0f / temp;
+    float *probs = smpl.probs.data();
+
+    if (top_k_n > 0 && top_k_n < n_vocab) {
+        top_k(logits, n_vocab, top_k_n, smpl.heap);
+        float sum = 0.0f;
+        for (int i = 0; i < top_k_n; ++i) {
+            probs[i] = exp_scalar((smpl.heap[i].value - mx) * inv_temp);
+            sum += probs[i];
+        }
+        int n_keep = top_p_cut(probs, top_k_n, sum, top_p);
+        float kept = 0.0f;
+        for (int i = 0; i < n_keep; ++i) kept += probs[i];
+        for (int i = 0; i < n_keep; ++i) {
+            out.push_back({probs[i] / kept, smpl.heap[i].id});
+        }
+        return (int)out.size();
+    }
+
+    const float sum = exp_sum(logits, probs, n_vocab, mx, inv_temp);
+
+    if (!(top_p > 0.0f && top_p < 1.0f)) {
+        // Whole vocabulary, in id order
+        const float inv_sum = 1.0f / sum;
+        for (int i = 0; i < n_vocab; ++i) {
+            out.push_back({probs[i] * inv_sum, (llama_token)i});
+        }
+        return (int)out.size();
+    }
+
+    for (int m = std::min(64, n_vocab); ; m = std::min(m * 4, n_vocab)) {
+        top_k(probs, n_vocab, m, smpl.heap);
+        float cum = 0.0f;
+        int n_keep = 0;
+        while (n_keep < m && cum < top_p * sum) {
+            cum += smpl.heap[n_keep].value;
+            ++n_keep;
+        }
+        if (cum >= top_p * sum || m == n_vocab) {
+            for (int i = 0; i < n_keep; ++i) {
+                out.push_back({smpl.heap[i].value / cum, smpl.heap[i].id});
+            }
+            return (int)out.size();
+        }
+    }
+}
+
+llama_token llm_sampler_draw(LlmSampler &smpl, const std::vector<LlmCandidate> &dist) {
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    float u = u01(smpl.rng);
+    float cum = 0.0f;
+    for (const auto &c : dist) {
+        cum += c.value;
+        if (u < cum) return c.id;
+    }
+    for (auto it = dist.rbegin(); it != dist.rend(); ++it) {
+        if (it->value > 0.0f) return it->id;
+    }
+    return LLAMA_TOKEN_NULL;
+}
+
+float llm_sampler_logprob(LlmSampler &smpl, const float *logits, llama_token token) {
+    const int n_vocab = smpl.n_vocab;
+    if (n_vocab <= 0 || !logits || token < 0 || token >= n_vocab) {
+        return -INFINITY;
+    }
+    const float mx = max_value(logits, n_vocab);
+    if (!std::isfinite(mx)) return -INFINITY;
+    const float sum = exp_sum(logits, smpl.probs.data(), n_vocab, mx, 1.0f);
+    return logits[token] - mx - std::log(sum);
+}
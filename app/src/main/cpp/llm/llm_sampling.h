@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "llama.h"
+
+// ============================================================================
+// Sampler state
+// ============================================================================
+//
+// One sampler per sequence. All scratch is sized once in llm_sampler_init, so
+// sampling a token does not allocate. The full-vocab passes (max, exp, sum,
+// top-k threshold scan) use NEON on arm64 and a scalar path elsewhere.
+// ============================================================================
+
+struct LlmCandidate {
+    float       value;   // logit or probability, depending on the stage
+    llama_token id;
+};
+
+struct LlmSampler {
+    int32_t n_vocab = 0;
+    std::mt19937 rng;
+
+    std::vector<float>        probs;   // [n_vocab] full-vocab softmax scratch
+    std::vector<LlmCandidate> heap;    // top-k survivors, capacity >= top_k
+};
+
+// ============================================================================
+// API
+// ============================================================================
+
+// Size the scratch buffers for a vocabulary and seed the RNG
+void llm_sampler_init(LlmSampler &smpl, int32_t n_vocab, uint32_t seed);
+
+// Sample one token from the raw logits of a single position.
+// temp <= 0 selects the arg-max; top_k <= 0 and top_p >= 1 disable filtering.
+// Top-p is applied to the top-k survivors only.
+llama_token llm_sampler_sample(LlmSampler &smpl, const float *logits,
+                               float temp, float top_p, int top_k);
+
+// Write the filtered distribution of one position to `out` as {probability, id}
+// entries summing to 1, using the same temp/top-k/top-p rules as
+// llm_sampler_sample (temp <= 0 gives the arg-max with probability 1).
+// `out` is reused; it only allocates when it must grow. Returns out.size().
+int llm_sampler_dist(LlmSampler &smpl, const float *logits, float temp,
+                     float top_p, int top_k, std::vector<LlmCandidate> &out);
+
+// Draw one token from a distribution produced by llm_sampler_dist
+llama_token llm_sampler_draw(LlmSampler &smpl, const std::vector<LlmCandidate> &dist);
+
+// Log-probability of `token` under the unfiltered softmax of the logits
+// (temp 1), e.g. to rank completions. One full-vocab pass.
+float llm_sampler_logprob(LlmSampler &smpl, const float *logits, llama_token token);
@@ -0,0 +1,1057 @@
+#include "llm_scheduler.h"
+#include "llm_grammar.h"
+#include "llm_metrics.h"
+#include "llm_prompt_cache.h"
+#include "llm_sampling.h"
+#include "llm_session.h"
+#include "llm_speculative.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <android/log.h>
+
+#define LOGS(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_SCHED", __VA_ARGS__)
+
+// Tokens always kept at the start of a sequence by a context shift; the first
+// positions act as attention sinks, so dropping them degrades output
+#define LLM_N_SINK_DEFAULT 4
+
+// -----------------------------------------------------------------------------
+// Slots
+// -----------------------------------------------------------------------------
+
+enum class SlotState {
+    Idle,
+    Prefill,   // prompt tokens still being decoded
+    Decode,    // sampling one token per iteration
+    Forked     // waiting for another slot to prefill the shared prompt (n > 1)
+};
+
+struct LlmSlot {
+    llama_seq_id id    = 0;
+    SlotState    state = SlotState::Idle;
+    std::shared_ptr<LlmRequest> req;
+
+    std::vector<llama_token> cache_tokens;   // tokens whose KV lives in seq `id`
+    size_t      n_prompt_done = 0;           // prompt tokens already in the KV
+    llama_token pending = LLAMA_TOKEN_NULL;  // sampled but not yet decoded
+    uint64_t    last_used = 0;
+    uint64_t    admitted_at = 0;             // admission order, for FCFS prefill
+    int64_t     session = 0;                 // chat session whose KV this slot holds
+    LlmSampler  sampler;
+    LlmDraft    draft;                       // speculative proposals, if a draft model is attached
+    LlmGrammar  grammar;                     // parse state of the request's grammar, if any
+    uint64_t    cache_lora = 0;              // LlmLora::id the cached KV was computed with, 0 = none
+    LlmSlot    *fork_of  = nullptr;          // Forked: the slot prefilling the prompt
+    // Leading cache tokens whose KV cells may also belong to another seq
+    // (forks share the prompt). Shared cells must not be shifted: their
+    // position is common to every seq that holds them.
+    size_t      n_shared = 0;
+
+    // Per-iteration batch bookkeeping
+    int32_t n_in_batch = 0;   // tokens this slot contributed
+    int32_t i_batch    = -1;  // output row to sample from, -1 = none
+};
+
+// -----------------------------------------------------------------------------
+// Globals
+// -----------------------------------------------------------------------------
+
+static llama_context     *g_ctx   = nullptr;
+static const llama_vocab *g_vocab = nullptr;
+static uint32_t           g_n_ctx = 0;
+
+static std::vector<LlmSlot> g_slots;
+// One batch, allocated at start and reused for every iteration. Each
+// iteration is capped at one physical ubatch so that a long prefill delays
+// the generating slots by at most one ubatch of compute.
+static llama_batch g_batch{};
+static int32_t     g_batch_cap = 0;
+static llama_seq_id g_scratch_seq = -1;   // spare seq id for prompt cache snapshots, -1 = none
+static uint64_t    g_tick = 0;
+static std::vector<LlmSlot *> g_prefill_order;
+static std::vector<llama_token> g_spec_out;   // tokens emitted by one verify
+// Requests in the batch being decoded, read by the abort callback
+static std::vector<const LlmRequest *> g_batch_reqs;
+
+static std::thread g_thread;
+static std::atomic<int64_t> g_first_ttft_us{-1};
+static std::atomic<int> g_n_sink{LLM_N_SINK_DEFAULT};   // < 0: no context shift
+static bool g_can_shift = false;   // the context's memory supports seq_add
+static std::shared_ptr<LlmLora> g_lora;   // adapter applied to g_ctx, nullptr = none
+
+static uint64_t lora_id(const LlmRequest &req) {
+    return req.lora ? req.lora->id : 0;
+}
+
+// Everything below is guarded by g_queue_mutex
+static std::mutex g_queue_mutex;
+static std::condition_variable g_queue_cv;
+static std::deque<std::shared_ptr<LlmRequest>> g_queue;
+static bool g_running     = false;
+static bool g_clear_cache = false;
+static int  g_new_threads       = 0;
+static int  g_new_threads_batch = 0;
+static bool g_paused = false;   // llm_scheduler_pause: no iteration may start
+static bool g_parked = false;   // the thread is waiting for work, not decoding
+static std::condition_variable g_parked_cv;
+
+// Requests with an id, for llm_scheduler_cancel
+static std::mutex g_live_mutex;
+static std::unordered_map<uint64_t, std::weak_ptr<LlmRequest>> g_live;
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static size_t common_prefix_length(const std::vector<llama_token> &a,
+                                   const std::vector<llama_token> &b) {
+    size_t n = std::min(a.size(), b.size());
+    size_t i = 0;
+    while (i < n && a[i] == b[i]) ++i;
+    return i;
+}
+
+static std::string token_to_piece(llama_token token) {
+    char buf[512];
+    int32_t n = llama_token_to_piece(g_vocab, token, buf, sizeof(buf), 0, false);
+    if (n < 0) return "";
+    return std::string(buf, n);
+}
+
+// Why a request should stop early, or nullptr to keep going
+static const char *abandon_reason(const LlmRequest &req, int64_t now_us) {
+    if (req.cancelled.load(std::memory_order_relaxed)) return "cancelled";
+    if (req.deadline_us > 0 && now_us >= req.deadline_us) return "deadline exceeded";
+    return nullptr;
+}
+
+static void complete_request(LlmRequest &req, const char *error) {
+    llm_metrics_add(LlmCounter::Requests);
+    if (error) {
+        llm_metrics_add(LlmCounter::RequestsFailed);
+        if (!strcmp(error, "cancelled") || !strcmp(error, "deadline exceeded")) {
+            llm_metrics_add(LlmCounter::RequestsCancelled);
+        }
+    }
+    if (req.id) {
+        std::lock_guard<std::mutex> lock(g_live_mutex);
+        auto it = g_live.find(req.id);
+        if (it != g_live.end() && it->second.lock().get() == &req) g_live.erase(it);
+    }
+    // Update the session history before waiters can start the next turn
+    if (req.session) llm_session_finish(req, error == nullptr);
+    {
+        std::lock_guard<std::mutex> lock(req.mutex);
+        if (error) req.error = error;
+        req.done = true;
+    }
+    req.cv.notify_all();
+    if (req.on_done) req.on_done();
+}
+
+// Complete a request that never reached a slot, and its forks
+static void complete_group(LlmRequest &req, const char *error) {
+    complete_request(req, error);
+    for (const auto &fork : req.forks) complete_request(*fork, error);
+}
+
+static void release_slot(LlmSlot &slot, const char *error) {
+    if (slot.req) complete_request(*slot.req, error);
+    slot.req.reset();
+    slot.draft.tokens.clear();
+    llm_grammar_free(slot.grammar);
+    slot.state     = SlotState::Idle;
+    slot.pending   = LLAMA_TOKEN_NULL;
+    slot.fork_of   = nullptr;
+    slot.last_used = ++g_tick;
+
+    // Forks still waiting for this prompt end with it
+    for (auto &s : g_slots) {
+        if (s.state == SlotState::Forked && s.fork_of == &slot) release_slot(s, error);
+    }
+}
+
+static void clear_slot_cache(LlmSlot &slot) {
+    llama_memory_seq_rm(llama_get_memory(g_ctx), slot.id, -1, -1);
+    slot.cache_tokens.clear();
+    slot.n_shared = 0;
+    llm_spec_clear_seq(slot.draft, slot.id);
+}
+
+static size_t n_idle_slots() {
+    size_t n = 0;
+    for (const auto &s : g_slots) {
+        if (s.state == SlotState::Idle) ++n;
+    }
+    return n;
+}
+
+static bool any_active() {
+    for (const auto &s : g_slots) {
+        if (s.state != SlotState::Idle) return true;
+    }
+    return false;
+}
+
+// -----------------------------------------------------------------------------
+// Admission
+// -----------------------------------------------------------------------------
+
+// Fresh parse state for the slot's request; the grammar was validated at submit
+static void bind_grammar(LlmSlot &slot) {
+    std::string error;
+    if (!llm_grammar_init(slot.grammar, g_vocab, slot.req->grammar, error)) {
+        LOGS("Slot %d: %s, generating unconstrained", slot.id, error.c_str());
+    }
+}
+
+// Move a session's KV out of its slot (paging it out if enabled); the slot
+// keeps the cells as an ordinary prefix cache
+static void unbind_session(LlmSlot &slot) {
+    if (!slot.session) return;
+    if (llm_session_exists(slot.session)) {
+        llm_session_page_out(slot.session, g_ctx, slot.id, slot.cache_tokens);
+    }
+    slot.session = 0;
+}
+
+// The session's own slot if it still holds it; otherwise the idle unbound
+// slot with the longest cached prefix of the prompt (least recently used on
+// ties); otherwise the least recently used idle session slot, evicted.
+// Returns nullptr if every slot is busy.
+static LlmSlot *pick_slot(const LlmRequest &req) {
+    LlmSlot *best = nullptr;
+    size_t best_lcp = 0;
+    for (auto &s : g_slots) {
+        if (s.session && s.session == req.session) {
+            return s.state == SlotState::Idle ? &s : nullptr;
+        }
+        if (s.state != SlotState::Idle || s.session) continue;
+        size_t lcp = s.cache_lora == lora_id(req)
+                     ? common_prefix_length(s.cache_tokens, req.prompt) : 0;
+        if (!best || lcp > best_lcp ||
+            (lcp == best_lcp && s.last_used < best->last_used)) {
+            best = &s;
+            best_lcp = lcp;
+        }
+    }
+    if (best) return best;
+
+    for (auto &s : g_slots) {
+        if (s.state != SlotState::Idle) continue;
+        if (!best || s.last_used < best->last_used) best = &s;
+    }
+    if (best) {
+        LOGS("Slot %d: evicting session %lld", best->id, (long long)best->session);
+        unbind_session(*best);
+    }
+    return best;
+}
+
+static void admit(LlmSlot &slot, const std::shared_ptr<LlmRequest> &req) {
+    // KV computed under another adapter is of no use. Checked before a
+    // session page-in, which brings base model KV in place of it.
+    if (slot.cache_lora != lora_id(*req)) {
+        clear_slot_cache(slot);
+        slot.cache_lora = lora_id(*req);
+    }
+
+    if (req->session && slot.session != req->session) {
+        slot.session = req->session;
+        llm_session_page_in(req->session, g_ctx, slot.id, slot.cache_tokens);
+    }
+
+    // Keep the common prefix, or restore a longer one from the disk cache
+    // (base model only); the last prompt token is always re-decoded so that
+    // fresh logits are produced for it.
+    size_t n_keep = common_prefix_length(slot.cache_tokens, req->prompt);
+    if (!req->lora) llm_pcache_restore(g_ctx, slot.id, req->prompt, n_keep, slot.cache_tokens);
+    n_keep = common_prefix_length(slot.cache_tokens, req->prompt);
+    if (n_keep >= req->prompt.size()) {
+        n_keep = req->prompt.size() - 1;
+    }
+
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    if (!llama_memory_seq_rm(mem, slot.id, (llama_pos)n_keep, -1)) {
+        // Partial removal is not supported by every memory type (e.g. recurrent)
+        llama_memory_seq_rm(mem, slot.id, -1, -1);
+        n_keep = 0;
+    }
+    slot.cache_tokens.resize(n_keep);
+    slot.n_shared = std::min(slot.n_shared, n_keep);
+    slot.n_prompt_done = n_keep;
+    slot.pending = LLAMA_TOKEN_NULL;
+    slot.req   = req;
+    slot.state = SlotState::Prefill;
+    slot.admitted_at = ++g_tick;
+    bind_grammar(slot);
+
+    req->n_prompt_reused = (int32_t)n_keep;
+    req->t_admit_us = llm_clock_us();
+    llm_metrics_record(LlmHist::QueueWait, req->t_admit_us - req->t_submit_us);
+    llm_metrics_add(LlmCounter::PromptTokens, req->prompt.size());
+    llm_metrics_add(LlmCounter::PromptTokensReused, n_keep);
+    LOGS("Slot %d: admitted request, reusing %zu of %zu prompt tokens",
+         slot.id, n_keep, req->prompt.size());
+}
+
+// Idle slot whose cache is least worth keeping: plain prefix caches before
+// sessions, least recently used first
+static LlmSlot *pick_fork_slot() {
+    LlmSlot *best = nullptr;
+    for (auto &s : g_slots) {
+        if (s.state != SlotState::Idle) continue;
+        if (!best || (best->session && !s.session) ||
+            (!best->session == !s.session && s.last_used < best->last_used)) {
+            best = &s;
+        }
+    }
+    return best;
+}
+
+// Reserve a slot for a fork of the request prefilling on `leader`. Its KV is
+// replaced once the prompt is done, see fork_slots.
+static void admit_fork(LlmSlot &slot, LlmSlot &leader, const std::shared_ptr<LlmRequest> &req) {
+    unbind_session(slot);
+    slot.pending = LLAMA_TOKEN_NULL;
+    slot.req     = req;
+    slot.state   = SlotState::Forked;
+    slot.fork_of = &leader;
+    slot.admitted_at = ++g_tick;
+    bind_grammar(slot);
+
+    req->t_admit_us = llm_clock_us();
+    llm_metrics_record(LlmHist::QueueWait, req->t_admit_us - req->t_submit_us);
+}
+
+// -----------------------------------------------------------------------------
+// Batch construction
+// -----------------------------------------------------------------------------
+
+static void batch_add(llama_token token, llama_pos pos, llama_seq_id seq,
+                      bool logits) {
+    int32_t i = g_batch.n_tokens++;
+    g_batch.token[i]     = token;
+    g_batch.pos[i]       = pos;
+    g_batch.n_seq_id[i]  = 1;
+    g_batch.seq_id[i][0] = seq;
+    g_batch.logits[i]    = logits ? 1 : 0;
+}
+
+static void build_batch() {
+    g_batch.n_tokens = 0;
+    for (auto &s : g_slots) {
+        s.n_in_batch = 0;
+        s.i_batch = -1;
+    }
+
+    // The pending token (plus any draft tokens) of every generating slot
+    // first, so decode never starves. Drafts need logits for verification.
+    for (auto &s : g_slots) {
+        if (s.state != SlotState::Decode) continue;
+        const llama_pos pos = (llama_pos)s.cache_tokens.size();
+        s.i_batch = g_batch.n_tokens;
+        s.n_in_batch = 1 + (int32_t)s.draft.tokens.size();
+        batch_add(s.pending, pos, s.id, true);
+        for (size_t j = 0; j < s.draft.tokens.size(); ++j) {
+            batch_add(s.draft.tokens[j], pos + 1 + (llama_pos)j, s.id, true);
+        }
+    }
+
+    // Fill the remaining room with prompt chunks, oldest request first;
+    // logits only for the last prompt token of each sequence
+    g_prefill_order.clear();
+    for (auto &s : g_slots) {
+        if (s.state == SlotState::Prefill) g_prefill_order.push_back(&s);
+    }
+    std::sort(g_prefill_order.begin(), g_prefill_order.end(),
+              [](const LlmSlot *a, const LlmSlot *b) {
+                  return a->admitted_at < b->admitted_at;
+              });
+    for (LlmSlot *slot : g_prefill_order) {
+        if (g_batch.n_tokens >= g_batch_cap) break;
+        LlmSlot &s = *slot;
+        const auto &prompt = s.req->prompt;
+        size_t i = s.n_prompt_done;
+        while (i < prompt.size() && g_batch.n_tokens < g_batch_cap) {
+            bool last = i + 1 == prompt.size();
+            if (last) s.i_batch = g_batch.n_tokens;
+            batch_add(prompt[i], (llama_pos)i, s.id, last);
+            ++i;
+        }
+        s.n_in_batch = (int32_t)(i - s.n_prompt_done);
+    }
+
+    g_batch_reqs.clear();
+    for (const auto &s : g_slots) {
+        if (s.n_in_batch > 0) g_batch_reqs.push_back(s.req.get());
+    }
+}
+
+// llama abort callback: stop a decode only if every sequence in it is being
+// abandoned, so a live request never loses work to a cancelled one
+static bool abort_batch(void *) {
+    if (g_batch_reqs.empty()) return false;
+    const int64_t now = llm_clock_us();
+    for (const LlmRequest *req : g_batch_reqs) {
+        if (!abandon_reason(*req, now)) return false;
+    }
+    return true;
+}
+
+// Complete cancelled and expired requests, queued or running. Slot caches
+// hold only committed tokens between iterations, so they stay reusable.
+// Caller holds g_queue_mutex.
+static void reap_abandoned() {
+    const int64_t now = llm_clock_us();
+    for (auto it = g_queue.begin(); it != g_queue.end(); ) {
+        if (const char *reason = abandon_reason(**it, now)) {
+            complete_group(**it, reason);
+            it = g_queue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto &s : g_slots) {
+        if (s.state == SlotState::Idle) continue;
+        if (const char *reason = abandon_reason(*s.req, now)) {
+            LOGS("Slot %d: request %s", s.id, reason);
+            release_slot(s, reason);
+        }
+    }
+}
+
+// Draft tokens for every generating slot, within the context and the batch:
+// prompt lookup first for requests that ask for it, then the draft model.
+// Returns true if any slot has proposals to verify.
+static bool propose_drafts() {
+    const int n_draft = llm_spec_n_draft();
+    if (n_draft <= 0) return false;
+
+    int32_t n_decode = 0;
+    for (const auto &s : g_slots) {
+        if (s.state == SlotState::Decode) ++n_decode;
+    }
+    int32_t room = g_batch_cap - n_decode;
+
+    bool any = false;
+    for (auto &s : g_slots) {
+        // Proposals are not checked against a grammar
+        if (s.state != SlotState::Decode || llm_grammar_active(s.grammar)) continue;
+        const LlmRequest &req = *s.req;
+        // No point drafting past the token budget or the context
+        int n = std::min(n_draft, req.n_gen - req.n_generated - 1);
+        n = std::min<int>(n, (int)g_n_ctx - (int)s.cache_tokens.size() - 2);
+        n = std::min<int>(n, room);
+        if (n <= 0) continue;
+        int n_proposed = 0;
+        if (req.prompt_lookup) {
+            n_proposed = llm_spec_lookup(s.draft, s.cache_tokens, s.pending, n);
+        }
+        if (n_proposed == 0 && llm_spec_active()) {
+            n_proposed = llm_spec_propose(s.draft, s.id, s.cache_tokens, s.pending, n,
+                                          req.temp, req.top_p, req.top_k);
+        }
+        n = n_proposed;
+        room -= n;
+        any = any || n > 0;
+    }
+    return any;
+}
+
+// Record the tokens of a successfully decoded batch in the slot caches
+static void commit_batch() {
+    for (auto &s : g_slots) {
+        if (s.n_in_batch == 0) continue;
+        if (s.state == SlotState::Decode) {
+            // Draft tokens are recorded once verified, see sample_slots
+            s.cache_tokens.push_back(s.pending);
+        } else if (s.state == SlotState::Prefill) {
+            const auto &prompt = s.req->prompt;
+            s.cache_tokens.insert(s.cache_tokens.end(),
+                                  prompt.begin() + s.n_prompt_done,
+                                  prompt.begin() + s.n_prompt_done + s.n_in_batch);
+            s.n_prompt_done += s.n_in_batch;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Decode + sample
+// -----------------------------------------------------------------------------
+
+// Free the KV of one idle slot: a prefix pinned for the prompt cache first,
+// then plain prefix caches (including the stale ones of forks about to be
+// replaced), then the least recently used session (paged out if enabled)
+static bool evict_idle_cache() {
+    if (g_scratch_seq >= 0 && llm_pcache_drop_pinned(g_ctx, g_scratch_seq)) return true;
+    LlmSlot *victim = nullptr;
+    for (auto &s : g_slots) {
+        if (s.state != SlotState::Idle && s.state != SlotState::Forked) continue;
+        if (s.cache_tokens.empty()) continue;
+        if (!victim || (victim->session && !s.session) ||
+            (!victim->session == !s.session && s.last_used < victim->last_used)) {
+            victim = &s;
+        }
+    }
+    if (!victim) return false;
+    unbind_session(*victim);
+    clear_slot_cache(*victim);
+    return true;
+}
+
+// Append a sampled token to the request. Returns false if the slot was
+// released because the token ends generation or a limit was reached.
+static bool emit_token(LlmSlot &s, llama_token tok) {
+    LlmRequest &req = *s.req;
+    if (tok == LLAMA_TOKEN_NULL || llama_vocab_is_eog(g_vocab, tok)) {
+        req.stop_token = tok;
+        release_slot(s, nullptr);
+        return false;
+    }
+
+    const int64_t t_piece = llm_clock_us();
+    std::string piece = token_to_piece(tok);
+    const int64_t now = llm_clock_us();
+    llm_metrics_record(LlmHist::Detokenize, now - t_piece);
+    if (req.t_last_token_us == 0) {
+        int64_t unset = -1;
+        g_first_ttft_us.compare_exchange_strong(unset, now - req.t_submit_us);
+        llm_metrics_record(LlmHist::Ttft, now - req.t_submit_us);
+    } else {
+        llm_metrics_record(LlmHist::TokenLatency, now - req.t_last_token_us);
+    }
+    req.t_last_token_us = now;
+    llm_metrics_add(LlmCounter::GeneratedTokens);
+    {
+        std::lock_guard<std::mutex> lock(req.mutex);
+        req.text += piece;
+        req.tokens.push_back(tok);
+        req.n_generated++;
+    }
+    if (req.stream) req.cv.notify_all();
+
+    const bool context_full = s.cache_tokens.size() + 1 >= g_n_ctx;
+    if (req.n_generated >= req.n_gen ||
+        (context_full && (!g_can_shift || g_n_sink.load(std::memory_order_relaxed) < 0))) {
+        release_slot(s, nullptr);
+        return false;
+    }
+    return true;
+}
+
+// Keep the accepted drafts of a slot in the KV, roll back the rest and emit
+// the accepted tokens plus the one drawn by the target
+static void verify_drafts(LlmSlot &s) {
+    LlmRequest &req = *s.req;
+    const int64_t t_sample = llm_clock_us();
+    const int n_accepted = llm_spec_verify(s.sampler, s.draft, g_ctx, s.i_batch,
+                                           req.temp, req.top_p, req.top_k, g_spec_out);
+    if (req.logprobs) {
+        // Emitted token i was drawn at output row i_batch + i
+        for (size_t i = 0; i < g_spec_out.size(); ++i) {
+            req.sum_logprob += llm_sampler_logprob(
+                    s.sampler, llama_get_logits_ith(g_ctx, s.i_batch + (int32_t)i), g_spec_out[i]);
+        }
+    }
+    llm_metrics_record(LlmHist::Sample, llm_clock_us() - t_sample);
+
+    s.cache_tokens.insert(s.cache_tokens.end(), s.draft.tokens.begin(),
+                          s.draft.tokens.begin() + n_accepted);
+    if (n_accepted < (int)s.draft.tokens.size() &&
+        !llama_memory_seq_rm(llama_get_memory(g_ctx), s.id,
+                             (llama_pos)s.cache_tokens.size(), -1)) {
+        LOGS("Slot %d: cannot roll back rejected draft tokens", s.id);
+        clear_slot_cache(s);
+        release_slot(s, "speculative rollback failed");
+        return;
+    }
+    s.draft.tokens.clear();
+    {
+        std::lock_guard<std::mutex> lock(req.mutex);
+        req.n_spec_steps++;
+        req.n_spec_accepted += n_accepted;
+    }
+
+    for (llama_token tok : g_spec_out) {
+        if (!emit_token(s, tok)) return;
+    }
+    s.pending = g_spec_out.back();
+}
+
+// Persist the part of a just-prefilled prompt that is shared with an earlier
+// request (e.g. a system prompt), so it survives restarts and reloads. It is
+// only pinned here; the snapshot waits until no slot is decoding.
+static void store_shared_prefix(const LlmSlot &slot) {
+    if (g_scratch_seq < 0 || slot.cache_lora) return;
+    const auto &prompt = slot.req->prompt;
+    size_t n_shared = (size_t)slot.req->n_prompt_reused;
+    for (const auto &other : g_slots) {
+        if (&other == &slot) continue;
+        n_shared = std::max(n_shared, common_prefix_length(other.cache_tokens, prompt));
+    }
+    llm_pcache_store(g_ctx, slot.id, g_scratch_seq, slot.cache_tokens,
+                     std::min(n_shared, slot.cache_tokens.size()));
+}
+
+// The prompt of `leader` is in the KV: give every fork waiting on it a copy
+// of that sequence (llama_memory_seq_cp shares the cells, nothing is
+// recomputed) and let it sample its first token from the same logits row
+static void fork_slots(LlmSlot &leader) {
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    for (auto &f : g_slots) {
+        if (f.state != SlotState::Forked || f.fork_of != &leader) continue;
+        llama_memory_seq_rm(mem, f.id, -1, -1);
+        llama_memory_seq_cp(mem, leader.id, f.id, -1, -1);
+        f.cache_tokens  = leader.cache_tokens;
+        f.cache_lora    = leader.cache_lora;
+        f.n_prompt_done = leader.n_prompt_done;
+        f.n_shared      = leader.cache_tokens.size();
+        llm_spec_fork_seq(leader.draft, leader.id, f.draft, f.id);
+        f.state   = SlotState::Decode;
+        f.fork_of = nullptr;
+        f.i_batch = leader.i_batch;
+        leader.n_shared = leader.cache_tokens.size();
+
+        f.req->n_prompt_reused = (int32_t)f.cache_tokens.size();
+        llm_metrics_add(LlmCounter::PromptTokens, f.cache_tokens.size());
+        llm_metrics_add(LlmCounter::PromptTokensReused, f.cache_tokens.size());
+        LOGS("Slot %d: forked from slot %d at %zu tokens", f.id, leader.id, f.cache_tokens.size());
+    }
+}
+
+static void sample_slots() {
+    // Prompts finished by this batch, before any sampling so that forks
+    // sample from the logits of the same iteration
+    for (auto &s : g_slots) {
+        if (s.i_batch < 0 || s.state != SlotState::Prefill) continue;
+        s.state = SlotState::Decode;
+        llm_metrics_record(LlmHist::Prefill, llm_clock_us() - s.req->t_admit_us);
+        store_shared_prefix(s);
+        fork_slots(s);
+    }
+
+    for (auto &s : g_slots) {
+        if (s.i_batch < 0) continue;
+        LlmRequest &req = *s.req;
+
+        if (req.n_generated >= req.n_gen) {
+            release_slot(s, nullptr);
+            continue;
+        }
+        if (!s.draft.tokens.empty()) {
+            verify_drafts(s);
+            continue;
+        }
+
+        const int64_t t_sample = llm_clock_us();
+        const float *logits = llama_get_logits_ith(g_ctx, s.i_batch);
+        llama_token tok = llm_grammar_sample(s.grammar, s.sampler, logits, req.temp,
+                                             req.top_p, req.top_k);
+        if (llm_grammar_active(s.grammar)) {
+            if (!llama_vocab_is_eog(g_vocab, tok)) llm_grammar_accept(s.grammar, tok);
+            llm_metrics_record(LlmHist::Grammar, s.grammar.last_us);
+        }
+        if (req.logprobs) req.sum_logprob += llm_sampler_logprob(s.sampler, logits, tok);
+        llm_metrics_record(LlmHist::Sample, llm_clock_us() - t_sample);
+        if (emit_token(s, tok)) {
+            s.pending = tok;
+        }
+    }
+}
+
+// Slide the window of a slot whose next token would not fit: keep the first
+// n_sink tokens, drop half of the rest and move the remainder down, so
+// generation continues without a re-prefill. Cells shared with another seq
+// are never moved: the discarded span grows to cover them.
+static bool shift_slot(LlmSlot &s) {
+    const int32_t n_past = (int32_t)s.cache_tokens.size();
+    const int32_t n_keep = std::min(g_n_sink.load(std::memory_order_relaxed), n_past);
+    const int32_t n_discard = std::max((n_past - n_keep) / 2, (int32_t)s.n_shared - n_keep);
+    if (n_keep < 0 || n_discard <= 0 || n_keep + n_discard >= n_past) return false;
+
+    llama_memory_t mem = llama_get_memory(g_ctx);
+    if (!llama_memory_seq_rm(mem, s.id, n_keep, n_keep + n_discard)) return false;
+    llama_memory_seq_add(mem, s.id, n_keep + n_discard, -1, -n_discard);
+    s.cache_tokens.erase(s.cache_tokens.begin() + n_keep,
+                         s.cache_tokens.begin() + n_keep + n_discard);
+    s.n_shared = std::min(s.n_shared, (size_t)n_keep);
+    llm_spec_shift_seq(s.draft, s.id, n_keep, n_discard);
+    {
+        std::lock_guard<std::mutex> lock(s.req->mutex);
+        s.req->shifts.emplace_back(n_keep, n_discard);
+    }
+    llm_metrics_add(LlmCounter::ContextShifts);
+    LOGS("Slot %d: context shift, kept %d sink tokens, discarded %d",
+         s.id, n_keep, n_discard);
+    return true;
+}
+
+static void step() {
+    for (auto &s : g_slots) {
+        if (s.state != SlotState::Decode || s.cache_tokens.size() + 1 < g_n_ctx) continue;
+        if (!shift_slot(s)) release_slot(s, "context full");
+    }
+
+    const bool speculating = propose_drafts();
+    build_batch();
+    if (g_batch.n_tokens == 0) return;
+
+    const auto t_start = std::chrono::steady_clock::now();
+    int32_t ret = llama_decode(g_ctx, g_batch);
+    while (ret == 1) {
+        // No room in the KV cache: drop idle caches one at a time, least
+        // valuable first, then give up on the active slot holding the most cells.
+        if (!evict_idle_cache()) {
+            LlmSlot *victim = nullptr;
+            for (auto &s : g_slots) {
+                if (s.state == SlotState::Idle) continue;
+                if (!victim || s.cache_tokens.size() > victim->cache_tokens.size()) {
+                    victim = &s;
+                }
+            }
+            if (!victim) return;
+            LOGS("Slot %d: KV cache full, dropping request", victim->id);
+            clear_slot_cache(*victim);
+            release_slot(*victim, "context full");
+            build_batch();
+            if (g_batch.n_tokens == 0) return;
+        }
+        ret = llama_decode(g_ctx, g_batch);
+    }
+
+    if (ret == 2) {
+        // Aborted because every request in the batch was abandoned. Drop
+        // whatever the aborted decode left beyond the committed tokens.
+        llama_memory_t mem = llama_get_memory(g_ctx);
+        const int64_t now = llm_clock_us();
+        for (auto &s : g_slots) {
+            if (s.n_in_batch == 0) continue;
+            if (!llama_memory_seq_rm(mem, s.id, (llama_pos)s.cache_tokens.size(), -1)) {
+                clear_slot_cache(s);
+            }
+            const char *reason = abandon_reason(*s.req, now);
+            release_slot(s, reason ? reason : "cancelled");
+        }
+        return;
+    }
+
+    if (ret != 0) {
+        // Partially processed ubatches may remain in memory, so the KV state
+        // of every sequence in this batch is unknown.
+        LOGS("llama_decode failed (%d), failing %d tokens", ret, g_batch.n_tokens);
+        for (auto &s : g_slots) {
+            if (s.n_in_batch == 0) continue;
+            clear_slot_cache(s);
+            release_slot(s, "decode failed");
+        }
+        return;
+    }
+
+    const int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - t_start).count();
+    llm_metrics_record(LlmHist::Decode, us);
+    llm_lora_record_decode(us);
+    if (speculating) {
+        llm_spec_record_target_us(us);
+    }
+    // Attribute the prefill share of this iteration by token count
+    int32_t n_prefill = 0;
+    for (const auto &s : g_slots) {
+        if (s.state == SlotState::Prefill) n_prefill += s.n_in_batch;
+    }
+    if (n_prefill > 0) {
+        llm_pcache_record_prefill(n_prefill, us * n_prefill / g_batch.n_tokens);
+    }
+    commit_batch();
+    sample_slots();
+}
+
+// -----------------------------------------------------------------------------
+// Thread
+// -----------------------------------------------------------------------------
+
+static void scheduler_loop() {
+    LOGS("Scheduler thread started with %zu slots", g_slots.size());
+    while (true) {
+        // Prompt cache snapshots copy the whole prefix; take them while idle
+        if (g_scratch_seq >= 0 && !any_active()) llm_pcache_flush(g_ctx, g_scratch_seq);
+        {
+            std::unique_lock<std::mutex> lock(g_queue_mutex);
+            g_parked = true;
+            g_parked_cv.notify_all();
+            g_queue_cv.wait(lock, [] {
+                return !g_running || (!g_paused && (g_clear_cache || g_new_threads > 0 ||
+                                                    !g_queue.empty() || any_active()));
+            });
+            g_parked = false;
+            if (!g_running) break;
+
+            if (g_new_threads > 0) {
+                llama_set_n_threads(g_ctx, g_new_threads, g_new_threads_batch);
+                llm_spec_set_threads(g_new_threads, g_new_threads_batch);
+                LOGS("Threads set to %d/%d", g_new_threads, g_new_threads_batch);
+                g_new_threads = 0;
+            }
+            if (g_clear_cache) {
+                if (g_scratch_seq >= 0) llm_pcache_drop_pinned(g_ctx, g_scratch_seq);
+                for (auto &s : g_slots) {
+                    if (s.state != SlotState::Idle) continue;
+                    s.session = 0;   // sessions re-prefill from their history
+                    clear_slot_cache(s);
+                }
+                g_clear_cache = false;
+            }
+            reap_abandoned();
+            for (auto &s : g_slots) {
+                if (s.session && !llm_session_exists(s.session)) s.session = 0;
+            }
+            while (!g_queue.empty()) {
+                const auto &req = g_queue.front();
+                if (req->lora != g_lora) {
+                    // One adapter per batch: drain, then switch
+                    if (any_active()) break;
+                    llm_lora_apply(g_ctx, req->lora.get());
+                    g_lora = req->lora;
+                }
+                if (n_idle_slots() < 1 + req->forks.size()) break;
+                LlmSlot *slot = pick_slot(*req);
+                if (!slot) break;
+                admit(*slot, req);
+                for (const auto &fork : req->forks) admit_fork(*pick_fork_slot(), *slot, fork);
+                g_queue.pop_front();
+            }
+        }
+        step();
+    }
+    LOGS("Scheduler thread exiting");
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+bool llm_scheduler_start(llama_context *ctx, const llama_context_params &cparams, int n_slots,
+                         llama_context *draft_ctx) {
+    if (!ctx || n_slots <= 0 || g_thread.joinable()) return false;
+
+    g_ctx   = ctx;
+    g_vocab = llama_model_get_vocab(llama_get_model(ctx));
+    g_n_ctx = llama_n_ctx(ctx);
+
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    if (draft_ctx) llm_spec_attach(ctx, draft_ctx);
+    llm_pcache_attach(ctx, cparams);
+    g_scratch_seq = (int)llama_n_seq_max(ctx) > n_slots ? n_slots : -1;
+    g_can_shift   = llama_memory_can_shift(llama_get_memory(ctx));
+    llama_clear_adapter_lora(ctx);
+    g_lora.reset();
+
+    std::random_device rd;
+    g_slots.assign(n_slots, LlmSlot{});
+    for (int i = 0; i < n_slots; ++i) {
+        g_slots[i].id = i;
+        llm_sampler_init(g_slots[i].sampler, n_vocab, rd());
+        llm_spec_init_slot(g_slots[i].draft, rd(), g_n_ctx);
+    }
+
+    g_batch_cap = (int32_t)std::min(llama_n_batch(ctx), llama_n_ubatch(ctx));
+    g_batch = llama_batch_init(g_batch_cap, 0, 1);
+    g_prefill_order.reserve(n_slots);
+    g_batch_reqs.reserve(n_slots);
+    llama_set_abort_callback(ctx, abort_batch, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_running = true;
+        g_paused  = false;
+        g_clear_cache = false;
+        g_new_threads = 0;
+    }
+    g_first_ttft_us = -1;
+    g_thread = std::thread(scheduler_loop);
+    return true;
+}
+
+void llm_scheduler_stop() {
+    if (!g_thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_running = false;
+    }
+    g_queue_cv.notify_all();
+    g_thread.join();
+
+    // The thread is gone, so slots and queue can be touched from here
+    for (auto &s : g_slots) {
+        if (s.req) release_slot(s, "model unloaded");
+    }
+    for (auto &req : g_queue) {
+        complete_group(*req, "model unloaded");
+    }
+    g_queue.clear();
+    g_slots.clear();
+    g_lora.reset();
+    llm_session_forget_tokens();
+    llm_spec_detach();
+    llm_pcache_detach();
+
+    llama_set_abort_callback(g_ctx, nullptr, nullptr);
+    g_batch_reqs.clear();
+    llama_batch_free(g_batch);
+    g_batch = llama_batch{};
+    g_batch_cap = 0;
+    g_ctx   = nullptr;
+    g_vocab = nullptr;
+}
+
+bool llm_scheduler_submit(const std::shared_ptr<LlmRequest> &req) {
+    req->t_submit_us = llm_clock_us();
+    if (req->prompt.empty()) {
+        complete_group(*req, "empty prompt tokens");
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        if (!g_running) {
+            complete_group(*req, "model not loaded");
+            return false;
+        }
+        if (1 + req->forks.size() > g_slots.size()) {
+            complete_group(*req, "n exceeds the number of parallel slots");
+            return false;
+        }
+        if (!req->grammar.empty()) {
+            LlmGrammar check;
+            std::string error;
+            const bool ok = llm_grammar_init(check, g_vocab, req->grammar, error);
+            llm_grammar_free(check);
+            if (!ok) {
+                complete_group(*req, error.c_str());
+                return false;
+            }
+        }
+        const int n_sink = g_n_sink.load(std::memory_order_relaxed);
+        if (req->prompt.size() >= g_n_ctx && n_sink >= 0) {
+            // Keep the sink tokens and the most recent part, leaving room
+            // for up to a quarter of the context of output
+            const size_t n_room = (size_t)std::max(1, std::min(req->n_gen, (int)g_n_ctx / 4));
+            const size_t n_keep = std::min((size_t)n_sink, g_n_ctx - n_room - 1);
+            const size_t n_cut  = req->prompt.size() - (g_n_ctx - n_room);
+            req->prompt.erase(req->prompt.begin() + n_keep,
+                              req->prompt.begin() + n_keep + n_cut);
+            llm_metrics_add(LlmCounter::PromptsTruncated);
+            LOGS("Prompt truncated: dropped %zu tokens after the first %zu", n_cut, n_keep);
+        }
+        if (req->prompt.size() >= g_n_ctx) {
+            complete_group(*req, "prompt exceeds context size");
+            return false;
+        }
+        if (req->n_budget > 0 && req->prompt.size() >= (size_t)req->n_budget) {
+            complete_group(*req, "prompt exceeds token budget");
+            return false;
+        }
+        for (const auto &fork : req->forks) {
+            fork->prompt      = req->prompt;
+            fork->t_submit_us = req->t_submit_us;
+        }
+        auto clamp_budget = [](LlmRequest &r) {
+            if (r.n_budget > 0) r.n_gen = std::min(r.n_gen, r.n_budget - (int)r.prompt.size());
+        };
+        clamp_budget(*req);
+        for (const auto &fork : req->forks) clamp_budget(*fork);
+        if (req->id) {
+            // Ids are chosen by clients; a second live request with the same id
+            // would take over the first one's cancel handle
+            bool duplicate;
+            {
+                std::lock_guard<std::mutex> live_lock(g_live_mutex);
+                auto &live = g_live[req->id];
+                duplicate = !live.expired();
+                if (!duplicate) live = req;
+            }
+            if (duplicate) {
+                complete_group(*req, "duplicate request id");
+                return false;
+            }
+        }
+        g_queue.push_back(req);
+    }
+    g_queue_cv.notify_one();
+    return true;
+}
+
+void llm_request_wait(LlmRequest &req) {
+    std::unique_lock<std::mutex> lock(req.mutex);
+    req.cv.wait(lock, [&req] { return req.done; });
+}
+
+void llm_request_cancel(LlmRequest &req) {
+    req.cancelled = true;
+    for (const auto &fork : req.forks) fork->cancelled = true;
+    // Wake the scheduler so that a queued request is dropped promptly
+    g_queue_cv.notify_one();
+}
+
+bool llm_scheduler_cancel(uint64_t id) {
+    std::shared_ptr<LlmRequest> req;
+    {
+        std::lock_guard<std::mutex> lock(g_live_mutex);
+        auto it = g_live.find(id);
+        if (it != g_live.end()) req = it->second.lock();
+    }
+    if (!req) return false;
+    llm_request_cancel(*req);
+    return true;
+}
+
+void llm_scheduler_set_context_shift(int n_sink) {
+    g_n_sink.store(n_sink < 0 ? -1 : n_sink);
+}
+
+int64_t llm_scheduler_first_ttft_us() {
+    return g_first_ttft_us.load();
+}
+
+int64_t llm_clock_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void llm_scheduler_clear_cache() {
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_clear_cache = true;
+    }
+    g_queue_cv.notify_one();
+}
+
+void llm_scheduler_pause() {
+    std::unique_lock<std::mutex> lock(g_queue_mutex);
+    g_paused = true;
+    g_parked_cv.wait(lock, [] { return g_parked || !g_running; });
+}
+
+void llm_scheduler_resume() {
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_paused = false;
+    }
+    g_queue_cv.notify_one();
+}
+
+void llm_scheduler_set_threads(int n_threads, int n_threads_batch) {
+    if (n_threads <= 0) return;
+    {
+        std::lock_guard<std::mutex> lock(g_queue_mutex);
+        g_new_threads = n_threads;
+        g_new_threads_batch = n_threads_batch > 0 ? n_threads_batch : n_threads;
+    }
+    g_queue_cv.notify_one();
+}
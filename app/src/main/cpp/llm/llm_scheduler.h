@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+#include "llm_lora.h"
+
+// ============================================================================
+// Generation request
+// ============================================================================
+//
+// The caller fills in the inputs, submits the request and waits for `done`.
+// Everything below `mutex` is written by the scheduler thread and must be
+// read under that mutex. A cancelled, expired or over-budget request stops
+// at the next iteration, or mid-decode through the abort callback when every
+// sequence in the batch is being abandoned.
+// ============================================================================
+
+struct LlmRequest {
+    std::vector<llama_token> prompt;   // templated + tokenized, incl. BOS
+    int   n_gen = 64;
+    float temp  = 0.7f;
+    float top_p = 0.9f;
+    int   top_k = 40;
+    bool  stream = false;              // notify `cv` after every sampled piece
+    bool  prompt_lookup = false;       // speculate from n-gram matches in the context
+    int64_t session = 0;               // chat session of this turn, 0 = none
+    uint64_t id = 0;                   // caller-chosen handle for llm_scheduler_cancel, 0 = none
+    int64_t deadline_us = 0;           // llm_clock_us() deadline, 0 = none
+    int32_t n_budget = 0;              // max prompt + generated tokens, 0 = none
+    bool  logprobs = false;            // accumulate sum_logprob
+    std::string grammar;               // GBNF the output must match (llm_grammar.h), empty = none;
+                                       // such requests do not speculate
+    std::shared_ptr<LlmLora> lora;     // adapter to decode with, nullptr = the base model
+    std::atomic<bool> cancelled{false};
+    // Further completions of the same prompt (n > 1). The prompt is
+    // prefilled once, on this request's slot; each fork then gets a copy of
+    // that KV on a slot of its own and decodes alongside it, with its own RNG
+    // stream. Forks keep their own sampling settings and limits, inherit the
+    // (possibly truncated) prompt and are cancelled with this request.
+    std::vector<std::shared_ptr<LlmRequest>> forks;
+    // Called once `done` is set (on the scheduler thread, or the submitting
+    // one if submit fails), for callers waiting on many requests at once
+    std::function<void()> on_done;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool        done = false;
+    std::string text;
+    std::vector<llama_token> tokens;   // generated tokens, as appended to `text`
+    llama_token stop_token = LLAMA_TOKEN_NULL;   // end-of-generation token, if one was sampled
+    std::string error;                 // empty on success
+    int32_t     n_prompt_reused = 0;   // prompt tokens served from the KV cache
+    int32_t     n_generated     = 0;
+    int32_t     n_spec_steps    = 0;   // verify steps that carried proposals
+    int32_t     n_spec_accepted = 0;   // proposals accepted over those steps
+    double      sum_logprob     = 0.0; // of the sampled tokens incl. the stop token (temp 1)
+    // Context shifts, in order: (n_keep, n_discard) spans dropped from
+    // prompt + tokens to keep generating past the end of the context
+    std::vector<std::pair<int32_t, int32_t>> shifts;
+
+    // llm_clock_us() timestamps for the metrics, scheduler side
+    int64_t t_submit_us = 0;
+    int64_t t_admit_us  = 0;
+    int64_t t_last_token_us = 0;       // 0 until the first token
+};
+
+// ============================================================================
+// Scheduler API
+// ============================================================================
+//
+// A single thread owns the llama_context. Every request is bound to a slot
+// (one sequence id each); every iteration decodes one llama_batch that mixes
+// one token for each generating slot with prompt chunks of slots that are
+// still prefilling. Idle slots keep their KV so that a new request can be
+// placed on the slot with the longest matching prompt prefix.
+//
+// All sequences of a batch share the context's LoRA adapter, so requests
+// run with the adapter currently applied; one that needs another adapter
+// waits at the head of the queue until the active slots have drained, then
+// the adapter is switched. Cached prefixes only match within one adapter.
+// ============================================================================
+
+// Start the scheduler thread. It takes exclusive use of ctx (and draft_ctx)
+// until stopped; both must have been created with n_seq_max >= n_slots. With
+// a compatible draft context, generating slots decode speculatively. One
+// extra sequence (n_seq_max > n_slots) enables prompt cache snapshots.
+// cparams are those ctx was created with.
+bool llm_scheduler_start(llama_context *ctx, const llama_context_params &cparams, int n_slots,
+                         llama_context *draft_ctx = nullptr);
+
+// Stop the thread. Queued and in-flight requests complete with an error.
+void llm_scheduler_stop();
+
+// Queue a request. Returns false (and completes the request with an error)
+// if the scheduler is not running, the prompt cannot fit the context or
+// another live request has the same id. A request with forks needs that many
+// free slots at once and fails if there are fewer slots in total.
+bool llm_scheduler_submit(const std::shared_ptr<LlmRequest> &req);
+
+// Block until the scheduler has completed the request
+void llm_request_wait(LlmRequest &req);
+
+// Abandon a request and its forks; they complete with the error "cancelled"
+void llm_request_cancel(LlmRequest &req);
+
+// Cancel the queued or running request with this id. Returns false if no
+// such request is live.
+bool llm_scheduler_cancel(uint64_t id);
+
+// Monotonic clock used for deadlines
+int64_t llm_clock_us();
+
+// Sliding-window mode for sequences that reach the end of the context: keep
+// the first n_sink tokens, drop the older half of the rest and shift the
+// remainder down (when the memory supports shifting), and cut over-long
+// prompts the same way at submit. n_sink < 0 disables both; requests then
+// stop at the end of the context and over-long prompts are rejected.
+void llm_scheduler_set_context_shift(int n_sink);
+
+// TTFT of the first request served since llm_scheduler_start, -1 until then
+int64_t llm_scheduler_first_ttft_us();
+
+// Drop the cached KV of every idle slot before the next iteration
+void llm_scheduler_clear_cache();
+
+// Change the thread counts of the live context before the next iteration
+void llm_scheduler_set_threads(int n_threads, int n_threads_batch);
+
+// Hold the scheduler thread between iterations, e.g. so a benchmark has the
+// CPU to itself; requests in flight and new ones wait meanwhile. Returns
+// once the thread has finished its current iteration.
+void llm_scheduler_pause();
+void llm_scheduler_resume();
@@ -0,0 +1,255 @@
+#include "llm_session.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <android/log.h>
+
+#define LOGSS(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_SESSION", __VA_ARGS__)
+
+// -----------------------------------------------------------------------------
+// Store
+// -----------------------------------------------------------------------------
+
+struct LlmSession {
+    std::vector<llama_token> history;   // every prompt and reply so far
+    std::vector<LlmChatMessage> messages;   // the same, as chat messages
+    LlmChatMessage pending;             // message of the turn in flight
+    bool     busy = false;              // a turn is in flight
+    uint64_t last_used = 0;
+
+    // Paged-out sequence state and the tokens it holds
+    std::vector<uint8_t>     paged_state;
+    std::vector<llama_token> paged_tokens;
+};
+
+// Everything below is guarded by g_mutex
+static std::mutex g_mutex;
+static std::unordered_map<int64_t, LlmSession> g_sessions;
+static int64_t  g_next_id = 1;
+static uint64_t g_tick = 0;
+static size_t   g_page_budget = 0;
+static size_t   g_paged_bytes = 0;
+
+static std::atomic<uint64_t> g_n_page_outs{0};
+static std::atomic<uint64_t> g_n_page_ins{0};
+static std::atomic<uint64_t> g_n_page_drops{0};
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Caller holds g_mutex
+static void drop_paged(LlmSession &s) {
+    g_paged_bytes -= s.paged_state.size();
+    s.paged_state.clear();
+    s.paged_state.shrink_to_fit();
+    s.paged_tokens.clear();
+}
+
+// Caller holds g_mutex. Drop the oldest snapshots until `incoming` more
+// bytes fit the budget.
+static void make_room(size_t incoming) {
+    while (g_paged_bytes + incoming > g_page_budget) {
+        LlmSession *lru = nullptr;
+        for (auto &kv : g_sessions) {
+            LlmSession &s = kv.second;
+            if (s.paged_state.empty()) continue;
+            if (!lru || s.last_used < lru->last_used) lru = &s;
+        }
+        if (!lru) return;
+        drop_paged(*lru);
+        g_n_page_drops++;
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Public API
+// -----------------------------------------------------------------------------
+
+int64_t llm_session_create() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    int64_t id = g_next_id++;
+    g_sessions[id].last_used = ++g_tick;
+    LOGSS("Session %lld created", (long long)id);
+    return id;
+}
+
+bool llm_session_close(int64_t id) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_sessions.find(id);
+    if (it == g_sessions.end()) return false;
+    drop_paged(it->second);
+    g_sessions.erase(it);
+    LOGSS("Session %lld closed", (long long)id);
+    return true;
+}
+
+bool llm_session_exists(int64_t id) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return g_sessions.count(id) != 0;
+}
+
+bool llm_session_messages(int64_t id, std::vector<LlmChatMessage> &out, bool &rebuild) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_sessions.find(id);
+    if (it == g_sessions.end()) return false;
+    out = it->second.messages;
+    rebuild = it->second.history.empty() && !out.empty();
+    return true;
+}
+
+bool llm_session_begin(int64_t id, llama_token bos, const LlmChatMessage &message,
+                       size_t n_past, bool rebuild, const std::vector<llama_token> &turn,
+                       LlmRequest &req, std::string &error) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_sessions.find(id);
+    if (it == g_sessions.end()) {
+        error = "unknown session";
+        return false;
+    }
+    LlmSession &s = it->second;
+    if (s.busy || s.messages.size() != n_past) {
+        error = "session busy";
+        return false;
+    }
+    s.busy = true;
+    s.last_used = ++g_tick;
+    s.pending = message;
+    if (rebuild) s.history.clear();
+
+    req.session = id;
+    req.prompt.clear();
+    req.prompt.reserve(s.history.size() + turn.size() + 1);
+    // Templates that write the BOS text themselves (e.g. llama-2's "<s>[INST]")
+    // already start the turn with it
+    if (s.history.empty() && bos != LLAMA_TOKEN_NULL && (turn.empty() || turn[0] != bos)) {
+        req.prompt.push_back(bos);
+    }
+    req.prompt.insert(req.prompt.end(), s.history.begin(), s.history.end());
+    req.prompt.insert(req.prompt.end(), turn.begin(), turn.end());
+    return true;
+}
+
+void llm_session_finish(const LlmRequest &req, bool ok) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_sessions.find(req.session);
+    if (it == g_sessions.end()) return;
+    LlmSession &s = it->second;
+    s.busy = false;
+    s.last_used = ++g_tick;
+    if (!ok) return;
+
+    s.history = req.prompt;
+    s.history.insert(s.history.end(), req.tokens.begin(), req.tokens.end());
+    if (req.stop_token != LLAMA_TOKEN_NULL) {
+        s.history.push_back(req.stop_token);
+    }
+    s.messages.push_back(std::move(s.pending));
+    s.messages.push_back({"assistant", req.text});
+    // Drop what context shifts dropped from the KV, so the next turn's
+    // prompt still matches the slot's cache
+    for (const auto &shift : req.shifts) {
+        const size_t from = std::min((size_t)shift.first, s.history.size());
+        const size_t to   = std::min(from + shift.second, s.history.size());
+        s.history.erase(s.history.begin() + from, s.history.begin() + to);
+    }
+}
+
+bool llm_session_page_out(int64_t id, llama_context *ctx, llama_seq_id seq,
+                          const std::vector<llama_token> &cache_tokens) {
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        auto it = g_sessions.find(id);
+        if (g_page_budget == 0 || it == g_sessions.end() || cache_tokens.empty()) {
+            return false;
+        }
+    }
+
+    // Copy outside the lock; the session may be closed meanwhile
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq));
+    size_t n = llama_state_seq_get_data(ctx, state.data(), state.size(), seq);
+    if (n == 0) return false;
+    state.resize(n);
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_sessions.find(id);
+    if (it == g_sessions.end() || n > g_page_budget) return false;
+    drop_paged(it->second);
+    make_room(n);
+    it->second.paged_state  = std::move(state);
+    it->second.paged_tokens = cache_tokens;
+    g_paged_bytes += n;
+    g_n_page_outs++;
+    LOGSS("Session %lld paged out: %zu tokens, %zu bytes",
+          (long long)id, cache_tokens.size(), n);
+    return true;
+}
+
+size_t llm_session_page_in(int64_t id, llama_context *ctx, llama_seq_id seq,
+                           std::vector<llama_token> &cache_tokens) {
+    std::vector<uint8_t> state;
+    std::vector<llama_token> tokens;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        auto it = g_sessions.find(id);
+        if (it == g_sessions.end() || it->second.paged_state.empty()) return 0;
+        // The snapshot is consumed: once resident, the slot holds the state
+        g_paged_bytes -= it->second.paged_state.size();
+        state.swap(it->second.paged_state);
+        tokens.swap(it->second.paged_tokens);
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_memory_seq_rm(mem, seq, -1, -1);
+    cache_tokens.clear();
+    if (llama_state_seq_set_data(ctx, state.data(), state.size(), seq) == 0) {
+        LOGSS("Session %lld: page-in failed, prefilling instead", (long long)id);
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        return 0;
+    }
+    cache_tokens = std::move(tokens);
+    g_n_page_ins++;
+    LOGSS("Session %lld paged in: %zu tokens", (long long)id, cache_tokens.size());
+    return cache_tokens.size();
+}
+
+void llm_session_set_paging(size_t budget_bytes) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_page_budget = budget_bytes;
+    make_room(0);
+}
+
+void llm_session_forget_tokens() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    for (auto &kv : g_sessions) {
+        kv.second.history.clear();
+        kv.second.history.shrink_to_fit();
+        drop_paged(kv.second);
+    }
+    LOGSS("Token history of %zu sessions dropped", g_sessions.size());
+}
+
+std::string llm_session_stats_json() {
+    size_t n_sessions, n_paged = 0, bytes, budget;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        n_sessions = g_sessions.size();
+        for (const auto &kv : g_sessions) {
+            if (!kv.second.paged_state.empty()) ++n_paged;
+        }
+        bytes  = g_paged_bytes;
+        budget = g_page_budget;
+    }
+    char buf[320];
+    snprintf(buf, sizeof(buf),
+             "{\"sessions\":%zu,\"paged\":%zu,\"paged_bytes\":%zu,\"page_budget\":%zu,"
+             "\"page_outs\":%llu,\"page_ins\":%llu,\"page_drops\":%llu}",
+             n_sessions, n_paged, bytes, budget,
+             (unsigned long long)g_n_page_outs.load(),
+             (unsigned long long)g_n_page_ins.load(),
+             (unsigned long long)g_n_page_drops.load());
+    return buf;
+}
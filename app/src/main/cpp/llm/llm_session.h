@@ -0,0 +1,76 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+#include "llm_chat.h"
+#include "llm_scheduler.h"
+
+// ============================================================================
+// Chat sessions
+// ============================================================================
+//
+// A session is a conversation whose token history (every prompt and reply so
+// far) stays in the KV cache between turns. The scheduler binds a session to
+// a slot, i.e. a sequence id, on its first turn and keeps it there while the
+// slot is idle, so the next turn only prefills the new message. When slots or
+// KV cells run short, the least recently used idle session is evicted; with
+// paging enabled its sequence state is first copied out with
+// llama_state_seq_get_data and is paged back in on its next turn instead of
+// being prefilled again.
+//
+// The history is owned here, as tokens and as chat messages (from which the
+// next turn is rendered, see llm_chat_render_delta), and updated by the
+// scheduler when a turn completes; one turn per session may be in flight at
+// a time.
+// ============================================================================
+
+// Returns a new session id (> 0)
+int64_t llm_session_create();
+
+// Forget a session. Its slot keeps the KV as an ordinary prefix cache.
+bool llm_session_close(int64_t id);
+bool llm_session_exists(int64_t id);
+
+// Messages of the turns so far. `rebuild` is set when their tokens are gone
+// (see llm_session_forget_tokens): the next turn is then the whole
+// conversation rendered again, not a delta. False if the session is unknown.
+bool llm_session_messages(int64_t id, std::vector<LlmChatMessage> &out, bool &rebuild);
+
+// Start a turn: prompt = history + `turn`, the tokens of `message` rendered
+// after the first n_past messages, with `bos` (unless NULL, or already the
+// first token of `turn`) in front on the first turn. With `rebuild`, `turn`
+// is the whole conversation rendered again and replaces the history. Fails
+// if the session is unknown, already has a turn in flight or has moved past
+// n_past messages.
+bool llm_session_begin(int64_t id, llama_token bos, const LlmChatMessage &message,
+                       size_t n_past, bool rebuild, const std::vector<llama_token> &turn,
+                       LlmRequest &req, std::string &error);
+
+// Scheduler side: record a finished turn (prompt, generated tokens and the
+// end-of-generation token, minus spans dropped by context shifts) as the new
+// history, and the message and reply. Failed turns are dropped.
+void llm_session_finish(const LlmRequest &req, bool ok);
+
+// Copy the sequence state out before its slot is reused. No-op when paging
+// is disabled. Returns true if a snapshot was kept.
+bool llm_session_page_out(int64_t id, llama_context *ctx, llama_seq_id seq,
+                          const std::vector<llama_token> &cache_tokens);
+
+// Restore a paged-out session into `seq`. Returns the number of tokens in
+// place (cache_tokens mirrors the sequence), 0 if there was no snapshot.
+size_t llm_session_page_in(int64_t id, llama_context *ctx, llama_seq_id seq,
+                           std::vector<llama_token> &cache_tokens);
+
+// Memory budget for paged-out snapshots; 0 disables paging
+void llm_session_set_paging(size_t budget_bytes);
+
+// Drop the token history and paged state of every session, keeping their
+// messages, when the model goes away (swap or unload): the KV and the token
+// ids are of the old model, the conversation is not
+void llm_session_forget_tokens();
+
+// Sessions, paged snapshots and their bytes, page-in/out counts
+std::string llm_session_stats_json();
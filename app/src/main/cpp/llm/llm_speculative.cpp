@@ -0,0 +1,451 @@
+#include "llm_speculative.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <android/log.h>
+
+#define LOGSP(...) __android_log_print(ANDROID_LOG_DEBUG, "LLM_SPEC", __VA_ARGS__)
+
+// Proposals are drawn from at most this many draft candidates. Any proposal
+// distribution keeps the output exact; a small one keeps q cheap to store.
+#define LLM_SPEC_DRAFT_TOP_K 32
+#define LLM_SPEC_MAX_DRAFT   16
+#define LLM_SPEC_DEFAULT_N_DRAFT 4
+
+// Prompt lookup tries the longest n-gram first
+#define LLM_LOOKUP_NGRAM_MIN 2
+#define LLM_LOOKUP_NGRAM_MAX 4
+
+// -----------------------------------------------------------------------------
+// Globals
+// -----------------------------------------------------------------------------
+
+static llama_context     *g_draft_ctx   = nullptr;
+static const llama_vocab *g_draft_vocab = nullptr;
+static int32_t            g_target_n_vocab = 0;
+static uint32_t           g_draft_n_ctx = 0;
+static llama_batch        g_draft_batch{};
+static int32_t            g_draft_batch_cap = 0;
+
+static std::atomic<int> g_n_draft{LLM_SPEC_DEFAULT_N_DRAFT};
+
+struct SpecCounters {
+    std::atomic<uint64_t> steps{0};      // verified slot-steps
+    std::atomic<uint64_t> drafted{0};
+    std::atomic<uint64_t> accepted{0};
+};
+static SpecCounters g_model_stats;
+static SpecCounters g_lookup_stats;
+static std::atomic<uint64_t> g_draft_us{0};
+static std::atomic<uint64_t> g_target_us{0};
+static std::atomic<uint64_t> g_n_target_iters{0};
+
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+static bool vocab_compatible(const llama_vocab *a, const llama_vocab *b) {
+    if (llama_vocab_type(a) != llama_vocab_type(b)) return false;
+    if (llama_vocab_bos(a) != llama_vocab_bos(b)) return false;
+    if (llama_vocab_eos(a) != llama_vocab_eos(b)) return false;
+
+    const int32_t n_a = llama_vocab_n_tokens(a);
+    const int32_t n_b = llama_vocab_n_tokens(b);
+    if (std::abs(n_a - n_b) > 128) return false;
+
+    // Ids 0-4 are often model-specific control tokens
+    for (int32_t i = 5; i < std::min(n_a, n_b); ++i) {
+        if (std::strcmp(llama_vocab_get_text(a, i), llama_vocab_get_text(b, i)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void draft_batch_add(llama_token token, llama_pos pos, llama_seq_id seq, bool logits) {
+    int32_t i = g_draft_batch.n_tokens++;
+    g_draft_batch.token[i]     = token;
+    g_draft_batch.pos[i]       = pos;
+    g_draft_batch.n_seq_id[i]  = 1;
+    g_draft_batch.seq_id[i][0] = seq;
+    g_draft_batch.logits[i]    = logits ? 1 : 0;
+}
+
+// Probability of `id` in a distribution from llm_sampler_dist. Full-vocab
+// distributions are stored in id order, which makes the lookup direct.
+static float dist_prob(const std::vector<LlmCandidate> &dist, llama_token id) {
+    if (id >= 0 && (size_t)id < dist.size() && dist[id].id == id) {
+        return dist[id].value;
+    }
+    for (const auto &c : dist) {
+        if (c.id == id) return c.value;
+    }
+    return 0.0f;
+}
+
+static LlmCandidate *dist_find(std::vector<LlmCandidate> &dist, llama_token id) {
+    if (id >= 0 && (size_t)id < dist.size() && dist[id].id == id) {
+        return &dist[id];
+    }
+    for (auto &c : dist) {
+        if (c.id == id) return &c;
+    }
+    return nullptr;
+}
+
+static uint64_t ngram_key(const llama_token *tokens, int n) {
+    uint64_t h = 1469598103934665603ull ^ (uint64_t)n;   // FNV-1a over ids
+    for (int i = 0; i < n; ++i) {
+        h = (h ^ (uint32_t)tokens[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Map the n-grams ending just before lookup_tokens[j] to j
+static void index_ngrams(LlmDraft &d, size_t j) {
+    const auto &h = d.lookup_tokens;
+    for (int n = LLM_LOOKUP_NGRAM_MIN; n <= LLM_LOOKUP_NGRAM_MAX && (size_t)n <= j; ++n) {
+        d.ngrams[ngram_key(&h[j - n], n)] = (int32_t)j;
+    }
+}
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------------------------------
+// Setup
+// -----------------------------------------------------------------------------
+
+bool llm_spec_attach(llama_context *target, llama_context *draft) {
+    llm_spec_detach();
+    if (!target || !draft) return false;
+
+    const llama_vocab *vt = llama_model_get_vocab(llama_get_model(target));
+    const llama_vocab *vd = llama_model_get_vocab(llama_get_model(draft));
+    if (!vocab_compatible(vt, vd)) {
+        LOGSP("Draft vocabulary does not match the target, speculation disabled");
+        return false;
+    }
+
+    g_draft_ctx   = draft;
+    g_draft_vocab = vd;
+    g_target_n_vocab = llama_vocab_n_tokens(vt);
+    g_draft_n_ctx = llama_n_ctx(draft);
+    g_draft_batch_cap = (int32_t)std::min(llama_n_batch(draft), llama_n_ubatch(draft));
+    g_draft_batch = llama_batch_init(g_draft_batch_cap, 0, 1);
+    llm_spec_reset_stats();
+    LOGSP("Draft model attached (n_ctx=%u)", g_draft_n_ctx);
+    return true;
+}
+
+void llm_spec_detach() {
+    if (!g_draft_ctx) return;
+    llama_batch_free(g_draft_batch);
+    g_draft_batch = llama_batch{};
+    g_draft_batch_cap = 0;
+    g_draft_ctx   = nullptr;
+    g_draft_vocab = nullptr;
+}
+
+bool llm_spec_active() {
+    return g_draft_ctx != nullptr && g_n_draft.load(std::memory_order_relaxed) > 0;
+}
+
+void llm_spec_set_n_draft(int n_draft) {
+    g_n_draft.store(std::max(0, std::min(n_draft, LLM_SPEC_MAX_DRAFT)));
+}
+
+int llm_spec_n_draft() {
+    return g_n_draft.load(std::memory_order_relaxed);
+}
+
+void llm_spec_init_slot(LlmDraft &d, uint32_t seed, uint32_t n_ctx) {
+    d.cache_tokens.clear();
+    d.tokens.clear();
+    d.lookup_tokens.clear();
+    d.lookup_tokens.reserve(n_ctx);
+    d.ngrams.clear();
+    d.ngrams.reserve((size_t)n_ctx * (LLM_LOOKUP_NGRAM_MAX - LLM_LOOKUP_NGRAM_MIN + 1));
+    d.tokens.reserve(LLM_SPEC_MAX_DRAFT);
+    d.dists.assign(LLM_SPEC_MAX_DRAFT, {});
+    for (auto &q : d.dists) q.reserve(LLM_SPEC_DRAFT_TOP_K);
+    if (g_draft_vocab) {
+        llm_sampler_init(d.sampler, llama_vocab_n_tokens(g_draft_vocab), seed);
+    }
+}
+
+void llm_spec_clear_seq(LlmDraft &d, llama_seq_id seq) {
+    if (g_draft_ctx) {
+        llama_memory_seq_rm(llama_get_memory(g_draft_ctx), seq, -1, -1);
+    }
+    d.cache_tokens.clear();
+    d.tokens.clear();
+}
+
+void llm_spec_shift_seq(LlmDraft &d, llama_seq_id seq, int32_t n_keep, int32_t n_discard) {
+    if (!g_draft_ctx || d.cache_tokens.size() <= (size_t)n_keep) return;
+    llama_memory_t mem = llama_get_memory(g_draft_ctx);
+    if (!llama_memory_can_shift(mem) ||
+        d.cache_tokens.size() < (size_t)(n_keep + n_discard) ||
+        !llama_memory_seq_rm(mem, seq, n_keep, n_keep + n_discard)) {
+        llm_spec_clear_seq(d, seq);
+        return;
+    }
+    llama_memory_seq_add(mem, seq, n_keep + n_discard, -1, -n_discard);
+    d.cache_tokens.erase(d.cache_tokens.begin() + n_keep,
+                         d.cache_tokens.begin() + n_keep + n_discard);
+}
+
+void llm_spec_fork_seq(const LlmDraft &src, llama_seq_id src_seq,
+                       LlmDraft &dst, llama_seq_id dst_seq) {
+    llm_spec_clear_seq(dst, dst_seq);
+    if (!g_draft_ctx || src.cache_tokens.empty()) return;
+    llama_memory_t mem = llama_get_memory(g_draft_ctx);
+    llama_memory_seq_cp(mem, src_seq, dst_seq, -1, -1);
+    dst.cache_tokens = src.cache_tokens;
+}
+
+void llm_spec_set_threads(int n_threads, int n_threads_batch) {
+    if (g_draft_ctx) llama_set_n_threads(g_draft_ctx, n_threads, n_threads_batch);
+}
+
+// -----------------------------------------------------------------------------
+// Draft
+// -----------------------------------------------------------------------------
+
+int llm_spec_propose(LlmDraft &d, llama_seq_id seq,
+                     const std::vector<llama_token> &context, llama_token pending,
+                     int n_draft, float temp, float top_p, int top_k) {
+    d.tokens.clear();
+    d.from_lookup = false;
+    n_draft = std::min(n_draft, LLM_SPEC_MAX_DRAFT);
+    const size_t n_total = context.size() + 1;
+    if (!g_draft_ctx || n_draft <= 0 || n_total + n_draft >= g_draft_n_ctx) return 0;
+
+    const int64_t t_start = now_us();
+    llama_memory_t mem = llama_get_memory(g_draft_ctx);
+    auto token_at = [&](size_t i) { return i < context.size() ? context[i] : pending; };
+
+    // Reuse the draft KV up to the first difference; the last token is always
+    // re-decoded so that the draft has logits for it
+    size_t n_keep = 0;
+    while (n_keep < d.cache_tokens.size() && n_keep < n_total &&
+           d.cache_tokens[n_keep] == token_at(n_keep)) {
+        ++n_keep;
+    }
+    if (n_keep == n_total) --n_keep;
+    if (!llama_memory_seq_rm(mem, seq, (llama_pos)n_keep, -1)) {
+        llama_memory_seq_rm(mem, seq, -1, -1);
+        n_keep = 0;
+    }
+    d.cache_tokens.resize(n_keep);
+
+    for (size_t i = n_keep; i < n_total; ) {
+        g_draft_batch.n_tokens = 0;
+        for (; i < n_total && g_draft_batch.n_tokens < g_draft_batch_cap; ++i) {
+            draft_batch_add(token_at(i), (llama_pos)i, seq, i + 1 == n_total);
+        }
+        if (llama_decode(g_draft_ctx, g_draft_batch) != 0) {
+            llm_spec_clear_seq(d, seq);
+            return 0;
+        }
+        for (int32_t j = 0; j < g_draft_batch.n_tokens; ++j) {
+            d.cache_tokens.push_back(g_draft_batch.token[j]);
+        }
+    }
+
+    const int k = top_k > 0 ? std::min(top_k, LLM_SPEC_DRAFT_TOP_K) : LLM_SPEC_DRAFT_TOP_K;
+    for (int i = 0; i < n_draft; ++i) {
+        auto &q = d.dists[i];
+        llm_sampler_dist(d.sampler, llama_get_logits_ith(g_draft_ctx, -1), temp, top_p, k, q);
+        llama_token tok = llm_sampler_draw(d.sampler, q);
+        if (tok == LLAMA_TOKEN_NULL || tok >= g_target_n_vocab) break;
+        d.tokens.push_back(tok);
+        if (llama_vocab_is_eog(g_draft_vocab, tok) || i + 1 == n_draft) break;
+
+        g_draft_batch.n_tokens = 0;
+        draft_batch_add(tok, (llama_pos)d.cache_tokens.size(), seq, true);
+        if (llama_decode(g_draft_ctx, g_draft_batch) != 0) break;
+        d.cache_tokens.push_back(tok);
+    }
+
+    g_draft_us.fetch_add((uint64_t)(now_us() - t_start), std::memory_order_relaxed);
+    return (int)d.tokens.size();
+}
+
+// -----------------------------------------------------------------------------
+// Prompt lookup
+// -----------------------------------------------------------------------------
+
+int llm_spec_lookup(LlmDraft &d, const std::vector<llama_token> &context,
+                    llama_token pending, int n_draft) {
+    d.tokens.clear();
+    d.from_lookup = true;
+    n_draft = std::min(n_draft, LLM_SPEC_MAX_DRAFT);
+    if (n_draft <= 0) return 0;
+
+    // Sync the indexed history with context + pending. Matches are still
+    // re-checked before use: keys are hashes.
+    auto &h = d.lookup_tokens;
+    const size_t n_total = context.size() + 1;
+    size_t n_keep = 0;
+    while (n_keep < h.size() && n_keep < n_total &&
+           h[n_keep] == (n_keep < context.size() ? context[n_keep] : pending)) {
+        ++n_keep;
+    }
+    if (n_keep < h.size()) {
+        // Diverged (the next request on the slot, a context shift): entries
+        // past n_keep would shadow valid matches and keep the map growing,
+        // so index the kept prefix again
+        h.resize(n_keep);
+        d.ngrams.clear();
+        for (size_t j = 0; j < n_keep; ++j) index_ngrams(d, j);
+    }
+    for (size_t j = n_keep; j < n_total; ++j) {
+        h.push_back(j < context.size() ? context[j] : pending);
+        index_ngrams(d, j);
+    }
+
+    for (int n = LLM_LOOKUP_NGRAM_MAX; n >= LLM_LOOKUP_NGRAM_MIN; --n) {
+        if ((size_t)n >= h.size()) continue;
+        const llama_token *tail = &h[h.size() - n];
+        auto it = d.ngrams.find(ngram_key(tail, n));
+        if (it == d.ngrams.end()) continue;
+
+        const size_t pos = (size_t)it->second;
+        if (pos < (size_t)n || pos >= h.size() ||
+            !std::equal(tail, tail + n, &h[pos - n])) {
+            continue;
+        }
+        for (size_t i = pos; i < h.size() && (int)d.tokens.size() < n_draft; ++i) {
+            d.tokens.push_back(h[i]);
+            d.dists[d.tokens.size() - 1].assign(1, {1.0f, h[i]});
+        }
+        break;
+    }
+    return (int)d.tokens.size();
+}
+
+// -----------------------------------------------------------------------------
+// Verify
+// -----------------------------------------------------------------------------
+
+int llm_spec_verify(LlmSampler &smpl, LlmDraft &d, llama_context *ctx,
+                    int32_t i_batch, float temp, float top_p, int top_k,
+                    std::vector<llama_token> &out) {
+    out.clear();
+    std::uniform_real_distribution<float> u01(0.0f, 1.0f);
+    const size_t n = d.tokens.size();
+
+    size_t i = 0;
+    for (; i < n; ++i) {
+        llm_sampler_dist(smpl, llama_get_logits_ith(ctx, i_batch + (int32_t)i),
+                         temp, top_p, top_k, d.p);
+        const llama_token x = d.tokens[i];
+        const float px = dist_prob(d.p, x);
+        const float qx = dist_prob(d.dists[i], x);
+        if (qx > 0.0f && u01(smpl.rng) * qx < px) {
+            out.push_back(x);
+            continue;
+        }
+
+        // Rejected: draw from norm(max(0, p - q))
+        d.residual = d.p;
+        for (const auto &c : d.dists[i]) {
+            LlmCandidate *r = dist_find(d.residual, c.id);
+            if (r) r->value = std::max(0.0f, r->value - c.value);
+        }
+        float sum = 0.0f;
+        for (const auto &r : d.residual) sum += r.value;
+        if (sum > 0.0f) {
+            for (auto &r : d.residual) r.value /= sum;
+            out.push_back(llm_sampler_draw(smpl, d.residual));
+        } else {
+            out.push_back(llm_sampler_draw(smpl, d.p));
+        }
+        break;
+    }
+    if (i == n) {
+        llm_sampler_dist(smpl, llama_get_logits_ith(ctx, i_batch + (int32_t)n),
+                         temp, top_p, top_k, d.p);
+        out.push_back(llm_sampler_draw(smpl, d.p));
+    }
+
+    SpecCounters &c = d.from_lookup ? g_lookup_stats : g_model_stats;
+    c.steps.fetch_add(1, std::memory_order_relaxed);
+    c.drafted.fetch_add(n, std::memory_order_relaxed);
+    c.accepted.fetch_add(i, std::memory_order_relaxed);
+    return (int)i;
+}
+
+// -----------------------------------------------------------------------------
+// Stats
+// -----------------------------------------------------------------------------
+
+void llm_spec_record_target_us(int64_t us) {
+    g_target_us.fetch_add((uint64_t)us, std::memory_order_relaxed);
+    g_n_target_iters.fetch_add(1, std::memory_order_relaxed);
+}
+
+static int counters_json(char *buf, size_t size, const char *name, const SpecCounters &c) {
+    const uint64_t steps    = c.steps.load();
+    const uint64_t drafted  = c.drafted.load();
+    const uint64_t accepted = c.accepted.load();
+    return snprintf(buf, size,
+                    "\"%s\":{\"steps\":%llu,\"drafted\":%llu,\"accepted\":%llu,"
+                    "\"acceptance_rate\":%.4f,\"tokens_per_step\":%.3f}",
+                    name, (unsigned long long)steps, (unsigned long long)drafted,
+                    (unsigned long long)accepted,
+                    drafted ? (double)accepted / drafted : 0.0,
+                    steps ? (double)(accepted + steps) / steps : 0.0);
+}
+
+std::string llm_spec_stats_json() {
+    const uint64_t steps    = g_model_stats.steps.load() + g_lookup_stats.steps.load();
+    const uint64_t accepted = g_model_stats.accepted.load() + g_lookup_stats.accepted.load();
+    const uint64_t draft_us = g_draft_us.load();
+    const uint64_t target_us = g_target_us.load();
+    const uint64_t iters    = g_n_target_iters.load();
+
+    const double tokens_per_step = steps ? (double)(accepted + steps) / steps : 0.0;
+    // Assumes a verify iteration costs about as much as a plain decode
+    // iteration (both are bound by weight bandwidth at these batch sizes)
+    const double draft_per_iter  = iters ? (double)draft_us / iters : 0.0;
+    const double target_per_iter = iters ? (double)target_us / iters : 0.0;
+    const double speedup = target_per_iter > 0.0
+            ? tokens_per_step * target_per_iter / (target_per_iter + draft_per_iter)
+            : 0.0;
+
+    char model[256];
+    char lookup[256];
+    counters_json(model, sizeof(model), "draft_model", g_model_stats);
+    counters_json(lookup, sizeof(lookup), "lookup", g_lookup_stats);
+
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+             "{\"active\":%s,\"n_draft\":%d,%s,%s,\"tokens_per_step\":%.3f,"
+             "\"draft_ms_per_iter\":%.3f,\"target_ms_per_iter\":%.3f,"
+             "\"est_speedup\":%.3f}",
+             g_draft_ctx ? "true" : "false", llm_spec_n_draft(), model, lookup,
+             tokens_per_step, draft_per_iter / 1000.0, target_per_iter / 1000.0,
+             speedup);
+    return buf;
+}
+
+void llm_spec_reset_stats() {
+    for (SpecCounters *c : {&g_model_stats, &g_lookup_stats}) {
+        c->steps = 0;
+        c->drafted = 0;
+        c->accepted = 0;
+    }
+    g_draft_us = 0;
+    g_target_us = 0;
+    g_n_target_iters = 0;
+}
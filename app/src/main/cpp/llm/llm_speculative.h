@@ -0,0 +1,104 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "llm_sampling.h"
+
+// ============================================================================
+// Speculative decoding
+// ============================================================================
+//
+// A small draft model sharing the target's vocabulary proposes up to N tokens
+// for a generating slot. The target decodes them after the slot's pending
+// token in the regular scheduler batch (one llama_decode for all slots) and
+// keeps the longest prefix allowed by the speculative-sampling rule: draft
+// token x, drawn from the draft distribution q, is accepted with probability
+// min(1, p(x) / q(x)); on the first rejection a replacement is drawn from
+// norm(max(0, p - q)), and if every draft is accepted one more token is drawn
+// from p. The emitted tokens therefore follow the target distribution p for
+// any draft model. Rejected positions are removed from the target KV with
+// llama_memory_seq_rm by the caller.
+//
+// Without a draft model, proposals can come from prompt lookup instead: an
+// n-gram index over the slot's prompt and generated tokens finds the most
+// recent earlier occurrence of the current tail and proposes what followed
+// it. A lookup proposal is deterministic, so q is one-hot and the same rule
+// applies. When nothing matches the slot simply decodes one token.
+//
+// The draft context mirrors the target's sequence ids, one per slot. All
+// functions are called from the scheduler thread only, except the n_draft
+// setter and the stats snapshot.
+// ============================================================================
+
+struct LlmDraft {
+    std::vector<llama_token> cache_tokens;   // tokens whose KV lives in the draft seq
+    std::vector<llama_token> tokens;         // proposals of the current step
+    std::vector<std::vector<LlmCandidate>> dists;   // q of each proposal
+    bool from_lookup = false;                // proposals came from the n-gram index
+    LlmSampler sampler;                      // draft-vocab scratch + RNG
+
+    // Prompt lookup: (n, n-gram hash) -> position of the token that followed
+    // its most recent occurrence in lookup_tokens
+    std::vector<llama_token> lookup_tokens;
+    std::unordered_map<uint64_t, int32_t> ngrams;
+
+    // Verification scratch
+    std::vector<LlmCandidate> p;
+    std::vector<LlmCandidate> residual;
+};
+
+// ============================================================================
+// API
+// ============================================================================
+
+// Use `draft` to speculate for `target`. Fails (and leaves speculation off) if
+// the vocabularies are not compatible.
+bool llm_spec_attach(llama_context *target, llama_context *draft);
+void llm_spec_detach();
+bool llm_spec_active();
+
+// Maximum number of draft tokens per slot and step; 0 disables speculation
+void llm_spec_set_n_draft(int n_draft);
+int  llm_spec_n_draft();
+
+void llm_spec_init_slot(LlmDraft &d, uint32_t seed, uint32_t n_ctx);
+void llm_spec_clear_seq(LlmDraft &d, llama_seq_id seq);
+// Mirror a context shift of the target: drop positions [n_keep, n_keep +
+// n_discard) and move the rest down, or clear the seq if the draft memory
+// cannot shift
+void llm_spec_shift_seq(LlmDraft &d, llama_seq_id seq, int32_t n_keep, int32_t n_discard);
+// Give `dst_seq` the draft KV of `src_seq`, for a completion forked from
+// another slot's prompt. The cells are shared, not copied.
+void llm_spec_fork_seq(const LlmDraft &src, llama_seq_id src_seq,
+                       LlmDraft &dst, llama_seq_id dst_seq);
+void llm_spec_set_threads(int n_threads, int n_threads_batch);
+
+// Bring the draft seq up to `context` + `pending` and draft up to n_draft
+// tokens into d.tokens / d.dists. Returns the number of proposals.
+int llm_spec_propose(LlmDraft &d, llama_seq_id seq,
+                     const std::vector<llama_token> &context, llama_token pending,
+                     int n_draft, float temp, float top_p, int top_k);
+
+// Propose up to n_draft tokens by prompt lookup over `context` + `pending`.
+// Returns the number of proposals (0 when no n-gram matches).
+int llm_spec_lookup(LlmDraft &d, const std::vector<llama_token> &context,
+                    llama_token pending, int n_draft);
+
+// Verify d.tokens against the target logits at rows i_batch .. i_batch + n.
+// `out` receives the accepted drafts followed by one token drawn from the
+// target. Returns the number of accepted drafts.
+int llm_spec_verify(LlmSampler &smpl, LlmDraft &d, llama_context *ctx,
+                    int32_t i_batch, float temp, float top_p, int top_k,
+                    std::vector<llama_token> &out);
+
+// Target decode time of one iteration that verified draft tokens
+void llm_spec_record_target_us(int64_t us);
+
+// Counters as JSON, separately for draft-model and lookup proposals:
+// drafted/accepted tokens, acceptance rate, tokens per verify step; plus draft
+// and target time and an estimated speedup
+std::string llm_spec_stats_json();
+void llm_spec_reset_stats();
@@ -0,0 +1,25 @@
+#pragma once
+#include <cstddef>
+
+// -----------------------------------------------------------------------------
+// Length of the longest prefix of s[0..n) that does not end inside a multi-byte
+// UTF-8 sequence. Token pieces can split a codepoint; the remaining tail is
+// held back until the next piece completes it.
+// -----------------------------------------------------------------------------
+inline size_t utf8_complete_prefix(const char *s, size_t n) {
+    // Walk back to the last lead byte (at most 3 continuation bytes)
+    size_t i = n;
+    for (size_t back = 0; back < 4 && i > 0; ++back) {
+        --i;
+        unsigned char c = (unsigned char)s[i];
+        if ((c & 0xC0) == 0x80) continue;
+
+        size_t len = 1;
+        if      ((c & 0xE0) == 0xC0) len = 2;
+        else if ((c & 0xF0) == 0xE0) len = 3;
+        else if ((c & 0xF8) == 0xF0) len = 4;
+        return n - i >= len ? n : i;
+    }
+    // No lead byte found: invalid input, do not hold anything back
+    return n;
+}
@@ -0,0 +1,92 @@
+// Host benchmark: prefill and decode throughput, TTFT and inter-token latency
+// of a GGUF model over a grid of thread counts, prompt lengths and batch
+// sizes, using the same llm_bench_run as the app. Prints JSON to stdout.
+// -c compares context profiles (KV cache types, flash attention) against the
+// first one listed; -b 0 uses each profile's own batch sizes.
+//
+//   cmake -S app/src/main/cpp -B build-host -DLLM_BUILD_HOST_TOOLS=ON
+//         -DLLM_HOST_LLAMA_DIR=/path/to/llama.cpp/build/bin
+//   cmake --build build-host
+//   ./build-host/llm_bench -m model.gguf -t 2,4,8 -p 64,512 -b 128,512 -n 64 -r 3
+//   ./build-host/llm_bench -m model.gguf -t 4 -p 512 -b 0 -c default,q8_0,q4_0_long
+
+#include "llm_bench.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static std::vector<int> parse_list(const char *s) {
+    std::vector<int> out;
+    while (*s) {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s) break;
+        out.push_back((int)v);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return out;
+}
+
+static std::vector<std::string> parse_names(const char *s) {
+    std::vector<std::string> out;
+    std::string cur;
+    for (; ; ++s) {
+        if (*s == ',' || !*s) {
+            if (!cur.empty()) out.push_back(cur);
+            cur.clear();
+            if (!*s) break;
+        } else {
+            cur += *s;
+        }
+    }
+    return out;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s -m model.gguf [-t threads,...] [-p n_prompt,...] [-b n_batch,...]\n"
+            "          [-n n_gen] [-r reps] [-c profile,...]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    const char *model_path = nullptr;
+    LlmBenchParams params;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const char *arg = argv[i], *val = argv[i + 1];
+        if      (!strcmp(arg, "-m")) model_path      = val;
+        else if (!strcmp(arg, "-t")) params.threads  = parse_list(val);
+        else if (!strcmp(arg, "-p")) params.n_prompt = parse_list(val);
+        else if (!strcmp(arg, "-b")) params.n_batch  = parse_list(val);
+        else if (!strcmp(arg, "-n")) params.n_gen    = atoi(val);
+        else if (!strcmp(arg, "-r")) params.n_reps   = atoi(val);
+        else if (!strcmp(arg, "-c")) params.profiles = parse_names(val);
+        else { usage(argv[0]); return 1; }
+    }
+    if (!model_path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    llama_log_set([](ggml_log_level, const char *, void *) {}, nullptr);
+    llama_backend_init();
+
+    const auto t0 = std::chrono::steady_clock::now();
+    llama_model *model = llama_model_load_from_file(model_path, llama_model_default_params());
+    const double load_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t0).count();
+    if (!model) {
+        fprintf(stderr, "failed to load %s\n", model_path);
+        return 1;
+    }
+
+    printf("%s\n", llm_bench_run(model, params, load_ms).c_str());
+
+    llama_model_free(model);
+    llama_backend_free();
+    return 0;
+}
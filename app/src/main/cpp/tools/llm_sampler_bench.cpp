@@ -0,0 +1,205 @@
+// Host benchmark: per-token latency of llm_sampler_sample against the
+// previous sample_token_from_logits implementation (kept verbatim below as
+// legacy_sample) over synthetic logits at several vocabulary sizes.
+//
+//   cmake -S app/src/main/cpp -B build-host -DLLM_BUILD_HOST_TOOLS=ON
+//   cmake --build build-host && ./build-host/llm_sampler_bench
+
+#include "llm_sampling.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Baseline
+// -----------------------------------------------------------------------------
+
+static llama_token legacy_sample(int n_vocab,
+                                 const float *logits, float temp,
+                                 float top_p, int top_k) {
+    if (n_vocab <= 0 || !logits) {
+        return LLAMA_TOKEN_NULL;
+    }
+
+    // Greedy fallback if temp <= 0
+    if (temp <= 0.0f) {
+        float max_logit = -1e30f;
+        llama_token best = LLAMA_TOKEN_NULL;
+        for (int i = 0; i < n_vocab; ++i) {
+            if (logits[i] > max_logit) {
+                max_logit = logits[i];
+                best = (llama_token)i;
+            }
+        }
+        return best;
+    }
+
+    struct Candidate {
+        llama_token id;
+        float logit;
+        float p;
+    };
+
+    std::vector<Candidate> cands;
+    cands.reserve(n_vocab);
+    for (int i = 0; i < n_vocab; ++i) {
+        Candidate c;
+        c.id = (llama_token)i;
+        c.logit = logits[i];
+        c.p = 0.0f;
+        cands.push_back(c);
+    }
+
+    // Top-k
+    if (top_k > 0 && top_k < n_vocab) {
+        std::nth_element(
+                cands.begin(),
+                cands.begin() + top_k,
+                cands.end(),
+                [](const Candidate &a, const Candidate &b) {
+                    return a.logit > b.logit;
+                }
+        );
+        cands.resize(top_k);
+    }
+
+    // Temperature
+    for (auto &c : cands) {
+        c.logit /= temp;
+    }
+
+    // Softmax
+    float max_logit = -1e30f;
+    for (const auto &c : cands) {
+        if (c.logit > max_logit) max_logit = c.logit;
+    }
+
+    double sum = 0.0;
+    for (auto &c : cands) {
+        double v = std::exp((double)c.logit - (double)max_logit);
+        c.p = (float)v;
+        sum += v;
+    }
+    if (sum <= 0.0) {
+        llama_token best = LLAMA_TOKEN_NULL;
+        float best_logit = -1e30f;
+        for (const auto &c : cands) {
+            if (c.logit > best_logit) {
+                best_logit = c.logit;
+                best = c.id;
+            }
+        }
+        return best;
+    }
+    for (auto &c : cands) {
+        c.p = (float)((double)c.p / sum);
+    }
+
+    // Top-p
+    if (top_p > 0.0f && top_p < 1.0f) {
+        std::sort(
+                cands.begin(),
+                cands.end(),
+                [](const Candidate &a, const Candidate &b) {
+                    return a.p > b.p;
+                }
+        );
+        double cum = 0.0;
+        size_t cut = cands.size();
+        for (size_t i = 0; i < cands.size(); ++i) {
+            cum += cands[i].p;
+            if (cum >= top_p) {
+                cut = i + 1;
+                break;
+            }
+        }
+        if (cut < cands.size()) {
+            cands.resize(cut);
+        }
+        double sum2 = 0.0;
+        for (auto &c : cands) sum2 += c.p;
+        if (sum2 > 0.0) {
+            for (auto &c : cands) c.p = (float)(c.p / sum2);
+        }
+    }
+
+    static thread_local std::mt19937 rng{std::random_device{}()};
+    std::vector<double> weights;
+    weights.reserve(cands.size());
+    for (const auto &c : cands) {
+        weights.push_back((double)c.p);
+    }
+
+    std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
+    size_t idx = dist(rng);
+    if (idx >= cands.size()) {
+        return LLAMA_TOKEN_NULL;
+    }
+    return cands[idx].id;
+}
+
+// -----------------------------------------------------------------------------
+// Harness
+// -----------------------------------------------------------------------------
+
+struct BenchCase {
+    const char *name;
+    float temp;
+    float top_p;
+    int   top_k;
+};
+
+template <typename F>
+static double time_us_per_token(int iters, F &&fn) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; ++i) fn(i);
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(t1 - t0).count() / iters;
+}
+
+int main() {
+    const int vocab_sizes[] = {32000, 128256, 151936, 256000};
+    const BenchCase cases[] = {
+            {"top_k=40 top_p=0.9", 0.7f, 0.9f, 40},
+            {"top_k=0  top_p=0.9", 0.7f, 0.9f, 0},
+            {"top_k=0  top_p=1.0", 0.7f, 1.0f, 0},
+            {"greedy",             0.0f, 1.0f, 0},
+    };
+    const int n_rows  = 16;   // distinct logit rows, cycled
+    const int iters   = 200;
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0.0f, 3.0f);
+
+    std::printf("%-8s %-20s %12s %12s %8s\n",
+                "n_vocab", "config", "legacy_us", "new_us", "speedup");
+
+    for (int n_vocab : vocab_sizes) {
+        std::vector<float> logits((size_t)n_rows * n_vocab);
+        for (auto &v : logits) v = normal(rng);
+
+        LlmSampler smpl;
+        llm_sampler_init(smpl, n_vocab, 1234);
+
+        for (const auto &c : cases) {
+            volatile llama_token sink = 0;
+            auto row = [&](int i) { return logits.data() + (size_t)(i % n_rows) * n_vocab; };
+
+            double legacy_us = time_us_per_token(iters, [&](int i) {
+                sink = legacy_sample(n_vocab, row(i), c.temp, c.top_p, c.top_k);
+            });
+            double new_us = time_us_per_token(iters, [&](int i) {
+                sink = llm_sampler_sample(smpl, row(i), c.temp, c.top_p, c.top_k);
+            });
+            (void)sink;
+
+            std::printf("%-8d %-20s %12.1f %12.1f %7.1fx\n",
+                        n_vocab, c.name, legacy_us, new_us, legacy_us / new_us);
+        }
+    }
+    return 0;
+}
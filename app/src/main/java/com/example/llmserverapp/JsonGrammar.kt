@@ -0,0 +1,184 @@
+package com.example.llmserverapp
+
+import org.json.JSONArray
+import org.json.JSONObject
+
+// GBNF grammars for constrained decoding (LlamaBridge grammar parameters).
+// Supports the JSON schema subset API clients use for structured output:
+// type (incl. type lists), properties/required, items with min/maxItems,
+// enum, const, anyOf/oneOf and string min/maxLength. Other keywords (pattern,
+// format, $ref, additionalProperties) are ignored; such values fall back to
+// the generic rule of their type. Properties are generated in schema order.
+object JsonGrammar {
+
+    // Whitespace is bounded so the model cannot pad forever
+    private val PRIMITIVES = linkedMapOf(
+        "ws" to """| " " | "\n" [ \t]{0,20}""",
+        "char" to """[^"\\\x7F\x00-\x1F] | [\\] (["\\/bfnrt] | "u" [0-9a-fA-F]{4})""",
+        "string" to """"\"" char* "\"" ws""",
+        "integral-part" to """[0] | [1-9] [0-9]{0,15}""",
+        "number" to """"-"? integral-part ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws""",
+        "integer" to """"-"? integral-part ws""",
+        "boolean" to """("true" | "false") ws""",
+        "null" to """"null" ws""",
+        "value" to """object | array | string | number | boolean | null""",
+        "object" to """"{" ws ( string ":" ws value ("," ws string ":" ws value)* )? "}" ws""",
+        "array" to """"[" ws ( value ("," ws value)* )? "]" ws""",
+    )
+
+    // Any JSON object, for response_format {"type": "json_object"}
+    val JSON_OBJECT: String = Builder().apply { rules["root"] = "object" }.build()
+
+    fun fromSchema(schema: JSONObject): String =
+        Builder().apply { rules["root"] = visit(schema, "root") }.build()
+
+    private class Builder {
+        val rules = linkedMapOf<String, String>()
+        private val used = mutableSetOf<String>()
+
+        fun build(): String {
+            // Pull in the primitives the generated rules reference, transitively
+            val out = StringBuilder()
+            for ((name, body) in rules) out.append("$name ::= $body\n")
+            val pending = ArrayDeque(rules.values.toList())
+            while (pending.isNotEmpty()) {
+                val body = pending.removeFirst()
+                for ((name, prim) in PRIMITIVES) {
+                    if (name !in used && Regex("(?<![\\w-])${Regex.escape(name)}(?![\\w-])").containsMatchIn(stripLiterals(body))) {
+                        used += name
+                        pending += prim
+                    }
+                }
+            }
+            for ((name, prim) in PRIMITIVES) if (name in used) out.append("$name ::= $prim\n")
+            return out.toString()
+        }
+
+        // Rule for a schema node; anything but a primitive gets a rule of its own
+        fun visit(schema: JSONObject, hint: String): String {
+            schema.optJSONArray("enum")?.let { values ->
+                return alternatives(List(values.length()) { literal(values.get(it)) })
+            }
+            if (schema.has("const")) return literal(schema.get("const"))
+            (schema.optJSONArray("anyOf") ?: schema.optJSONArray("oneOf"))?.let { options ->
+                return alternatives(List(options.length()) {
+                    val option = options.optJSONObject(it) ?: JSONObject()
+                    ruleFor(visit(option, "$hint-$it"), "$hint-$it")
+                })
+            }
+            schema.optJSONArray("type")?.let { types ->
+                return alternatives(List(types.length()) {
+                    val single = JSONObject(schema.toString()).put("type", types.getString(it))
+                    ruleFor(visit(single, "$hint-${types.getString(it)}"), "$hint-$it")
+                })
+            }
+            return when (schema.optString("type")) {
+                "object" -> objectRule(schema, hint)
+                "array" -> arrayRule(schema, hint)
+                "string" -> stringRule(schema)
+                "number", "integer", "boolean", "null" -> schema.getString("type")
+                else -> if (schema.has("properties")) objectRule(schema, hint) else "value"
+            }
+        }
+
+        private fun objectRule(schema: JSONObject, hint: String): String {
+            val props = schema.optJSONObject("properties") ?: return "object"
+            val required = schema.optJSONArray("required")
+                ?.let { arr -> List(arr.length()) { arr.getString(it) }.toSet() } ?: emptySet()
+            val kv = mutableListOf<Pair<String, Boolean>>()
+            for (key in props.keys()) {
+                val value = ruleFor(visit(props.getJSONObject(key), "$hint-$key"), "$hint-$key")
+                kv += "${gbnfString(JSONObject.quote(key))} \":\" ws $value" to (key in required)
+            }
+            // Properties i.. in schema order, optional ones as optional groups in
+            // place; only the first property present goes without a comma
+            fun members(i: Int, started: Boolean): String {
+                if (i == kv.size) return ""
+                val (member, isRequired) = kv[i]
+                val comma = if (started) "\",\" ws " else ""
+                val rest = members(i + 1, true)
+                return when {
+                    isRequired -> "$comma$member $rest"
+                    started -> "(\",\" ws $member)? $rest"
+                    i + 1 == kv.size -> "($member)?"
+                    else -> "($member $rest | ${members(i + 1, false)})"
+                }.trim()
+            }
+            val body = members(0, false)
+            return "\"{\" ws $body \"}\" ws"
+        }
+
+        private fun arrayRule(schema: JSONObject, hint: String): String {
+            val item = schema.optJSONObject("items")
+                ?.let { ruleFor(visit(it, "$hint-item"), "$hint-item") } ?: "value"
+            val min = schema.optInt("minItems", 0).coerceAtLeast(0)
+            val max = if (schema.has("maxItems")) schema.getInt("maxItems") else -1
+            val more = repeat(maxOf(min - 1, 0), if (max < 0) -1 else max - 1)
+            val rest = if (more == "{0}") "" else "(\",\" ws $item)$more"
+            val items = when {
+                max == 0 -> ""
+                min == 0 -> "($item $rest)?"
+                else -> "$item $rest"
+            }
+            return "\"[\" ws $items \"]\" ws"
+        }
+
+        private fun stringRule(schema: JSONObject): String {
+            if (!schema.has("minLength") && !schema.has("maxLength")) return "string"
+            val min = schema.optInt("minLength", 0).coerceAtLeast(0)
+            val max = if (schema.has("maxLength")) schema.getInt("maxLength") else -1
+            return "\"\\\"\" char${repeat(min, max)} \"\\\"\" ws"
+        }
+
+        private fun repeat(min: Int, max: Int): String = when {
+            max < 0 -> if (min == 0) "*" else "{$min,}"
+            min == max -> "{$min}"
+            else -> "{$min,$max}"
+        }
+
+        // Named rule for a non-trivial body, so alternatives stay readable
+        private fun ruleFor(body: String, hint: String): String {
+            if (body in PRIMITIVES || body in rules) return body
+            var name = hint.replace(Regex("[^A-Za-z0-9-]+"), "-").lowercase()
+            if (name in PRIMITIVES) name = "$name-"
+            var unique = name
+            var i = 1
+            while (unique in rules) unique = "$name${i++}"
+            rules[unique] = body
+            return unique
+        }
+
+        private fun alternatives(options: List<String>): String =
+            options.distinct().joinToString(" | ").let { if (options.size > 1) "($it)" else it }
+
+        // A fixed JSON value, e.g. an enum member
+        private fun literal(value: Any?): String {
+            val json = when (value) {
+                null, JSONObject.NULL -> "null"
+                is String -> JSONObject.quote(value)
+                is JSONObject, is JSONArray -> value.toString()
+                else -> JSONObject.wrap(value).toString()
+            }
+            return "${gbnfString(json)} ws"
+        }
+    }
+
+    // Text as a GBNF string literal
+    private fun gbnfString(text: String): String = buildString {
+        append('"')
+        for (c in text) when (c) {
+            '"' -> append("\\\"")
+            '\\' -> append("\\\\")
+            '\n' -> append("\\n")
+            '\r' -> append("\\r")
+            '\t' -> append("\\t")
+            else -> append(c)
+        }
+        append('"')
+    }
+
+    // Rule bodies without their quoted literals and character classes, for
+    // finding rule references
+    private fun stripLiterals(body: String): String =
+        body.replace(Regex("\"(\\\\.|[^\"\\\\])*\""), " ").replace(Regex("\\[(\\\\.|[^\\]\\\\])*]"), " ")
+}
@@ -1,6 +1,13 @@
 package com.example.llmserverapp
 
 import org.json.JSONObject
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.nio.CharBuffer
+import java.nio.FloatBuffer
+import java.nio.IntBuffer
+import java.nio.charset.CodingErrorAction
+import java.util.concurrent.atomic.AtomicLong
 
 object LlamaBridge {
 
@@ -11,23 +18,599 @@ object LlamaBridge {
         System.loadLibrary("native-lib")
     }
 
-    external fun loadModel(path: String, threads: Int): Long
+    // draftPath: optional small GGUF with the same vocabulary, used for
+    // speculative decoding. Pass null to load the target alone.
+    external fun loadModel(path: String, threads: Int, draftPath: String?): Long
+    // Like loadModel, but the current model keeps serving while the new one
+    // loads and warms up; the swap waits for in-flight requests, so none
+    // fail. Blocks the caller until done; 0 on failure (old model kept) or
+    // if unloadModel was called meanwhile.
+    external fun swapModel(path: String, threads: Int, draftPath: String?): Long
+    // Progress of the load in flight, 0..1
+    external fun getLoadProgress(): Float
+    // Cold start options for the next load: parallel readahead of the
+    // weights, mlock, and a warmup decode before the model reports ready
+    external fun setStartupOptions(prefetch: Boolean, mlock: Boolean, warmup: Boolean)
+    // JSON: ready_ms (time-to-ready), load/prefetch/warmup ms and the TTFT of
+    // the first request served after the load (first_ttft_ms, -1 until then)
+    external fun getStartupStats(): String
+    // Context shape for the next load: n_ctx, batch sizes, KV cache types
+    // (f16, q8_0, q4_0) and flash attention, by profile name. nCtx > 0
+    // overrides the profile's context length. False if the name is unknown.
+    external fun setContextProfile(name: String, nCtx: Int): Boolean
+    // Sequences the scheduler decodes together (1..16, default 4), for the
+    // next load. They share the context's KV cells.
+    external fun setParallelSlots(n: Int)
+    // JSON: active profile (with kv_mb), the one for the next load, and all
+    // profiles with their KV size for the loaded model
+    external fun getContextProfiles(): String
     external fun getThreadCount(): Int
-    external fun generate(prompt: String, temperature: Float, maxTokens: Int, threads: Int): String
-    external fun runInference(prompt: String, onToken: (String) -> Unit)
+
+    // Applies to the live context: no reload, KV cache is kept. Does not wait
+    // for the model lock, so it is cheap enough for the settings UI.
+    external fun setThreads(threads: Int, batchThreads: Int)
+    // Sliding window past the end of the context: keep the first nSink
+    // tokens, drop the older half of the rest. Over-long prompts are cut the
+    // same way. -1 disables (requests stop at the end of the context).
+    external fun setContextShift(nSink: Int)
+    // Maximum draft tokens per step; 0 disables speculation
+    external fun setSpeculative(nDraft: Int)
+    // JSON: per-source (draft_model, lookup) acceptance_rate and
+    // tokens_per_step, plus est_speedup
+    external fun getSpeculativeStats(reset: Boolean): String
+    // promptLookup: speculate from n-gram matches in the prompt and output,
+    // for tasks that copy spans of the input (summaries, code edits).
+    // requestId: handle for cancelRequest (0 = not cancellable), rejected
+    // while another request with it is live; timeoutMs: wall-clock deadline;
+    // tokenBudget: max prompt + generated tokens. 0 disables either limit.
+    // grammar: GBNF the output must match (see JsonGrammar), null for free
+    // text; constrained requests do not speculate. lora: name of a
+    // registered adapter (registerLora), null for the base model.
+    external fun generate(
+        prompt: String,
+        temperature: Float,
+        maxTokens: Int,
+        threads: Int,
+        promptLookup: Boolean,
+        requestId: Long,
+        timeoutMs: Int,
+        tokenBudget: Int,
+        grammar: String?,
+        lora: String?
+    ): String
+    // n completions of one prompt: prefilled once, then decoded together on
+    // n slots with independent RNG streams. bestOf > n generates bestOf and
+    // keeps the n with the highest mean log-probability per token. n and
+    // bestOf are limited by the number of parallel slots. JSON: choices[]
+    // (text, tokens, finish_reason, logprob and mean_logprob when ranked),
+    // generated, duration_ms, or error.
+    external fun generateChoices(
+        prompt: String,
+        temperature: Float,
+        maxTokens: Int,
+        n: Int,
+        bestOf: Int,
+        requestId: Long,
+        timeoutMs: Int,
+        tokenBudget: Int,
+        grammar: String?,
+        lora: String?
+    ): String
+    // Independent prompts in one call, for offline jobs: up to maxConcurrent
+    // (at most the parallel slots) decode together, each finished one
+    // replaced by the next. A model swap does not wait for the batch; prompts
+    // it interrupts run again on the new model. timeoutMs bounds the whole
+    // batch. One result per prompt, in order: the text or "Error: ...".
+    // stats as for generateDirect, the total over all prompts.
+    external fun generateBatch(
+        prompts: Array<String>,
+        temperature: Float,
+        maxTokens: Int,
+        maxConcurrent: Int,
+        timeoutMs: Int,
+        grammar: String?,
+        lora: String?,
+        stats: IntArray?
+    ): Array<String>
+    // Mask cache counters of constrained decoding: checks, rejects,
+    // mask_hits, mask_builds. Per-token constraint time is the "grammar"
+    // histogram of getMetrics.
+    external fun getGrammarStats(): String
+    // JSON: us_per_token of sampling under `grammar` over synthetic logits
+    // for none / full_scan / cached_cold / cached_warm
+    external fun runGrammarBenchmark(grammar: String, tokens: Int): String
+    // Embeddings on a dedicated context of the loaded model. pooling is a
+    // llama_pooling_type: -1 model default, 0 none (mean-pooled natively),
+    // 1 mean, 2 cls, 3 last, 4 rank. batchTokens caps tokens per decode and
+    // input length; maxSeqs the inputs packed into one decode.
+    external fun setEmbeddingOptions(pooling: Int, batchTokens: Int, maxSeqs: Int)
+    // Floats per vector, 0 if no model is loaded
+    external fun getEmbeddingDim(): Int
+    // Writes vector i at float offset i * dim of out, a direct buffer in
+    // native byte order. JSON: n, dim, tokens, duration_ms, or error.
+    external fun embed(texts: Array<String>, out: ByteBuffer, normalize: Boolean): String
+    // JSON: texts_per_s / tokens_per_s for each max inputs per decode
+    external fun runEmbeddingBenchmark(seqsPerBatch: IntArray, texts: Int, tokensPerText: Int): String
+
+    // All vectors in one direct buffer, texts.size * dim floats. The texts
+    // go over as UTF-8 in a reused direct buffer (embedDirect), not as
+    // Strings converted one by one.
+    fun embedTexts(texts: List<String>, normalize: Boolean = true): Pair<FloatBuffer, Int> {
+        val dim = getEmbeddingDim()
+        check(dim > 0) { "model not loaded" }
+        val out = ByteBuffer.allocateDirect(texts.size * dim * 4).order(ByteOrder.nativeOrder())
+        val result = withDirectIo { io ->
+            val offsets = io.offsets(texts.size + 1)
+            var bytes = io.input(texts.sumOf { it.length })
+            offsets.putInt(0, 0)
+            texts.forEachIndexed { i, text ->
+                bytes = io.append(text)
+                offsets.putInt((i + 1) * 4, bytes.position())
+            }
+            JSONObject(embedDirect(bytes, offsets, texts.size, out, normalize))
+        }
+        check(!result.has("error")) { result.getString("error") }
+        return out.asFloatBuffer() to dim
+    }
+
+    // Direct buffer I/O: text crosses as UTF-8 and tokens / output are
+    // written in place into direct buffers owned here, so the JNI boundary
+    // does no UTF-16 conversion or array copy (jni_copy_bytes vs
+    // jni_direct_bytes in getMetrics). Buffers come from a small pool.
+
+    // Upper bound of the UTF-8 bytes of one generated token, 0 if no model
+    external fun getMaxTokenBytes(): Int
+    // Tokens of text[0, len) as int32 into out. Returns the count, minus the
+    // count needed if out is too small, 0 if no model is loaded.
+    external fun tokenizeDirect(text: ByteBuffer, len: Int, addBos: Boolean, out: ByteBuffer): Int
+    // generate() reading the prompt from prompt[0, len) and writing the reply
+    // (or "Error: ...") as UTF-8 into out. Returns the bytes written; stats,
+    // if given, receives the generated token count in stats[0].
+    external fun generateDirect(
+        prompt: ByteBuffer,
+        len: Int,
+        temperature: Float,
+        maxTokens: Int,
+        threads: Int,
+        promptLookup: Boolean,
+        requestId: Long,
+        timeoutMs: Int,
+        tokenBudget: Int,
+        grammar: String?,
+        lora: String?,
+        out: ByteBuffer,
+        stats: IntArray?
+    ): Int
+    // embed() over n texts packed as UTF-8 in utf8, text i at
+    // [offsets[i], offsets[i + 1]) of n + 1 native-order int32 offsets
+    external fun embedDirect(
+        utf8: ByteBuffer,
+        offsets: ByteBuffer,
+        n: Int,
+        out: ByteBuffer,
+        normalize: Boolean
+    ): String
+
+    private class DirectIo {
+        private val encoder = Charsets.UTF_8.newEncoder()
+            .onMalformedInput(CodingErrorAction.REPLACE)
+            .onUnmappableCharacter(CodingErrorAction.REPLACE)
+        private var input = ByteBuffer.allocateDirect(0)
+        private var output = ByteBuffer.allocateDirect(0)
+        private var offsets = ByteBuffer.allocateDirect(0)
+
+        private fun grow(buf: ByteBuffer, bytes: Int): ByteBuffer =
+            if (buf.capacity() >= bytes) buf
+            else ByteBuffer.allocateDirect(Integer.highestOneBit(maxOf(bytes, 4096) - 1) shl 1)
+                .order(ByteOrder.nativeOrder())
+
+        // Cleared input buffer with room for `bytes`
+        fun input(bytes: Int): ByteBuffer {
+            input = grow(input, bytes)
+            input.clear()
+            return input
+        }
+
+        // Encode text after the input position, growing as needed
+        fun append(text: String): ByteBuffer {
+            val chars = CharBuffer.wrap(text)
+            val start = input.position()
+            while (true) {
+                encoder.reset()
+                if (encoder.encode(chars, input, true).isUnderflow && encoder.flush(input).isUnderflow) {
+                    return input
+                }
+                // Out of room: keep the bytes before this text and start it over
+                val grown = grow(input, input.capacity() + text.length * 3 + 16)
+                input.position(0)
+                input.limit(start)
+                grown.put(input)
+                input = grown
+                chars.rewind()
+            }
+        }
+
+        fun output(bytes: Int): ByteBuffer {
+            output = grow(output, bytes)
+            output.clear()
+            return output
+        }
+
+        fun offsets(n: Int): ByteBuffer {
+            offsets = grow(offsets, n * 4)
+            offsets.clear()
+            return offsets
+        }
+    }
+
+    // Idle buffer sets, at most DIRECT_IO_POOL. Not per thread: the HTTP
+    // server runs each connection on a new thread, whose buffers would never
+    // be used again. Callers beyond the pool size allocate their own.
+    private const val DIRECT_IO_POOL = 4
+    private val directIoPool = ArrayDeque<DirectIo>()
+
+    private inline fun <R> withDirectIo(block: (DirectIo) -> R): R {
+        val io = synchronized(directIoPool) { directIoPool.removeLastOrNull() } ?: DirectIo()
+        try {
+            return block(io)
+        } finally {
+            synchronized(directIoPool) {
+                if (directIoPool.size < DIRECT_IO_POOL) directIoPool.addLast(io)
+            }
+        }
+    }
+
+    // Tokens of text, passed to block; the buffer is only valid inside it
+    fun <R> tokenizeUtf8(text: String, addBos: Boolean = true, block: (IntBuffer) -> R): R =
+        withDirectIo { io ->
+            io.input(text.length)
+            val bytes = io.append(text)
+            var out = io.output(bytes.position() * 4 + 8)
+            var n = tokenizeDirect(bytes, bytes.position(), addBos, out)
+            if (n < 0) {
+                out = io.output(-n * 4)
+                n = tokenizeDirect(bytes, bytes.position(), addBos, out)
+            }
+            block(out.asIntBuffer().apply { limit(n.coerceAtLeast(0)) })
+        }
+
+    // generate() through reused direct buffers; stats as for generateDirect
+    fun generateUtf8(
+        prompt: String,
+        temperature: Float,
+        maxTokens: Int,
+        threads: Int,
+        promptLookup: Boolean,
+        requestId: Long,
+        timeoutMs: Int,
+        tokenBudget: Int,
+        grammar: String?,
+        lora: String?,
+        stats: IntArray? = null
+    ): String = withDirectIo { io ->
+        io.input(prompt.length)
+        val bytes = io.append(prompt)
+        val out = io.output(maxTokens.coerceAtLeast(1) * getMaxTokenBytes().coerceAtLeast(4) + 256)
+        val n = generateDirect(
+            bytes, bytes.position(), temperature, maxTokens, threads, promptLookup,
+            requestId, timeoutMs, tokenBudget, grammar, lora, out, stats
+        )
+        out.limit(n)
+        Charsets.UTF_8.decode(out).toString()
+    }
+
+    // LoRA adapters of the loaded model, selected per request by name instead
+    // of loading a fine-tuned copy. Registered adapters are loaded with the
+    // next model, or into the current one on first use. Requests of different
+    // adapters take turns on the slots; sessions always use the base model.
+    // JSON: ok or error.
+    external fun registerLora(name: String, path: String, scale: Float): String
+    external fun unregisterLora(name: String): Boolean
+    // Least recently used adapters are freed beyond budgetMb; 0 = unlimited
+    external fun setLoraBudget(budgetMb: Int)
+    // JSON: adapters[], switches, switch_ms, first_decode_ms, load_ms and
+    // model_load_ms, the cost of a full reload for comparison
+    external fun getLoraStats(): String
+
+    // Streams generated text: onToken is called from the calling thread with
+    // each batch of newly sampled pieces until generation completes. If
+    // onToken throws, generation is cancelled. Returns the tokens generated.
+    external fun runInference(
+        prompt: String,
+        temperature: Float,
+        maxTokens: Int,
+        requestId: Long,
+        timeoutMs: Int,
+        grammar: String?,
+        lora: String?,
+        onToken: (String) -> Unit
+    ): Int
+    // Stops a queued or running request, even mid-prefill; it returns
+    // "Error: cancelled". False if no such request is live.
+    external fun cancelRequest(requestId: Long): Boolean
+
+    // Ids from newRequestId have bit 62 set and client-chosen ids must stay
+    // below it, so a client can never pick an id the server hands out
+    private const val SERVER_REQUEST_IDS = 1L shl 62
+    private val nextRequestId = AtomicLong(SERVER_REQUEST_IDS + 1)
+    fun newRequestId(): Long = nextRequestId.getAndIncrement()
+    fun isClientRequestId(id: Long): Boolean = id in 1 until SERVER_REQUEST_IDS
+    // Waits for requests in flight, so not on the main thread. A load or swap
+    // still staging is abandoned.
     external fun unloadModel()
 
+    // Prompts use the chat template embedded in the model, or the Alpaca
+    // format if it has none. Special tokens in message text are not parsed.
+    // JSON: source ("model" / "fallback"), template, renders, render_us,
+    // deltas, fallback_renders
+    external fun getChatTemplate(): String
+
+    // Chat sessions: each keeps its conversation in the KV cache between
+    // turns, so a turn only prefills the new message. Idle sessions are
+    // evicted LRU when the cache is full. Sessions survive a model swap; the
+    // first turn after it prefills the whole conversation again. stats as
+    // for generateDirect.
+    external fun createSession(): Long
+    external fun generateInSession(
+        sessionId: Long,
+        message: String,
+        temperature: Float,
+        maxTokens: Int,
+        requestId: Long,
+        timeoutMs: Int,
+        tokenBudget: Int,
+        grammar: String?,
+        stats: IntArray?
+    ): String
+    external fun closeSession(sessionId: Long): Boolean
+    // Keep up to budgetMb of evicted session state in memory so it can be
+    // paged back in instead of re-prefilled; 0 disables
+    external fun setSessionPaging(budgetMb: Int)
+    external fun getSessionStats(): String
+
+    // Persist shared prompt prefixes under dir, within budgetMb (0 disables).
+    // Restored entries skip prefill after restarts and model reloads.
+    external fun setPromptCache(dir: String?, budgetMb: Int): Boolean
+    // JSON: entries, bytes, restore vs prefill time per token, ...
+    external fun getPromptCacheStats(): String
+
+    // GGUF metadata without loading the model: header and KV section only,
+    // cached in the index file at path by file size and mtime
+    external fun setModelIndex(path: String)
+    // JSON: architecture, name, parameters, quantization, context_length,
+    // chat_template, tensor_bytes, bytes_by_type, cached; or error
+    external fun inspectModel(path: String): String
+    // JSON: entries, hits, misses, hit_ms vs read_ms
+    external fun getModelIndexStats(): String
+
 
     fun benchmarkModel(modelName: String, onLog: (String) -> Unit) {
-        adaptiveBenchmark(
-            passes = 5,
-            prompt = "hello",
-            modelName = modelName,
-            onLog = onLog
-        )
+        onLog("=== Benchmark for $modelName ===")
+        val json = try {
+            runBenchmark(
+                threads = intArrayOf(2, 4, Runtime.getRuntime().availableProcessors()).distinct().toIntArray(),
+                promptTokens = intArrayOf(64, 256),
+                batchSizes = intArrayOf(128, 512),
+                genTokens = 32,
+                reps = 3,
+                profiles = null
+            )
+        } catch (e: Throwable) {
+            onLog("Benchmark failed: ${e.message}")
+            return
+        }
+
+        val root = JSONObject(json)
+        if (root.has("error")) {
+            onLog("Benchmark failed: ${root.getString("error")}")
+            return
+        }
+        onLog("Model load: ${"%.0f".format(root.optDouble("load_ms"))} ms")
+        val results = root.getJSONArray("results")
+        for (i in 0 until results.length()) {
+            val r = results.getJSONObject(i)
+            val config = "threads=${r.getInt("threads")} | batch=${r.getInt("n_batch")} | " +
+                    "prompt=${r.getInt("n_prompt")}"
+            if (r.has("error")) {
+                onLog("$config: ${r.getString("error")}")
+                continue
+            }
+            onLog(
+                "$config: prefill ${"%.1f".format(r.getJSONObject("prefill_tps").getDouble("mean"))} tok/s" +
+                        " | decode ${"%.1f".format(r.getJSONObject("decode_tps").getDouble("mean"))} tok/s" +
+                        " | TTFT p50 ${"%.0f".format(r.getJSONObject("ttft_ms").getDouble("p50"))} ms" +
+                        " | ITL p90 ${"%.1f".format(r.getJSONObject("itl_ms").getDouble("p90"))} ms"
+            )
+        }
+        onLog(json)
+        benchmarkProfiles(onLog)
+        benchmarkEmbeddings(onLog)
+        benchmarkGrammar(onLog)
+        benchmarkBatch(onLog)
+        benchmarkJniIo(onLog)
+    }
+
+    // Bytes copied vs read in place at the JNI boundary and wall time, String
+    // vs direct buffer calls, on a long prompt with non-BMP characters
+    private fun benchmarkJniIo(onLog: (String) -> Unit) {
+        onLog("=== JNI I/O ===")
+        val prompt = "Summarize the notes below in one line. \uD83D\uDE80\n" +
+                "Launch checklist item, status green \uD83D\uDE00; ".repeat(200)
+        val texts = List(64) { "Document $it \uD83D\uDCC4 about nothing in particular. ".repeat(8) }
+        fun counters(): JSONObject = JSONObject(getMetrics(false)).getJSONObject("counters")
+        fun measure(name: String, block: () -> Unit) {
+            val before = counters()
+            val start = System.nanoTime()
+            block()
+            val ms = (System.nanoTime() - start) / 1e6
+            val after = counters()
+            fun delta(key: String) = after.optLong(key) - before.optLong(key)
+            onLog(
+                "$name: ${"%.1f".format(ms)} ms" +
+                        " | copied ${delta("jni_copy_bytes")} B" +
+                        " | direct ${delta("jni_direct_bytes")} B"
+            )
+        }
+        try {
+            measure("generate (String)") {
+                generate(prompt, 0.0f, 8, getThreadCount(), false, 0L, 0, 0, null, null)
+            }
+            measure("generate (direct)") {
+                generateUtf8(prompt, 0.0f, 8, getThreadCount(), false, 0L, 0, 0, null, null)
+            }
+            val dim = getEmbeddingDim()
+            if (dim > 0) {
+                measure("embed (String[])") {
+                    val out = ByteBuffer.allocateDirect(texts.size * dim * 4).order(ByteOrder.nativeOrder())
+                    embed(texts.toTypedArray(), out, true)
+                }
+                measure("embed (direct)") { embedTexts(texts) }
+            }
+        } catch (e: Throwable) {
+            onLog("JNI I/O benchmark failed: ${e.message}")
+        }
+    }
+
+    // Short independent prompts: one generate call each vs one generateBatch
+    private fun benchmarkBatch(onLog: (String) -> Unit) {
+        onLog("=== Batch generation ===")
+        val prompts = Array(16) { "Classify the sentiment of review #$it as positive or negative: \"It was fine.\"" }
+        try {
+            var start = System.nanoTime()
+            for (p in prompts) generate(p, 0.0f, 16, getThreadCount(), false, 0L, 0, 0, null, null)
+            val loopMs = (System.nanoTime() - start) / 1e6
+            start = System.nanoTime()
+            generateBatch(prompts, 0.0f, 16, Int.MAX_VALUE, 0, null, null, null)
+            val batchMs = (System.nanoTime() - start) / 1e6
+            onLog(
+                "${prompts.size} prompts: loop ${"%.0f".format(loopMs)} ms" +
+                        " | batch ${"%.0f".format(batchMs)} ms" +
+                        " | ${"%.2f".format(loopMs / batchMs)}x"
+            )
+        } catch (e: Throwable) {
+            onLog("Batch benchmark failed: ${e.message}")
+        }
+    }
+
+    // Cost of JSON-constrained sampling per token, against free sampling and
+    // checking the whole vocabulary every step
+    private fun benchmarkGrammar(onLog: (String) -> Unit) {
+        onLog("=== Constrained decoding ===")
+        val json = try {
+            runGrammarBenchmark(JsonGrammar.JSON_OBJECT, tokens = 256)
+        } catch (e: Throwable) {
+            onLog("Grammar benchmark failed: ${e.message}")
+            return
+        }
+        val results = JSONObject(json).optJSONArray("results") ?: return
+        for (i in 0 until results.length()) {
+            val r = results.getJSONObject(i)
+            onLog(
+                "${r.getString("mode")}: ${"%.1f".format(r.getDouble("us_per_token"))} us/token" +
+                        " | p99 ${"%.1f".format(r.getDouble("p99_us"))} us"
+            )
+        }
+        onLog(json)
     }
 
-    // IMPORTANT: JNI returns JSON STRING, not LlamaResult
+    // Embedding throughput as more inputs are packed into each decode
+    private fun benchmarkEmbeddings(onLog: (String) -> Unit) {
+        onLog("=== Embeddings ===")
+        val json = try {
+            runEmbeddingBenchmark(intArrayOf(1, 4, 16, 64), texts = 128, tokensPerText = 64)
+        } catch (e: Throwable) {
+            onLog("Embedding benchmark failed: ${e.message}")
+            return
+        }
+        val results = JSONObject(json).optJSONArray("results") ?: return
+        for (i in 0 until results.length()) {
+            val r = results.getJSONObject(i)
+            val config = "${r.getInt("n_seqs")} texts/decode"
+            if (r.has("error")) {
+                onLog("$config: ${r.getString("error")}")
+                continue
+            }
+            onLog(
+                "$config: ${"%.1f".format(r.getDouble("texts_per_s"))} texts/s" +
+                        " | ${"%.0f".format(r.getDouble("tokens_per_s"))} tok/s" +
+                        " | ${"%.1f".format(r.getDouble("ms_per_decode"))} ms/decode"
+            )
+        }
+        onLog(json)
+    }
+
+    // Memory / speed / quality of each context profile on the loaded model,
+    // against the first profile ("default", f16 KV)
+    private fun benchmarkProfiles(onLog: (String) -> Unit) {
+        val names = try {
+            val profiles = JSONObject(getContextProfiles()).getJSONArray("profiles")
+            Array(profiles.length()) { profiles.getJSONObject(it).getString("name") }
+        } catch (e: Throwable) {
+            onLog("Profile benchmark failed: ${e.message}")
+            return
+        }
+        onLog("=== Context profiles ===")
+        val json = try {
+            runBenchmark(
+                threads = intArrayOf(getThreadCount().coerceAtLeast(1)),
+                promptTokens = intArrayOf(256),
+                batchSizes = intArrayOf(0),
+                genTokens = 32,
+                reps = 2,
+                profiles = names
+            )
+        } catch (e: Throwable) {
+            onLog("Profile benchmark failed: ${e.message}")
+            return
+        }
+
+        val results = JSONObject(json).optJSONArray("results") ?: return
+        for (i in 0 until results.length()) {
+            val r = results.getJSONObject(i)
+            val profile = r.getJSONObject("profile")
+            val config = "${profile.getString("name")} (KV ${profile.getString("type_k")}, " +
+                    "n_ctx=${profile.getInt("n_ctx")}, ${"%.0f".format(profile.optDouble("kv_mb"))} MB)"
+            if (r.has("error")) {
+                onLog("$config: ${r.getString("error")}")
+                continue
+            }
+            val quality = r.optJSONObject("quality")?.let {
+                " | KL ${"%.4f".format(it.getDouble("kl"))}" +
+                        " | greedy match ${"%.0f".format(it.getDouble("greedy_match") * 100)}%"
+            } ?: " | reference"
+            onLog(
+                "$config: prefill ${"%.1f".format(r.getJSONObject("prefill_tps").getDouble("mean"))} tok/s" +
+                        " | decode ${"%.1f".format(r.getJSONObject("decode_tps").getDouble("mean"))} tok/s" +
+                        quality
+            )
+        }
+        onLog(json)
+    }
+
+    // JSON snapshot of the native metrics: request/token counters and
+    // latency histograms (queue_wait, tokenize, prefill, ttft, token_latency,
+    // decode, sample, detokenize) with count, mean, max and p50/p90/p99 in us.
+    // jni_copy_bytes / jni_direct_bytes: bytes converted or copied across JNI
+    // vs read and written in place through direct buffers.
+    external fun getMetrics(reset: Boolean): String
+
+    // Native benchmark over the grid profiles x threads x promptTokens x
+    // batchSizes on the loaded model; blocks generation while it runs. JSON:
+    // load_ms and per configuration prefill/decode tok/s, TTFT and ITL
+    // percentiles. With profiles, each result carries the profile (kv_mb)
+    // and, after the first profile, its quality against it (kl,
+    // greedy_match); batch size 0 then means the profile's own.
+    external fun runBenchmark(
+        threads: IntArray,
+        promptTokens: IntArray,
+        batchSizes: IntArray,
+        genTokens: Int,
+        reps: Int,
+        profiles: Array<String>?
+    ): String
+
+    // IMPORTANT: JNI returns JSON STRING, not LlamaResult.
+    // "generated" is a token count, "duration_ms" the native request time.
     external fun generateWithStats(text: String): String
 
     data class BenchmarkConfig(
@@ -63,8 +646,6 @@ object LlamaBridge {
             onLog("---- Pass ${pass + 1} ----")
             onLog(formatConfigLine(config))
 
-            val start = System.nanoTime()
-
             val jsonString = try {
                 generateWithStats(prompt)
             } catch (e: Throwable) {
@@ -73,8 +654,6 @@ object LlamaBridge {
                 return@repeat
             }
 
-            val elapsedMs = (System.nanoTime() - start) / 1_000_000.0
-
             val result = try {
                 JSONObject(jsonString)
             } catch (e: Throwable) {
@@ -90,7 +669,8 @@ object LlamaBridge {
                 return@repeat
             }
 
-            val tps = tokens / (elapsedMs / 1000.0)
+            val elapsedMs = result.optDouble("duration_ms", 0.0)
+            val tps = if (elapsedMs > 0) tokens / (elapsedMs / 1000.0) else 0.0
             onLog("Tokens/sec: ${"%.2f".format(tps)}")
 
             if (tps > bestSpeed) {
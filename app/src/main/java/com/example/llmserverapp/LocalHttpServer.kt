@@ -2,9 +2,15 @@ package com.example.llmserverapp
 
 import com.example.llmserverapp.core.logging.LogBuffer
 import fi.iki.elonen.NanoHTTPD
+import org.json.JSONArray
 import org.json.JSONObject
 import android.util.Base64
+import com.example.llmserverapp.core.models.ModelManager
+import com.example.llmserverapp.core.models.ModelStatus
 import com.example.llmserverapp.core.models.ModelType
+import java.io.IOException
+import java.io.PipedInputStream
+import java.io.PipedOutputStream
 
 class LocalHttpServer(port: Int) : NanoHTTPD("0.0.0.0", port) {
 
@@ -44,6 +50,47 @@ class LocalHttpServer(port: Int) : NanoHTTPD("0.0.0.0", port) {
                 newFixedLengthResponse(logs)
             }
 
+            // -----------------------------
+            // NATIVE METRICS (?reset=1 clears them after the snapshot)
+            // -----------------------------
+            "/metrics" -> {
+                val reset = session.parameters["reset"]?.firstOrNull() == "1"
+                newFixedLengthResponse(
+                    Response.Status.OK,
+                    "application/json",
+                    LlamaBridge.getMetrics(reset)
+                )
+            }
+
+            // -----------------------------
+            // LLM: downloaded models with their GGUF metadata
+            // -----------------------------
+            "/v1/models" -> {
+                val data = JSONArray()
+                ModelManager.models.value
+                    .filter { it.type == ModelType.Llama && it.info != null }
+                    .forEach { model ->
+                        val info = model.info!!
+                        data.put(
+                            JSONObject()
+                                .put("id", model.id)
+                                .put("name", model.prettyName)
+                                .put("loaded", model.status == ModelStatus.Loaded)
+                                .put("architecture", info.architecture)
+                                .put("parameters", info.parameters)
+                                .put("quantization", info.quantization)
+                                .put("context_length", info.contextLength)
+                                .put("has_chat_template", info.chatTemplate != null)
+                                .put("size_bytes", model.sizeBytes)
+                        )
+                    }
+                newFixedLengthResponse(
+                    Response.Status.OK,
+                    "application/json",
+                    JSONObject().put("object", "list").put("data", data).toString()
+                )
+            }
+
             // -----------------------------
             // LLM: /v1/chat/completions
             // -----------------------------
@@ -60,22 +107,75 @@ class LocalHttpServer(port: Int) : NanoHTTPD("0.0.0.0", port) {
                 }
 
                 val cfg = ServerController.settings.value
+
+                // Clients may pick their own id to cancel via /v1/cancel, below
+                // the range of server-generated ones
+                val clientId = json.optLong("request_id", 0L)
+                if (clientId != 0L && !LlamaBridge.isClientRequestId(clientId)) {
+                    return newFixedLengthResponse("Error: request_id must be in [1, 2^62)")
+                }
+                val requestId = clientId.takeIf { it > 0 } ?: LlamaBridge.newRequestId()
+                val timeoutMs = json.optInt("timeout_ms", cfg.requestTimeoutMs)
+                val tokenBudget = json.optInt("token_budget", 0)
+                val grammar = try {
+                    requestGrammar(json)
+                } catch (e: Exception) {
+                    return newFixedLengthResponse("Error: invalid json_schema: ${e.message}")
+                }
+                val lora = json.optString("lora", "").takeIf { it.isNotBlank() }
+
+                if (json.optBoolean("stream", false)) {
+                    return streamCompletion(session.uri, prompt, cfg, requestId, timeoutMs, grammar, lora)
+                }
+
+                val n = json.optInt("n", 1)
+                val bestOf = json.optInt("best_of", n)
+                if (n > 1 || bestOf > 1) {
+                    return choicesCompletion(
+                        session.uri, prompt, cfg, n, bestOf, requestId, timeoutMs, tokenBudget, grammar, lora
+                    )
+                }
+
                 val start = System.currentTimeMillis()
 
+                val sessionId = json.optLong("session", 0L)
+                val stats = IntArray(1)
+
                 val result: String = try {
-                    LlamaBridge.generate(
-                        prompt,
-                        cfg.temperature,
-                        cfg.maxTokens,
-                        cfg.threads
-                    )
+                    if (sessionId > 0) {
+                        LlamaBridge.generateInSession(
+                            sessionId,
+                            prompt,
+                            cfg.temperature,
+                            cfg.maxTokens,
+                            requestId,
+                            timeoutMs,
+                            tokenBudget,
+                            grammar,
+                            stats
+                        )
+                    } else {
+                        LlamaBridge.generateUtf8(
+                            prompt,
+                            cfg.temperature,
+                            cfg.maxTokens,
+                            cfg.threads,
+                            json.optBoolean("prompt_lookup", false),
+                            requestId,
+                            timeoutMs,
+                            tokenBudget,
+                            grammar,
+                            lora,
+                            stats
+                        )
+                    }
                 } catch (e: Exception) {
                     LogBuffer.error("LLM generation failed: ${e.message}", "MODEL")
                     return newFixedLengthResponse("Error: ${e.message}")
                 }
 
                 val durationMs = System.currentTimeMillis() - start
-                val tokens = result.length
+                val tokens = stats[0]
                 val tps = if (durationMs > 0) tokens / (durationMs / 1000f) else 0f
 
                 ServerController.updateMetrics(tps, durationMs, tokens)
@@ -88,6 +188,7 @@ class LocalHttpServer(port: Int) : NanoHTTPD("0.0.0.0", port) {
                 )
 
                 val responseJson = JSONObject().apply {
+                    put("request_id", requestId)
                     put("text", result)
                     put("generated", tokens)
                     put("duration_ms", durationMs)
@@ -97,6 +198,130 @@ class LocalHttpServer(port: Int) : NanoHTTPD("0.0.0.0", port) {
                 return newFixedLengthResponse(responseJson.toString())
             }
 
+            // -----------------------------
+            // LLM: embeddings, "input" is a string or an array of strings
+            // -----------------------------
+            "/v1/embeddings" -> {
+                if (postBody == null) {
+                    return newFixedLengthResponse("Missing POST body")
+                }
+                val json = JSONObject(postBody)
+                val texts = json.optJSONArray("input")?.let { arr ->
+                    List(arr.length()) { arr.getString(it) }
+                } ?: listOf(json.optString("input", ""))
+                val (vectors, dim) = try {
+                    LlamaBridge.embedTexts(texts, json.optBoolean("normalize", true))
+                } catch (e: Exception) {
+                    LogBuffer.error("Embedding failed: ${e.message}", "MODEL")
+                    return newFixedLengthResponse("Error: ${e.message}")
+                }
+                val data = JSONArray()
+                for (i in texts.indices) {
+                    val embedding = JSONArray()
+                    for (k in 0 until dim) embedding.put(vectors.get(i * dim + k).toDouble())
+                    data.put(JSONObject().put("index", i).put("embedding", embedding))
+                }
+                newFixedLengthResponse(
+                    Response.Status.OK,
+                    "application/json",
+                    JSONObject().put("object", "list").put("data", data).toString()
+                )
+            }
+
+            // -----------------------------
+            // LLM: many independent prompts in one call, {"prompts": [...]}
+            // -----------------------------
+            "/v1/batch" -> {
+                if (postBody == null) {
+                    return newFixedLengthResponse("Missing POST body")
+                }
+                val json = JSONObject(postBody)
+                val prompts = json.optJSONArray("prompts")
+                    ?.let { arr -> Array(arr.length()) { arr.getString(it) } }
+                    ?: return newFixedLengthResponse("Missing prompts")
+                val cfg = ServerController.settings.value
+                val grammar = try {
+                    requestGrammar(json)
+                } catch (e: Exception) {
+                    return newFixedLengthResponse("Error: invalid json_schema: ${e.message}")
+                }
+                val start = System.currentTimeMillis()
+                val stats = IntArray(1)
+                val results = try {
+                    LlamaBridge.generateBatch(
+                        prompts,
+                        cfg.temperature,
+                        json.optInt("max_tokens", cfg.maxTokens),
+                        json.optInt("max_concurrent", cfg.parallelSlots),
+                        json.optInt("timeout_ms", 0),
+                        grammar,
+                        json.optString("lora", "").takeIf { it.isNotBlank() },
+                        stats
+                    )
+                } catch (e: Exception) {
+                    LogBuffer.error("Batch generation failed: ${e.message}", "MODEL")
+                    return newFixedLengthResponse("Error: ${e.message}")
+                }
+                ServerController.addRequest(
+                    ServerController.RequestInfo(
+                        path = session.uri,
+                        tokens = stats[0],
+                        durationMs = System.currentTimeMillis() - start
+                    )
+                )
+                newFixedLengthResponse(
+                    Response.Status.OK,
+                    "application/json",
+                    JSONObject().put("results", JSONArray(results.toList())).toString()
+                )
+            }
+
+            // -----------------------------
+            // LLM: cancel a queued or running completion
+            // -----------------------------
+            "/v1/cancel" -> {
+                val id = postBody?.let { JSONObject(it).optLong("request_id", 0L) } ?: 0L
+                val cancelled = id > 0 && LlamaBridge.cancelRequest(id)
+                newFixedLengthResponse(JSONObject().put("cancelled", cancelled).toString())
+            }
+
+            // -----------------------------
+            // LLM: LoRA adapters. POST {name, path, scale} registers,
+            // {name, remove: true} unregisters; GET lists them with stats.
+            // -----------------------------
+            "/v1/lora" -> {
+                if (postBody == null) {
+                    return newFixedLengthResponse(LlamaBridge.getLoraStats())
+                }
+                val json = JSONObject(postBody)
+                val name = json.optString("name", "")
+                if (json.optBoolean("remove", false)) {
+                    val removed = LlamaBridge.unregisterLora(name)
+                    return newFixedLengthResponse(JSONObject().put("removed", removed).toString())
+                }
+                newFixedLengthResponse(
+                    LlamaBridge.registerLora(
+                        name,
+                        json.optString("path", ""),
+                        json.optDouble("scale", 1.0).toFloat()
+                    )
+                )
+            }
+
+            // -----------------------------
+            // LLM: chat sessions
+            // -----------------------------
+            "/v1/sessions" -> {
+                val id = LlamaBridge.createSession()
+                newFixedLengthResponse(JSONObject().put("session", id).toString())
+            }
+
+            "/v1/sessions/close" -> {
+                val id = postBody?.let { JSONObject(it).optLong("session", 0L) } ?: 0L
+                val closed = id > 0 && LlamaBridge.closeSession(id)
+                newFixedLengthResponse(JSONObject().put("closed", closed).toString())
+            }
+
             // -----------------------------
             // SD: /v1/images/generations
             // -----------------------------
@@ -181,4 +406,131 @@ class LocalHttpServer(port: Int) : NanoHTTPD("0.0.0.0", port) {
             else -> newFixedLengthResponse("unknown endpoint")
         }
     }
+
+    // Output constraint of a completion request, as GBNF: "grammar" as is,
+    // "json_schema" or response_format json_schema converted, response_format
+    // json_object as any JSON object. Null for free text.
+    private fun requestGrammar(json: JSONObject): String? {
+        json.optString("grammar", "").takeIf { it.isNotBlank() }?.let { return it }
+        json.optJSONObject("json_schema")?.let { return JsonGrammar.fromSchema(it) }
+        val format = json.optJSONObject("response_format") ?: return null
+        return when (format.optString("type")) {
+            "json_object" -> format.optJSONObject("schema")?.let { JsonGrammar.fromSchema(it) }
+                ?: JsonGrammar.JSON_OBJECT
+            "json_schema" -> {
+                val schema = format.optJSONObject("json_schema")?.optJSONObject("schema")
+                    ?: format.optJSONObject("schema")
+                    ?: throw IllegalArgumentException("missing schema")
+                JsonGrammar.fromSchema(schema)
+            }
+            else -> null
+        }
+    }
+
+    // Several completions of one prompt in a single native call
+    private fun choicesCompletion(
+        uri: String,
+        prompt: String,
+        cfg: ServerController.ServerSettings,
+        n: Int,
+        bestOf: Int,
+        requestId: Long,
+        timeoutMs: Int,
+        tokenBudget: Int,
+        grammar: String?,
+        lora: String?
+    ): Response {
+        val result = try {
+            JSONObject(
+                LlamaBridge.generateChoices(
+                    prompt,
+                    cfg.temperature,
+                    cfg.maxTokens,
+                    n,
+                    bestOf,
+                    requestId,
+                    timeoutMs,
+                    tokenBudget,
+                    grammar,
+                    lora
+                )
+            )
+        } catch (e: Exception) {
+            LogBuffer.error("LLM generation failed: ${e.message}", "MODEL")
+            return newFixedLengthResponse("Error: ${e.message}")
+        }
+        if (result.has("error")) {
+            return newFixedLengthResponse("Error: ${result.getString("error")}")
+        }
+
+        val durationMs = result.optDouble("duration_ms", 0.0).toLong()
+        val tokens = result.optInt("generated", 0)
+        val tps = if (durationMs > 0) tokens / (durationMs / 1000f) else 0f
+        ServerController.updateMetrics(tps, durationMs, tokens)
+        ServerController.addRequest(
+            ServerController.RequestInfo(path = uri, tokens = tokens, durationMs = durationMs)
+        )
+
+        val choices = result.getJSONArray("choices")
+        result.put("request_id", requestId)
+        result.put("text", choices.getJSONObject(0).getString("text"))
+        result.put("tokens_per_sec", tps)
+        return newFixedLengthResponse(result.toString())
+    }
+
+    // -----------------------------
+    // Server-sent events: one "data:" event per streamed chunk
+    // -----------------------------
+    private fun streamCompletion(
+        path: String,
+        prompt: String,
+        cfg: ServerController.ServerSettings,
+        requestId: Long,
+        timeoutMs: Int,
+        grammar: String?,
+        lora: String?
+    ): Response {
+        val input = PipedInputStream(16 * 1024)
+        val output = PipedOutputStream(input)
+
+        Thread {
+            val start = System.currentTimeMillis()
+            var tokens = 0
+            try {
+                tokens = LlamaBridge.runInference(
+                    prompt, cfg.temperature, cfg.maxTokens, requestId, timeoutMs, grammar, lora
+                ) { piece ->
+                    val event = JSONObject().put("text", piece)
+                    output.write("data: $event\n\n".toByteArray())
+                    output.flush()
+                }
+                output.write("data: [DONE]\n\n".toByteArray())
+            } catch (e: IOException) {
+                LogBuffer.info("Stream client disconnected", tag = "HTTP")
+            } catch (e: Exception) {
+                LogBuffer.error("LLM streaming failed: ${e.message}", "MODEL")
+            } finally {
+                try {
+                    output.close()
+                } catch (e: IOException) {
+                    // Client already gone
+                }
+            }
+
+            val durationMs = System.currentTimeMillis() - start
+            val tps = if (durationMs > 0) tokens / (durationMs / 1000f) else 0f
+            ServerController.updateMetrics(tps, durationMs, tokens)
+            ServerController.addRequest(
+                ServerController.RequestInfo(
+                    path = path,
+                    tokens = tokens,
+                    durationMs = durationMs
+                )
+            )
+        }.start()
+
+        return newChunkedResponse(Response.Status.OK, "text/event-stream", input).apply {
+            addHeader("X-Request-Id", requestId.toString())
+        }
+    }
 }
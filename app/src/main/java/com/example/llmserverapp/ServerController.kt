@@ -59,7 +59,19 @@ object ServerController {
         val maxTokens: Int = 256,
         val temperature: Float = 0.7f,
         val threads: Int = 4,
-        val contextLength: Int = 2048
+        val batchThreads: Int = 4,
+        val draftModelId: String? = null,
+        val draftTokens: Int = 4,
+        val promptCacheMb: Int = 512,
+        val sessionPagingMb: Int = 256,
+        val requestTimeoutMs: Int = 120_000,
+        val contextShiftSink: Int = 4,
+        val prefetchWeights: Boolean = true,
+        val mlockWeights: Boolean = false,
+        val warmupOnLoad: Boolean = true,
+        val contextProfile: String = "default",
+        val contextLength: Int = 2048,
+        val parallelSlots: Int = 4
     )
 
     private val _settings = MutableStateFlow(ServerSettings())
@@ -79,9 +91,77 @@ object ServerController {
 
     fun updateThreads(newThreads: Int) {
         _settings.value = _settings.value.copy(threads = newThreads)
-        if (isRunning.value) {
-            stopServer()
-            startServer()
+        applyThreads()
+    }
+
+    fun updateBatchThreads(newThreads: Int) {
+        _settings.value = _settings.value.copy(batchThreads = newThreads)
+        applyThreads()
+    }
+
+    // Tokens kept by context shifts; -1 disables shifting
+    fun updateContextShift(nSink: Int) {
+        _settings.value = _settings.value.copy(contextShiftSink = nSink)
+        try {
+            LlamaBridge.setContextShift(nSink)
+        } catch (e: Throwable) {
+            LogBuffer.error("Failed to apply context shift: ${e.message}", tag = "MODEL")
+        }
+    }
+
+    // Cold start options; take effect on the next model load
+    fun updateStartup(prefetch: Boolean, mlock: Boolean, warmup: Boolean) {
+        _settings.value = _settings.value.copy(
+            prefetchWeights = prefetch,
+            mlockWeights = mlock,
+            warmupOnLoad = warmup
+        )
+    }
+
+    // Context profile (KV cache types, flash attention, n_ctx); takes effect
+    // on the next model load
+    fun updateContextProfile(name: String) {
+        _settings.value = _settings.value.copy(contextProfile = name)
+    }
+
+    // Sequences decoded together (generateBatch concurrency); takes effect
+    // on the next model load
+    fun updateParallelSlots(n: Int) {
+        _settings.value = _settings.value.copy(parallelSlots = n)
+    }
+
+    // Context length of the loaded model, as reported by the native side
+    fun setContextLength(nCtx: Int) {
+        _settings.value = _settings.value.copy(contextLength = nCtx)
+    }
+
+    // Default deadline of HTTP requests; 0 disables
+    fun updateRequestTimeout(ms: Int) {
+        _settings.value = _settings.value.copy(requestTimeoutMs = ms)
+    }
+
+    // Takes effect on the next model load
+    fun updateDraftModel(id: String?) {
+        _settings.value = _settings.value.copy(draftModelId = id)
+    }
+
+    fun updateDraftTokens(n: Int) {
+        _settings.value = _settings.value.copy(draftTokens = n)
+        try {
+            LlamaBridge.setSpeculative(n)
+        } catch (e: Throwable) {
+            LogBuffer.error("Failed to apply draft tokens: ${e.message}", tag = "MODEL")
+        }
+    }
+
+    // Thread counts are a live setting of the loaded context
+    fun applyThreads() {
+        if (llmModelPath == null) return
+        val s = _settings.value
+        try {
+            LlamaBridge.setThreads(s.threads, s.batchThreads)
+        } catch (e: Throwable) {
+            LogBuffer.error("Failed to apply threads: ${e.message}", tag = "MODEL")
         }
     }
 
@@ -197,12 +277,15 @@ object ServerController {
 
         LogBuffer.info("HTTP Server Stopped", tag = "SERVER")
 
-        try {
-            LlamaBridge.unloadModel()
-            StableDiffusionBridge.sdUnloadModel()
-            ModelManager.unloadModel()
-        } catch (e: Exception) {
-            LogBuffer.error("Failed to unload models: ${e.message}", tag = "MODEL")
+        // Unloading waits for requests in flight (and the LLaMA unload for a
+        // staged load), so never on the caller's thread, usually the UI's
+        ModelManager.unloadModel()
+        AppScope.io.launch {
+            try {
+                StableDiffusionBridge.sdUnloadModel()
+            } catch (e: Exception) {
+                LogBuffer.error("Failed to unload models: ${e.message}", tag = "MODEL")
+            }
         }
 
         llmModelPath = null
@@ -0,0 +1,39 @@
+package com.example.llmserverapp.core.models
+
+import org.json.JSONObject
+
+// What a downloaded GGUF model is, read from its header (LlamaBridge.inspectModel)
+data class GgufInfo(
+    val architecture: String,
+    val name: String,
+    val parameters: Long,
+    val quantization: String,
+    val contextLength: Int,
+    val chatTemplate: String?,
+    val tensorBytes: Long
+) {
+    // e.g. "llama · 1.1B · Q4_K_M · 2048 ctx"
+    val summary: String
+        get() = listOf(
+            architecture,
+            if (parameters >= 1_000_000_000L) "%.1fB".format(parameters / 1e9)
+            else "%.0fM".format(parameters / 1e6),
+            quantization,
+            "$contextLength ctx"
+        ).joinToString(" · ")
+
+    companion object {
+        fun fromJson(json: JSONObject): GgufInfo? {
+            if (json.has("error")) return null
+            return GgufInfo(
+                architecture = json.getString("architecture"),
+                name = json.optString("name", ""),
+                parameters = json.optLong("parameters", 0L),
+                quantization = json.optString("quantization", ""),
+                contextLength = json.optInt("context_length", 0),
+                chatTemplate = if (json.isNull("chat_template")) null else json.getString("chat_template"),
+                tensorBytes = json.optLong("tensor_bytes", 0L)
+            )
+        }
+    }
+}
@@ -24,6 +24,8 @@ import kotlinx.coroutines.launch
 import java.io.File
 import java.io.FileOutputStream
 import java.net.URL
+import java.util.concurrent.atomic.AtomicLong
+import org.json.JSONObject
 
 data class ModelFile(
     val name: String,
@@ -62,7 +64,9 @@ data class ModelDescriptor(
     val status: ModelStatus,
     val progress: Float? = null,
     val sizeBytes: Long,
-    val type: ModelType
+    val type: ModelType,
+    val info: GgufInfo? = null,  // LLaMA models, once downloaded
+    val error: String? = null    // why the last load failed, with status Failed
 )
 
 object ModelManager {
@@ -75,6 +79,11 @@ object ModelManager {
     private var loadedModelId: String? = null
     private var didInitialRefresh = false
 
+    // Bumped by each LLaMA load and unload; a load only publishes its result
+    // if nothing came after it. Checked and published under loadLock.
+    private val loadGeneration = AtomicLong(0)
+    private val loadLock = Any()
+
     private val modelEntries = mutableListOf<ModelEntry>()
 
     private val notificationJobs = mutableMapOf<String, Job>()
@@ -116,6 +125,26 @@ object ModelManager {
     fun getModelDir(id: String): File =
         File(ServerController.appContext.filesDir, "models/$id")
 
+    private fun typeOf(entry: ModelEntry): ModelType = when (entry.type.lowercase()) {
+        "llama" -> ModelType.Llama
+        "sd", "stablediffusion" -> ModelType.StableDiffusion
+        else -> ModelType.Llama
+    }
+
+    // Header metadata of a downloaded LLaMA model; served from the native
+    // index unless the file changed, so no load is needed. Null if the file
+    // is missing or not a usable GGUF.
+    private fun inspectLlamaModel(entry: ModelEntry): GgufInfo? {
+        val file = File(getModelDir(entry.id), entry.files.firstOrNull()?.name ?: return null)
+        if (!file.exists()) return null
+        LlamaBridge.setModelIndex(File(ServerController.appContext.filesDir, "gguf_index.bin").absolutePath)
+        val json = JSONObject(LlamaBridge.inspectModel(file.absolutePath))
+        if (json.has("error")) {
+            LogBuffer.error("${file.name}: ${json.getString("error")}", tag = "MODEL")
+        }
+        return GgufInfo.fromJson(json)
+    }
+
     fun prettySize(bytes: Long): String {
         val kb = 1024L
         val mb = kb * 1024
@@ -150,7 +179,13 @@ object ModelManager {
                 prompt,
                 s.temperature,
                 s.maxTokens,
-                s.threads
+                s.threads,
+                false,
+                LlamaBridge.newRequestId(),
+                s.requestTimeoutMs,
+                0,
+                null,
+                null
             )
         } catch (e: Exception) {
             "Inference failed: ${e.message}"
@@ -190,11 +225,7 @@ object ModelManager {
                     if (f.exists()) f.length() else mf.size
                 }
 
-                val type = when (entry.type.lowercase()) {
-                    "llama" -> ModelType.Llama
-                    "sd", "stablediffusion" -> ModelType.StableDiffusion
-                    else -> ModelType.Llama
-                }
+                val type = typeOf(entry)
 
                 ModelDescriptor(
                     id = entry.id,
@@ -204,7 +235,8 @@ object ModelManager {
                     localPath = dir.absolutePath,
                     status = status,
                     sizeBytes = sizeBytes,
-                    type = type
+                    type = type,
+                    info = if (type == ModelType.Llama && allFilesExist) inspectLlamaModel(entry) else null
                 )
             }
 
@@ -229,10 +261,11 @@ object ModelManager {
             stopNotificationLoop(entry.id)
             DownloadProgressBus.clear(entry.id)
 
+            val info = if (typeOf(entry) == ModelType.Llama) inspectLlamaModel(entry) else null
             _models.update { list ->
                 list.map {
                     if (it.id == entry.id)
-                        it.copy(status = ModelStatus.Downloaded, progress = 1f)
+                        it.copy(status = ModelStatus.Downloaded, progress = 1f, info = info)
                     else it
                 }
             }
@@ -415,18 +448,85 @@ object ModelManager {
                     LogBuffer.error("Model file missing: ${modelFile.absolutePath}", tag = "MODEL")
                     return
                 }
+                // Hot swap: the current model keeps serving while the new
+                // one loads in the background
+                val generation = loadGeneration.incrementAndGet()
+                scope.launch {
+                    // Checked from the header, before committing to a full
+                    // load; on an index miss that parses the tokenizer arrays,
+                    // so not on the caller's thread
+                    val info = inspectLlamaModel(entry)
+                    if (info == null) {
+                        markFailed(id, "Not a readable GGUF file")
+                        return@launch
+                    }
+                    LogBuffer.info("Loading ${descriptor.prettyName}: ${info.summary}", tag = "MODEL")
+
+                    LlamaBridge.setPromptCache(
+                        File(ServerController.appContext.filesDir, "prompt_cache").absolutePath,
+                        settings.value.promptCacheMb
+                    )
+                    val draftFile = resolveDraftFile(id)
+                    settings.value.let {
+                        LlamaBridge.setStartupOptions(it.prefetchWeights, it.mlockWeights, it.warmupOnLoad)
+                        LlamaBridge.setParallelSlots(it.parallelSlots)
+                        if (!LlamaBridge.setContextProfile(it.contextProfile, 0)) {
+                            LogBuffer.error("Unknown context profile ${it.contextProfile}", tag = "MODEL")
+                        }
+                    }
+                    val progressJob = launch {
+                        var lastDecile = -1
+                        while (isActive) {
+                            val decile = (LlamaBridge.getLoadProgress() * 10).toInt()
+                            if (decile != lastDecile) {
+                                LogBuffer.info("Loading ${descriptor.prettyName}: ${decile * 10}%", tag = "MODEL")
+                                lastDecile = decile
+                            }
+                            delay(250)
+                        }
+                    }
+                    val result = try {
+                        LlamaBridge.swapModel(
+                            modelFile.absolutePath,
+                            settings.value.threads,
+                            draftFile?.absolutePath
+                        )
+                    } finally {
+                        progressJob.cancel()
+                    }
+                    synchronized(loadLock) {
+                        if (loadGeneration.get() != generation) {
+                            LogBuffer.info("Load of ${descriptor.prettyName} superseded", tag = "MODEL")
+                            return@launch
+                        }
+                        if (result == 0L) {
+                            LogBuffer.error("Native swapModel returned 0", tag = "MODEL")
+                            markFailed(id, "Load failed")
+                            return@launch
+                        }
+                        loadedModelId = id
+                        ServerController.modelPath = modelFile.absolutePath
+                        ServerController.setLoadedModel(descriptor.prettyName)
+                        markLoaded(id, descriptor.type)
+                    }
 
-                val result = LlamaBridge.loadModel(modelFile.absolutePath, settings.value.threads)
-                if (result == 0L) {
-                    LogBuffer.error("Native loadModel returned 0", tag = "MODEL")
-                    return
+                    ServerController.applyThreads()
+                    LlamaBridge.setSpeculative(settings.value.draftTokens)
+                    LlamaBridge.setSessionPaging(settings.value.sessionPagingMb)
+                    LlamaBridge.setContextShift(settings.value.contextShiftSink)
+
+                    ModelNotificationManager.cancel(id)
+                    LogBuffer.info("Startup: ${LlamaBridge.getStartupStats()}", tag = "MODEL")
+                    LogBuffer.info(
+                        "Chat template: ${JSONObject(LlamaBridge.getChatTemplate()).getString("source")}",
+                        tag = "MODEL"
+                    )
+                    JSONObject(LlamaBridge.getContextProfiles()).optJSONObject("active")?.let {
+                        ServerController.setContextLength(it.getInt("n_ctx"))
+                        LogBuffer.info("Context profile: $it", tag = "MODEL")
+                    }
                 }
-
-                loadedModelId = id
-                ServerController.modelPath = modelFile.absolutePath
-                ServerController.setLoadedModel(descriptor.prettyName)
-
-                ModelNotificationManager.cancel(id)
+                return
             }
 
             ModelType.StableDiffusion -> {
@@ -449,11 +549,24 @@ object ModelManager {
             }
         }
 
+        markLoaded(id, descriptor.type)
+    }
+
+    // Shown on the model until the next refresh (Retry)
+    private fun markFailed(id: String, reason: String) {
+        _models.update { list ->
+            list.map {
+                if (it.id == id) it.copy(status = ModelStatus.Failed, error = reason) else it
+            }
+        }
+    }
+
+    private fun markLoaded(id: String, type: ModelType) {
         _models.update { list ->
             list.map {
                 when {
                     it.id == id -> it.copy(status = ModelStatus.Loaded)
-                    it.status == ModelStatus.Loaded && it.type == descriptor.type ->
+                    it.status == ModelStatus.Loaded && it.type == type ->
                         it.copy(status = ModelStatus.Downloaded)
                     else -> it
                 }
@@ -461,6 +574,19 @@ object ModelManager {
         }
     }
 
+    // Downloaded file of the configured draft model, if any
+    private fun resolveDraftFile(targetId: String): File? {
+        val draftId = settings.value.draftModelId ?: return null
+        if (draftId == targetId) return null
+        val entry = modelEntries.firstOrNull { it.id == draftId } ?: return null
+        val file = File(getModelDir(draftId), entry.files.firstOrNull()?.name ?: return null)
+        if (!file.exists()) {
+            LogBuffer.error("Draft model file missing: ${file.absolutePath}", tag = "MODEL")
+            return null
+        }
+        return file
+    }
+
     fun runBenchmark() {
         val loaded = _models.value.firstOrNull {
             it.status == ModelStatus.Loaded && it.type == ModelType.Llama
@@ -481,26 +607,35 @@ object ModelManager {
         }
     }
 
+    // Returns at once: the native unload waits for requests in flight. A
+    // load still in progress is abandoned and does not mark its model loaded.
     fun unloadModel() {
+        val generation = loadGeneration.incrementAndGet()
         LogBuffer.info("Unloading model…", tag = "MODEL")
 
-        try {
-            LlamaBridge.unloadModel()
-        } catch (e: Exception) {
-            LogBuffer.error("Native unloadModel failed: ${e.message}", tag = "MODEL")
-        }
+        scope.launch {
+            try {
+                LlamaBridge.unloadModel()
+            } catch (e: Exception) {
+                LogBuffer.error("Native unloadModel failed: ${e.message}", tag = "MODEL")
+            }
 
-        loadedModelId = null
-        ServerController.modelPath = null
+            synchronized(loadLock) {
+                // A load started after this unload owns the state now
+                if (loadGeneration.get() != generation) return@launch
+                loadedModelId = null
+                ServerController.modelPath = null
 
-        _models.update { list ->
-            list.map {
-                if (it.status == ModelStatus.Loaded && it.type == ModelType.Llama)
-                    it.copy(status = ModelStatus.Downloaded)
-                else it
+                _models.update { list ->
+                    list.map {
+                        if (it.status == ModelStatus.Loaded && it.type == ModelType.Llama)
+                            it.copy(status = ModelStatus.Downloaded)
+                        else it
+                    }
+                }
             }
-        }
 
-        LogBuffer.info("Model unloaded ✓", tag = "MODEL")
+            LogBuffer.info("Model unloaded ✓", tag = "MODEL")
+        }
     }
 }
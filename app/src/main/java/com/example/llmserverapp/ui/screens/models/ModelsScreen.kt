@@ -224,6 +224,12 @@ fun DownloadModelRow(model: ModelDescriptor) {
         Column {
             Text(model.prettyName, style = MaterialTheme.typography.titleMedium)
             Text(prettySize(model.sizeBytes), color = Color.Gray)
+            model.info?.let {
+                Text(it.summary, style = MaterialTheme.typography.labelSmall, color = Color.Gray)
+            }
+            model.error?.let {
+                Text(it, style = MaterialTheme.typography.labelSmall, color = Color.Red)
+            }
 
             if (model.status == ModelStatus.Downloading && model.progress != null) {
                 Text(
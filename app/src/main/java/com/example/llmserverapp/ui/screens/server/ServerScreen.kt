@@ -27,6 +27,7 @@ import androidx.compose.material3.ExperimentalMaterial3Api
 import androidx.compose.material3.Icon
 import androidx.compose.material3.MaterialTheme
 import androidx.compose.material3.ModalBottomSheet
+import androidx.compose.material3.Switch
 import androidx.compose.material3.Text
 import androidx.compose.material3.TextButton
 import androidx.compose.material3.TextField
@@ -60,6 +61,7 @@ fun ServerScreen() {
     var maxTokensText by remember { mutableStateOf(settings.maxTokens.toString()) }
     var temperatureText by remember { mutableStateOf(settings.temperature.toString()) }
     var threadsText by remember { mutableStateOf(settings.threads.toString()) }
+    var batchThreadsText by remember { mutableStateOf(settings.batchThreads.toString()) }
 
     // -------------------------
     // Block Outline
@@ -520,10 +522,74 @@ fun ServerScreen() {
             )
         }
 
+        Row(
+            modifier = Modifier
+                .fillMaxWidth(),
+            horizontalArrangement = Arrangement.SpaceBetween
+        ) {
+            Text("Batch Threads")
+            ThinNumberField(
+                value = batchThreadsText,
+                onValueChange = { new ->
+                    batchThreadsText = new
+                    new.toIntOrNull()?.let {
+                        ServerController.updateBatchThreads(it)
+                    }
+                },
+                onNumberCommit = { ServerController.updateBatchThreads(it) }
+            )
+        }
+
+        // Cold start options, applied on the next model load
+        Row(
+            modifier = Modifier
+                .fillMaxWidth(),
+            horizontalArrangement = Arrangement.SpaceBetween,
+            verticalAlignment = Alignment.CenterVertically
+        ) {
+            Text("Prefetch Weights")
+            Switch(
+                checked = settings.prefetchWeights,
+                onCheckedChange = {
+                    ServerController.updateStartup(it, settings.mlockWeights, settings.warmupOnLoad)
+                }
+            )
+        }
+
+        Row(
+            modifier = Modifier
+                .fillMaxWidth(),
+            horizontalArrangement = Arrangement.SpaceBetween,
+            verticalAlignment = Alignment.CenterVertically
+        ) {
+            Text("Lock Weights in RAM")
+            Switch(
+                checked = settings.mlockWeights,
+                onCheckedChange = {
+                    ServerController.updateStartup(settings.prefetchWeights, it, settings.warmupOnLoad)
+                }
+            )
+        }
+
+        Row(
+            modifier = Modifier
+                .fillMaxWidth(),
+            horizontalArrangement = Arrangement.SpaceBetween,
+            verticalAlignment = Alignment.CenterVertically
+        ) {
+            Text("Warm Up on Load")
+            Switch(
+                checked = settings.warmupOnLoad,
+                onCheckedChange = {
+                    ServerController.updateStartup(settings.prefetchWeights, settings.mlockWeights, it)
+                }
+            )
+        }
+
 // Context Length (read‑only)
         ReadOnlyRow(
             label = "Context Length",
-            value = settings.contextLength.toString()
+            value = "${settings.contextLength} (${settings.contextProfile})"
         )
     }
 